@@ -0,0 +1,116 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#include <smart_ptr/detail/hash_table.h>
+
+#include <benchmark/benchmark.h>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+using unordered_map = std::unordered_map< uintptr_t, int64_t >;
+using hash_table = smart_ptr::hash_table< uintptr_t, int64_t >;
+
+// Message stream of a churn-heavy workload: objects are created, copied a few times and released,
+// about range(0) objects are alive at any time. Messages carry the lowest bit for increments.
+static const std::vector< uintptr_t >& get_messages(size_t live)
+{
+    static std::unordered_map< size_t, std::vector< uintptr_t > > cache;
+    auto& messages = cache[live];
+    if (messages.empty())
+    {
+        std::mt19937 random;
+        std::vector< std::pair< uintptr_t, size_t > > objects;
+        uintptr_t address = 0x10000;
+        while (messages.size() < (1 << 20))
+        {
+            if (objects.size() < live)
+            {
+                address += 64 * (1 + random() % 4);
+                objects.emplace_back(address, 1);
+                messages.push_back(address | 1);
+            }
+
+            auto& object = objects[random() % objects.size()];
+            if (random() % 2)
+            {
+                ++object.second;
+                messages.push_back(object.first | 1);
+            }
+            else
+            {
+                messages.push_back(object.first);
+                if (--object.second == 0)
+                {
+                    object = objects.back();
+                    objects.pop_back();
+                }
+            }
+        }
+    }
+
+    return messages;
+}
+
+template < typename Table > static int64_t* find(Table& table, uintptr_t key)
+{
+    if constexpr (std::is_same_v< Table, unordered_map >)
+    {
+        auto it = table.find(key);
+        return it != table.end() ? &it->second : nullptr;
+    }
+    else
+    {
+        return table.find(key);
+    }
+}
+
+// Table operations of collector::drain: increments are applied as they come, decrements one batch later
+template < typename Table > static void drain(benchmark::State& state)
+{
+    auto& messages = get_messages(state.range(0));
+    const size_t batch_size = 1 << 12;
+
+    for (auto _ : state)
+    {
+        Table table;
+        std::vector< uintptr_t > decrements, deferred;
+        for (size_t batch = 0; batch < messages.size(); batch += batch_size)
+        {
+            for (size_t i = batch; i < batch + batch_size && i < messages.size(); ++i)
+            {
+                if (messages[i] & 1)
+                {
+                    ++table[messages[i] & ~uintptr_t(1)];
+                }
+                else
+                {
+                    decrements.push_back(messages[i]);
+                }
+            }
+
+            for (auto key : deferred)
+            {
+                auto refs = find(table, key);
+                if (refs && --*refs <= 0)
+                {
+                    table.erase(key);
+                }
+            }
+
+            deferred.clear();
+            std::swap(deferred, decrements);
+        }
+
+        benchmark::DoNotOptimize(table.size());
+    }
+
+    state.SetItemsProcessed(state.iterations() * messages.size());
+}
+
+BENCHMARK_TEMPLATE(drain, unordered_map)->UseRealTime()->RangeMultiplier(16)->Range(1 << 8, 1 << 16);
+BENCHMARK_TEMPLATE(drain, hash_table)->UseRealTime()->RangeMultiplier(16)->Range(1 << 8, 1 << 16);
@@ -0,0 +1,328 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+// Memory cost of pointer types: bytes per object, per-thread overhead of thread_counter, collector table overhead
+// and peak memory under churn. Global operator new counts heap bytes, peak RSS is read from /proc/self/status.
+
+#include <smart_ptr/shared_ptr.h>
+#include <smart_ptr/detail/shared_counter.h>
+#include <smart_ptr/detail/biased_counter.h>
+#include <smart_ptr/detail/percpu_counter.h>
+#include <smart_ptr/detail/thread_counter.h>
+#include <smart_ptr/detail/thread_cache.h>
+
+#include <benchmark/benchmark.h>
+#include <malloc.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const auto max_threads = std::thread::hardware_concurrency();
+
+// Heap bytes including allocator rounding, as reported by malloc_usable_size
+struct heap_usage
+{
+    std::atomic< int64_t > live;
+    std::atomic< int64_t > peak;
+
+    void allocated(int64_t size)
+    {
+        auto live = this->live.fetch_add(size, std::memory_order_relaxed) + size;
+        auto peak = this->peak.load(std::memory_order_relaxed);
+        while (peak < live && !this->peak.compare_exchange_weak(peak, live, std::memory_order_relaxed));
+    }
+
+    void reset_peak() { peak = live.load(); }
+};
+
+static heap_usage heap;
+
+// Bytes allocated by current thread, frees are not subtracted
+static thread_local uint64_t thread_allocated;
+
+static void* count_allocation(void* ptr)
+{
+    if (!ptr)
+        throw std::bad_alloc();
+
+    auto size = malloc_usable_size(ptr);
+    heap.allocated(size);
+    thread_allocated += size;
+    return ptr;
+}
+
+static void count_free(void* ptr)
+{
+    if (ptr)
+    {
+        heap.live.fetch_sub(malloc_usable_size(ptr), std::memory_order_relaxed);
+        std::free(ptr);
+    }
+}
+
+void* operator new(size_t size) { return count_allocation(std::malloc(size ? size : 1)); }
+void* operator new(size_t size, std::align_val_t alignment) { return count_allocation(std::aligned_alloc((size_t)alignment, (size + (size_t)alignment - 1) & ~((size_t)alignment - 1))); }
+void operator delete(void* ptr) noexcept { count_free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { count_free(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { count_free(ptr); }
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept { count_free(ptr); }
+
+// Value of a /proc/self/status field in kB, -1 if it is not there
+static int64_t read_status(const char* field)
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    auto length = std::strlen(field);
+    while (std::getline(status, line))
+    {
+        if (line.compare(0, length, field) == 0 && line[length] == ':')
+            return std::stoll(line.substr(length + 1));
+    }
+
+    return -1;
+}
+
+// Resets VmHWM to current RSS, returns false on kernels that do not support it
+static bool reset_peak_rss()
+{
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    clear_refs << "5";
+    clear_refs.flush();
+    return clear_refs.good();
+}
+
+// Table operations of the collector are measured through its metrics
+static bool collector_configured = []
+{
+    smart_ptr::collector_options options;
+    options.metrics = true;
+    return smart_ptr::collector::configure(options);
+}();
+
+// Objects released by thread_counter are counted in the collector table until it drains their decrements
+static bool wait_control_blocks(bool (*done)(uint64_t))
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!done(smart_ptr::collector::instance().get_metrics().control_blocks))
+    {
+        if (std::chrono::steady_clock::now() > deadline)
+            return false;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    return true;
+}
+
+template < typename P > struct pointer_traits;
+
+template < typename T > struct pointer_traits< std::shared_ptr< T > >
+{
+    static constexpr bool deferred = false;
+    static std::shared_ptr< T > make(const T& value) { return std::make_shared< T >(value); }
+};
+
+template < typename T, typename Counter > struct pointer_traits< smart_ptr::shared_ptr< T, Counter > >
+{
+    static constexpr bool deferred = Counter::deferred;
+    static smart_ptr::shared_ptr< T, Counter > make(const T& value) { return smart_ptr::make_shared< T, Counter >(value); }
+
+    template < bool Storage > static constexpr size_t control_block_size = sizeof(smart_ptr::control_block< T, Counter, std::allocator< T >,
+        std::conditional_t< Storage, smart_ptr::default_destructor< T >, smart_ptr::default_deleter< T > >, Storage >);
+};
+
+template < typename P > static P make(int value)
+{
+    return pointer_traits< P >::make(value);
+}
+
+template < typename P > static void wait_released()
+{
+    if constexpr (pointer_traits< P >::deferred)
+        wait_control_blocks([](uint64_t blocks) { return blocks == 0; });
+}
+
+using std_shared_ptr = std::shared_ptr< int >;
+using shared_counter = smart_ptr::shared_ptr< int, smart_ptr::shared_counter< uint64_t, true > >;
+using biased_counter = smart_ptr::shared_ptr< int, smart_ptr::biased_counter< uint64_t > >;
+using percpu_counter = smart_ptr::shared_ptr< int, smart_ptr::percpu_counter< uint64_t > >;
+using thread_counter = smart_ptr::shared_ptr< int, smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > > >;
+
+// Heap bytes of an object created by make_shared, and sizes of control blocks holding the object or a pointer to it
+template < typename P > static void bytes_per_object(benchmark::State& state)
+{
+    const size_t count = 1 << 12;
+    std::vector< P > values;
+    values.reserve(count);
+
+    for (auto _ : state)
+    {
+        auto allocated = thread_allocated;
+        for (size_t i = 0; i < count; ++i)
+        {
+            values.push_back(make< P >((int)i));
+        }
+
+        state.counters["heap_bytes"] = (double)(thread_allocated - allocated) / count;
+
+        state.PauseTiming();
+        values.clear();
+        wait_released< P >();
+        state.ResumeTiming();
+    }
+
+    if constexpr (!std::is_same_v< P, std::shared_ptr< int > >)
+    {
+        state.counters["control_block_inline"] = (double)pointer_traits< P >::template control_block_size< true >;
+        state.counters["control_block_pointer"] = (double)pointer_traits< P >::template control_block_size< false >;
+    }
+}
+
+// Fixed cost of a thread using thread_counter: its collector producer with a queue for every shard on the heap
+// and thread local storage of the cache
+template < typename Cache > static void thread_overhead(benchmark::State& state)
+{
+    using pointer = smart_ptr::shared_ptr< int, smart_ptr::thread_counter< uint64_t, Cache > >;
+
+    // Collector allocates its tables on the first use
+    auto& collector = smart_ptr::collector::instance();
+
+    for (auto _ : state)
+    {
+        uint64_t producer = 0;
+        std::thread([&]
+        {
+            // The first pointer of the thread creates its producer, the second one allocates just the block
+            auto allocated = thread_allocated;
+            auto first = make< pointer >(0);
+            auto first_bytes = thread_allocated - allocated;
+
+            allocated = thread_allocated;
+            auto second = make< pointer >(1);
+            producer = first_bytes - (thread_allocated - allocated);
+        }).join();
+
+        state.counters["producer_bytes"] = (double)producer;
+
+        state.PauseTiming();
+        wait_released< pointer >();
+        state.ResumeTiming();
+    }
+
+    state.counters["queue_bytes"] = (double)sizeof(smart_ptr::collector_queue);
+    state.counters["shards"] = (double)collector.get_shard_count();
+    state.counters["thread_cache_bytes"] = (double)Cache::get_local_size();
+}
+
+// Bytes of collector tables per live object once they hold range(0) objects. Tables keep their minimal
+// capacity when empty, so small counts pay for it.
+static void collector_table(benchmark::State& state)
+{
+    using pointer = thread_counter;
+
+    static size_t count;
+    count = state.range(0);
+    std::vector< pointer > values;
+    values.reserve(count);
+
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            values.push_back(make< pointer >((int)i));
+        }
+
+        if (!wait_control_blocks([](uint64_t blocks) { return blocks >= count; }))
+        {
+            state.SkipWithError("collector did not drain");
+            return;
+        }
+
+        state.counters["table_bytes"] = (double)smart_ptr::collector::instance().get_metrics().table_bytes / count;
+
+        state.PauseTiming();
+        values.clear();
+        wait_released< pointer >();
+        state.ResumeTiming();
+    }
+}
+
+// Every thread keeps range(0) objects alive and replaces one of them per item. Peaks are growth over the
+// heap and RSS at the start of the run, RSS peak is process wide.
+template < typename P > static void churn_peak(benchmark::State& state)
+{
+    static std::atomic< int > finished;
+    static int64_t live;
+    static int64_t rss;
+
+    if (state.thread_index() == 0)
+    {
+        finished = 0;
+        if (!reset_peak_rss())
+        {
+            state.SkipWithError("peak RSS can not be reset");
+        }
+
+        heap.reset_peak();
+        live = heap.live.load();
+        rss = read_status("VmRSS");
+    }
+
+    std::vector< P > values(state.range(0));
+    size_t index = 0;
+    for (auto _ : state)
+    {
+        values[index] = make< P >((int)index);
+        if (++index == values.size())
+        {
+            index = 0;
+        }
+    }
+
+    values.clear();
+    ++finished;
+
+    if (state.thread_index() == 0)
+    {
+        while (finished != state.threads())
+        {
+            std::this_thread::yield();
+        }
+
+        state.counters["peak_heap_bytes"] = (double)(heap.peak.load() - live);
+        state.counters["peak_rss_kb"] = (double)(read_status("VmHWM") - rss);
+        wait_released< P >();
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+#define MEMORY(P) \
+    BENCHMARK_TEMPLATE(bytes_per_object, P)->Iterations(1); \
+    BENCHMARK_TEMPLATE(churn_peak, P)->ThreadRange(1, max_threads)->UseRealTime()->RangeMultiplier(16)->Range(1 << 8, 1 << 16);
+
+MEMORY(std_shared_ptr)
+MEMORY(shared_counter)
+MEMORY(biased_counter)
+MEMORY(percpu_counter)
+MEMORY(thread_counter)
+
+using thread_cache = smart_ptr::thread_cache< uintptr_t, uint64_t, 8 >;
+using set_associative_thread_cache = smart_ptr::set_associative_thread_cache< uintptr_t, uint64_t, 1024, 4 >;
+
+BENCHMARK_TEMPLATE(thread_overhead, thread_cache)->Iterations(1);
+BENCHMARK_TEMPLATE(thread_overhead, set_associative_thread_cache)->Iterations(1);
+BENCHMARK(collector_table)->Iterations(1)->RangeMultiplier(16)->Range(1 << 8, 1 << 20);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,143 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#include <smart_ptr/shared_ptr.h>
+#include <smart_ptr/detail/shared_counter.h>
+#include <smart_ptr/detail/thread_counter.h>
+#include <smart_ptr/detail/thread_cache.h>
+#include <smart_ptr/detail/hazard_counter.h>
+#include <smart_ptr/detail/metrics.h>
+
+#include <benchmark/benchmark.h>
+#include <chrono>
+#include <thread>
+
+static const auto max_threads = std::thread::hardware_concurrency();
+
+using clock_type = std::chrono::steady_clock;
+
+// Nanoseconds from the last decrement of an object to its destruction, which is followed by deallocation
+struct reclamation_latency
+{
+    std::atomic< uint64_t > buckets[smart_ptr::histogram::size];
+    std::atomic< uint64_t > max;
+    std::atomic< uint64_t > destroyed;
+
+    static reclamation_latency& instance()
+    {
+        static reclamation_latency value;
+        return value;
+    }
+
+    void reset()
+    {
+        for (auto& bucket : buckets)
+            bucket = 0;
+        max = 0;
+        destroyed = 0;
+    }
+
+    void record(uint64_t latency)
+    {
+        buckets[smart_ptr::histogram::get_bucket(latency)].fetch_add(1, std::memory_order_relaxed);
+        auto current = max.load(std::memory_order_relaxed);
+        while (current < latency && !max.compare_exchange_weak(current, latency, std::memory_order_relaxed));
+        destroyed.fetch_add(1, std::memory_order_release);
+    }
+
+    smart_ptr::histogram get_histogram() const
+    {
+        smart_ptr::histogram histogram;
+        for (size_t i = 0; i < histogram.size; ++i)
+            histogram.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+        return histogram;
+    }
+};
+
+struct timed_object
+{
+    ~timed_object()
+    {
+        auto latency = std::chrono::duration_cast< std::chrono::nanoseconds >(clock_type::now() - released).count();
+        reclamation_latency::instance().record(latency);
+    }
+
+    clock_type::time_point released;
+};
+
+template < typename Counter > struct is_thread_counter: std::false_type {};
+template < typename T, typename Cache > struct is_thread_counter< smart_ptr::thread_counter< T, Cache > >: std::true_type {};
+
+template < typename Counter > struct is_hazard_counter: std::false_type {};
+template < typename T > struct is_hazard_counter< smart_ptr::hazard_counter< T > >: std::true_type {};
+
+// Every thread creates objects and drops their only reference. Thread 0 waits until all objects of the run are
+// destroyed and reports latency quantiles. For thread_counter, range(0) is the collector lag limit in messages.
+template < typename Counter > static void reclamation(benchmark::State& state)
+{
+    static std::atomic< uint64_t > created;
+    static std::atomic< int > finished;
+
+    auto& latency = reclamation_latency::instance();
+    if (state.thread_index() == 0)
+    {
+        latency.reset();
+        created = 0;
+        finished = 0;
+        if constexpr (is_thread_counter< Counter >::value)
+            smart_ptr::collector::instance().set_max_pending_messages(state.range(0));
+    }
+
+    uint64_t count = 0;
+    for (auto _ : state)
+    {
+        smart_ptr::shared_ptr< timed_object, Counter > p(new timed_object);
+        p->released = clock_type::now();
+        p.reset();
+        ++count;
+    }
+
+    // Retired pointers of a thread are not reclaimed by others while it runs
+    if constexpr (is_hazard_counter< Counter >::value)
+        smart_ptr::hazard_domain::instance().reclaim();
+
+    created += count;
+    ++finished;
+
+    if (state.thread_index() == 0)
+    {
+        auto deadline = clock_type::now() + std::chrono::seconds(10);
+        while ((finished != state.threads() || latency.destroyed.load(std::memory_order_acquire) != created) && clock_type::now() < deadline)
+        {
+            std::this_thread::yield();
+        }
+
+        if constexpr (is_thread_counter< Counter >::value)
+            smart_ptr::collector::instance().set_max_pending_messages(0);
+
+        if (latency.destroyed.load() != created.load())
+        {
+            state.SkipWithError("objects were not released");
+            return;
+        }
+
+        auto histogram = latency.get_histogram();
+        state.counters["p50_ns"] = (double)histogram.quantile(0.5);
+        state.counters["p99_ns"] = (double)histogram.quantile(0.99);
+        state.counters["max_ns"] = (double)latency.max.load();
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+using shared_counter_mt = smart_ptr::shared_counter< uint64_t, true >;
+using thread_counter = smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > >;
+using hazard_counter = smart_ptr::hazard_counter< uint64_t >;
+
+BENCHMARK_TEMPLATE(reclamation, shared_counter_mt)->ThreadRange(1, max_threads)->UseRealTime();
+BENCHMARK_TEMPLATE(reclamation, hazard_counter)->ThreadRange(1, max_threads)->UseRealTime();
+BENCHMARK_TEMPLATE(reclamation, thread_counter)->ThreadRange(1, max_threads)->UseRealTime()->Arg(0)->Arg(1024)->Arg(64);
@@ -0,0 +1,335 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+// Usage patterns of shared pointers measured for every counter policy and std::shared_ptr, to pick a policy
+// for a workload. Results are written as JSON to smart_ptr_benchmark_scenarios.json unless --benchmark_out says otherwise.
+
+#include <smart_ptr/shared_ptr.h>
+#include <smart_ptr/weak_ptr.h>
+#include <smart_ptr/detail/shared_counter.h>
+#include <smart_ptr/detail/biased_counter.h>
+#include <smart_ptr/detail/percpu_counter.h>
+#include <smart_ptr/detail/thread_counter.h>
+#include <smart_ptr/detail/thread_cache.h>
+#include <smart_ptr/detail/hazard_counter.h>
+
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+static const auto max_threads = std::thread::hardware_concurrency();
+
+template < typename P > struct pointer_traits;
+
+template < typename T > struct pointer_traits< std::shared_ptr< T > >
+{
+    template < typename... Args > static std::shared_ptr< T > make(Args&&... args) { return std::make_shared< T >(std::forward< Args >(args)...); }
+};
+
+template < typename T, typename Counter > struct pointer_traits< smart_ptr::shared_ptr< T, Counter > >
+{
+    template < typename... Args > static smart_ptr::shared_ptr< T, Counter > make(Args&&... args) { return smart_ptr::make_shared< T, Counter >(std::forward< Args >(args)...); }
+};
+
+template < typename P, typename... Args > static P make(Args&&... args)
+{
+    return pointer_traits< P >::make(std::forward< Args >(args)...);
+}
+
+// Pointers that live until exit are leaked, with thread_counter their releases would be pushed after the collector is gone
+template < typename P > static std::vector< P >& make_pool(size_t size)
+{
+    auto values = new std::vector< P >();
+    values->reserve(size);
+    for (size_t i = 0; i < size; ++i)
+    {
+        values->push_back(make< P >((int)i));
+    }
+
+    return *values;
+}
+
+// Keys drawn from Zipf distribution with exponent 1. Hot keys are spread over the pool, so they do not share cache lines.
+static std::vector< uint32_t > make_zipf_keys(size_t size, size_t count, uint32_t seed)
+{
+    std::vector< double > cdf(size);
+    double sum = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        sum += 1.0 / (double)(i + 1);
+        cdf[i] = sum;
+    }
+
+    std::vector< uint32_t > permutation(size);
+    std::iota(permutation.begin(), permutation.end(), 0);
+    std::mt19937 random(seed);
+    std::shuffle(permutation.begin(), permutation.end(), random);
+
+    std::uniform_real_distribution< double > distribution(0, sum);
+    std::vector< uint32_t > keys(count);
+    for (auto& key : keys)
+    {
+        auto rank = std::lower_bound(cdf.begin(), cdf.end(), distribution(random)) - cdf.begin();
+        key = permutation[std::min< size_t >(rank, size - 1)];
+    }
+
+    return keys;
+}
+
+// Every thread keeps range(0) objects alive and replaces one of them per item, so objects live range(0) items
+template < typename P > static void churn(benchmark::State& state)
+{
+    std::vector< P > live(state.range(0));
+    size_t index = 0;
+    for (auto _ : state)
+    {
+        live[index] = make< P >((int)index);
+        if (++index == live.size())
+        {
+            index = 0;
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+template < typename P > struct handoff_channel
+{
+    static constexpr size_t capacity = 4;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque< std::vector< P > > batches;
+};
+
+// Producer thread creates batches of range(0) objects that consumer thread releases. Both run the same number
+// of iterations, so every batch is consumed.
+template < typename P > static void handoff(benchmark::State& state)
+{
+    static handoff_channel< P > channel;
+
+    std::vector< P > values;
+    for (auto _ : state)
+    {
+        if (state.thread_index() == 0)
+        {
+            values.reserve(state.range(0));
+            for (auto i = 0; i < state.range(0); ++i)
+            {
+                values.push_back(make< P >(i));
+            }
+
+            {
+                std::unique_lock< std::mutex > lock(channel.mutex);
+                channel.cv.wait(lock, [] { return channel.batches.size() < channel.capacity; });
+                channel.batches.push_back(std::move(values));
+            }
+
+            channel.cv.notify_all();
+            values = std::vector< P >();
+        }
+        else
+        {
+            {
+                std::unique_lock< std::mutex > lock(channel.mutex);
+                channel.cv.wait(lock, [] { return !channel.batches.empty(); });
+                values = std::move(channel.batches.front());
+                channel.batches.pop_front();
+            }
+
+            channel.cv.notify_all();
+            values.clear();
+        }
+    }
+
+    if (state.thread_index() == 0)
+    {
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+    }
+}
+
+// All threads copy the same object range(0) times and drop the copies
+template < typename P > static void broadcast(benchmark::State& state)
+{
+    static P& value = make_pool< P >(1)[0];
+
+    std::vector< P > copies;
+    copies.reserve(state.range(0));
+    for (auto _ : state)
+    {
+        for (auto i = 0; i < state.range(0); ++i)
+        {
+            copies.push_back(value);
+        }
+
+        copies.clear();
+    }
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// All threads copy the same object and drop every copy right away. With range(0) set, each thread holds
+// a copy of its own during the run, so per-CPU counters see a slot that is never emptied by the drops.
+template < typename P > static void copy_drop(benchmark::State& state)
+{
+    static P& value = make_pool< P >(1)[0];
+
+    P held = state.range(0) ? value : P();
+    for (auto _ : state)
+    {
+        P tmp = value;
+        benchmark::DoNotOptimize(tmp);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+static const size_t max_working_set = 1 << 14;
+
+// Threads copy pointers of a working set of range(0) objects picked with Zipf distribution. Working sets
+// larger than a thread cache test how counters cope with misses and with a hot subset that still fits.
+template < typename P > static void zipf_working_set(benchmark::State& state)
+{
+    static std::vector< P >& pool = make_pool< P >(max_working_set);
+
+    auto keys = make_zipf_keys(state.range(0), 1 << 16, state.thread_index() + 1);
+    size_t index = 0;
+    for (auto _ : state)
+    {
+        P tmp = pool[keys[index]];
+        benchmark::DoNotOptimize(tmp);
+        index = (index + 1) & (keys.size() - 1);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Containers move their elements when they sort, grow and insert in the middle, none of that should touch the counts
+template < typename P > static void move_container(benchmark::State& state)
+{
+    std::vector< P > values;
+    for (auto i = 0; i < state.range(0); ++i)
+    {
+        values.push_back(make< P >(i));
+    }
+
+    for (auto _ : state)
+    {
+        std::reverse(values.begin(), values.end());
+        std::sort(values.begin(), values.end(), [](const P& lhs, const P& rhs) { return *lhs < *rhs; });
+
+        auto middle = values.begin() + values.size() / 2;
+        auto last = std::move(values.back());
+        values.pop_back();
+        values.insert(middle, std::move(last));
+
+        std::vector< P > grown;
+        for (auto& value : values)
+        {
+            grown.push_back(std::move(value));
+        }
+
+        values = std::move(grown);
+    }
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Threads lock weak pointers of a shared table and, for range(0) percent of operations, store weak pointers
+// of table objects in their own slots. Objects stay alive, so every lock succeeds.
+template < typename P > static void weak_read_write(benchmark::State& state)
+{
+    using weak_type = typename P::weak_type;
+    static const size_t table_size = 256;
+
+    static std::vector< P >& strong = make_pool< P >(table_size);
+    static std::vector< weak_type >& weak = *[]
+    {
+        auto values = new std::vector< weak_type >();
+        for (auto& value : strong)
+        {
+            values->emplace_back(value);
+        }
+        return values;
+    }();
+
+    std::array< weak_type, 16 > slots;
+    std::mt19937 random(state.thread_index() + 1);
+    const auto writes = (uint32_t)state.range(0);
+    for (auto _ : state)
+    {
+        auto value = random();
+        auto index = (value >> 8) % table_size;
+        if (value % 100 < writes)
+        {
+            slots[value & 15] = strong[index];
+        }
+        else
+        {
+            auto tmp = weak[index].lock();
+            benchmark::DoNotOptimize(tmp);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+using std_shared_ptr = std::shared_ptr< int >;
+using shared_counter_mt = smart_ptr::shared_ptr< int, smart_ptr::shared_counter< uint64_t, true > >;
+using biased_counter = smart_ptr::shared_ptr< int, smart_ptr::biased_counter< uint64_t > >;
+using percpu_counter = smart_ptr::shared_ptr< int, smart_ptr::percpu_counter< uint64_t > >;
+using thread_counter = smart_ptr::shared_ptr< int, smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > > >;
+using thread_counter_set_associative = smart_ptr::shared_ptr< int, smart_ptr::thread_counter< uint64_t, smart_ptr::set_associative_thread_cache< uintptr_t, uint64_t, 1024, 4 > > >;
+using hazard_counter = smart_ptr::shared_ptr< int, smart_ptr::hazard_counter< uint64_t > >;
+
+#define SCENARIOS(P) \
+    BENCHMARK_TEMPLATE(churn, P)->ThreadRange(1, max_threads)->UseRealTime()->RangeMultiplier(64)->Range(1, 1 << 12); \
+    BENCHMARK_TEMPLATE(handoff, P)->Threads(2)->UseRealTime()->RangeMultiplier(16)->Range(16, 1 << 12); \
+    BENCHMARK_TEMPLATE(broadcast, P)->ThreadRange(1, max_threads)->UseRealTime()->Arg(64); \
+    BENCHMARK_TEMPLATE(copy_drop, P)->ThreadRange(1, max_threads)->UseRealTime()->Arg(0)->Arg(1); \
+    BENCHMARK_TEMPLATE(zipf_working_set, P)->ThreadRange(1, max_threads)->UseRealTime()->RangeMultiplier(16)->Range(64, max_working_set); \
+    BENCHMARK_TEMPLATE(move_container, P)->UseRealTime()->RangeMultiplier(16)->Range(16, 1 << 12); \
+    BENCHMARK_TEMPLATE(weak_read_write, P)->ThreadRange(1, max_threads)->UseRealTime()->Arg(0)->Arg(10)->Arg(50);
+
+SCENARIOS(std_shared_ptr)
+SCENARIOS(shared_counter_mt)
+SCENARIOS(biased_counter)
+SCENARIOS(percpu_counter)
+SCENARIOS(thread_counter)
+SCENARIOS(thread_counter_set_associative)
+SCENARIOS(hazard_counter)
+
+// Writes JSON next to the console output unless the caller chose the output
+int main(int argc, char** argv)
+{
+    std::vector< char* > args(argv, argv + argc);
+    std::string out = "--benchmark_out=smart_ptr_benchmark_scenarios.json";
+    std::string format = "--benchmark_out_format=json";
+    if (std::none_of(args.begin(), args.end(), [](const char* arg) { return std::strncmp(arg, "--benchmark_out=", 16) == 0; }))
+    {
+        args.push_back(out.data());
+        args.push_back(format.data());
+    }
+
+    int size = (int)args.size();
+    benchmark::Initialize(&size, args.data());
+    if (benchmark::ReportUnrecognizedArguments(size, args.data()))
+        return 1;
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -11,12 +11,20 @@
 #endif
 
 #include <smart_ptr/shared_ptr.h>
+#include <smart_ptr/atomic_shared_ptr.h>
+#include <smart_ptr/intrusive_ptr.h>
+#include <smart_ptr/local_shared_ptr.h>
+#include <smart_ptr/shared_ptr_batch.h>
 #include <smart_ptr/detail/shared_counter.h>
 #include <smart_ptr/detail/biased_counter.h>
+#include <smart_ptr/detail/percpu_counter.h>
 #include <smart_ptr/detail/thread_counter.h>
 #include <smart_ptr/detail/thread_cache.h>
+#include <smart_ptr/detail/hazard_counter.h>
+#include <smart_ptr/detail/slab_allocator.h>
 
 #include <benchmark/benchmark.h>
+#include <vector>
 
 static const auto max_threads = std::thread::hardware_concurrency();
 static const auto min_ptrs = 1;
@@ -47,14 +55,259 @@ using shared_ptr = std::shared_ptr< int >;
 using shared_ptr_shared_counter_st = smart_ptr::shared_ptr< int, smart_ptr::shared_counter< uint64_t, false > >;
 using shared_ptr_shared_counter_mt = smart_ptr::shared_ptr< int, smart_ptr::shared_counter< uint64_t, true > >;
 using shared_ptr_biased_counter = smart_ptr::shared_ptr< int, smart_ptr::biased_counter< uint64_t > >;
+using shared_ptr_percpu_counter = smart_ptr::shared_ptr< int, smart_ptr::percpu_counter< uint64_t > >;
 using shared_ptr_thread_counter_1 = smart_ptr::shared_ptr< int, smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > > >;
 using shared_ptr_thread_counter_2 = smart_ptr::shared_ptr< int, smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache2< uintptr_t, uint64_t, 8 > > >;
+using shared_ptr_thread_counter_lru = smart_ptr::shared_ptr< int, smart_ptr::thread_counter< uint64_t, smart_ptr::lru_thread_cache< uintptr_t, uint64_t, 8 > > >;
 
 BENCHMARK_TEMPLATE(copy_ctor, shared_ptr)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
 BENCHMARK_TEMPLATE(copy_ctor, shared_ptr_shared_counter_st)->UseRealTime()->Range(min_ptrs, max_ptrs);
 BENCHMARK_TEMPLATE(copy_ctor, shared_ptr_shared_counter_mt)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
 BENCHMARK_TEMPLATE(copy_ctor, shared_ptr_biased_counter)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
+BENCHMARK_TEMPLATE(copy_ctor, shared_ptr_percpu_counter)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
 BENCHMARK_TEMPLATE(copy_ctor, shared_ptr_thread_counter_1)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
 BENCHMARK_TEMPLATE(copy_ctor, shared_ptr_thread_counter_2)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
+BENCHMARK_TEMPLATE(copy_ctor, shared_ptr_thread_counter_lru)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
+
+static const auto min_working_set = 8;
+static const auto max_working_set = 1 << 12;
+
+// Every thread copies each of range(0) pointers in turn. Once the working set outgrows a thread cache, copies
+// go to the collector, hit_rate is the ratio of references the thread caches served.
+template < typename T > static void working_set(benchmark::State& state)
+{
+    // Pointers are never destroyed, as their releases would be pushed from the main thread after it left the collector
+    static std::vector< T >& values = *[]()
+    {
+        auto values = new std::vector< T >(max_working_set);
+        for (auto& value : *values)
+            value = T(new typename T::element_type());
+        return values;
+    }();
+
+    // Collector counts cache hits only with metrics enabled, other benchmarks run without their cost
+    auto& collector = smart_ptr::collector::instance();
+    smart_ptr::collector_metrics before;
+    if (state.thread_index() == 0)
+    {
+        collector.set_metrics(true);
+        before = collector.get_metrics();
+    }
+
+    for (auto _ : state)
+    {
+        for (auto i = 0; i < state.range(0); ++i)
+        {
+            T tmp = values[i];
+            benchmark::DoNotOptimize(tmp);
+        }
+    }
+
+    if (state.thread_index() == 0)
+    {
+        auto after = collector.get_metrics();
+        auto hits = after.cache_hits - before.cache_hits;
+        auto pushed = after.pushed - before.pushed;
+        state.counters["hit_rate"] = hits + pushed ? (double)hits / (hits + pushed) : 0;
+        collector.set_metrics(false);
+    }
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+using shared_ptr_thread_counter_set_associative = smart_ptr::shared_ptr< int, smart_ptr::thread_counter< uint64_t, smart_ptr::set_associative_thread_cache< uintptr_t, uint64_t, 1024, 4 > > >;
+
+BENCHMARK_TEMPLATE(working_set, shared_ptr_thread_counter_1)->ThreadRange(1, max_threads)->UseRealTime()->RangeMultiplier(4)->Range(min_working_set, max_working_set);
+BENCHMARK_TEMPLATE(working_set, shared_ptr_thread_counter_2)->ThreadRange(1, max_threads)->UseRealTime()->RangeMultiplier(4)->Range(min_working_set, max_working_set);
+BENCHMARK_TEMPLATE(working_set, shared_ptr_thread_counter_lru)->ThreadRange(1, max_threads)->UseRealTime()->RangeMultiplier(4)->Range(min_working_set, max_working_set);
+BENCHMARK_TEMPLATE(working_set, shared_ptr_thread_counter_set_associative)->ThreadRange(1, max_threads)->UseRealTime()->RangeMultiplier(4)->Range(min_working_set, max_working_set);
+
+// Creates and drops range(0) objects per iteration. With thread_counter, objects are freed by the collector thread.
+template < typename Counter, typename Allocator > static void allocate_shared(benchmark::State& state)
+{
+    for (auto _ : state)
+    {
+        for (auto i = 0; i < state.range(0); ++i)
+        {
+            auto tmp = smart_ptr::allocate_shared< int, Allocator, Counter >(Allocator(), i);
+            benchmark::DoNotOptimize(tmp);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+using shared_counter_mt = smart_ptr::shared_counter< uint64_t, true >;
+using thread_counter_1 = smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > >;
+
+BENCHMARK_TEMPLATE(allocate_shared, shared_counter_mt, std::allocator< int >)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
+BENCHMARK_TEMPLATE(allocate_shared, shared_counter_mt, smart_ptr::slab_allocator< int >)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
+BENCHMARK_TEMPLATE(allocate_shared, thread_counter_1, std::allocator< int >)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
+BENCHMARK_TEMPLATE(allocate_shared, thread_counter_1, smart_ptr::slab_allocator< int >)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
+
+// Hazard counter reclaims on the releasing thread in batches, thread counter leaves it to the collector
+using hazard_counter_mt = smart_ptr::hazard_counter< uint64_t >;
+
+BENCHMARK_TEMPLATE(allocate_shared, hazard_counter_mt, std::allocator< int >)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
+BENCHMARK_TEMPLATE(allocate_shared, hazard_counter_mt, smart_ptr::slab_allocator< int >)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
+
+// Local pointers belong to a single thread, so they are copied by one thread only
+using local_shared_ptr_shared_counter_mt = smart_ptr::local_shared_ptr< int, shared_counter_mt >;
+using local_shared_ptr_biased_counter = smart_ptr::local_shared_ptr< int, smart_ptr::biased_counter< uint64_t > >;
+using local_shared_ptr_thread_counter_1 = smart_ptr::local_shared_ptr< int, thread_counter_1 >;
+
+BENCHMARK_TEMPLATE(copy_ctor, local_shared_ptr_shared_counter_mt)->UseRealTime()->Range(min_ptrs, max_ptrs);
+BENCHMARK_TEMPLATE(copy_ctor, local_shared_ptr_biased_counter)->UseRealTime()->Range(min_ptrs, max_ptrs);
+BENCHMARK_TEMPLATE(copy_ctor, local_shared_ptr_thread_counter_1)->UseRealTime()->Range(min_ptrs, max_ptrs);
+
+template < typename Counter > struct intrusive_int
+    : smart_ptr::intrusive_ref_counted< intrusive_int< Counter >, Counter >
+{
+    intrusive_int(int v = 0): value(v) {}
+    int value;
+};
+
+using intrusive_ptr_shared_counter_st = smart_ptr::intrusive_ptr< intrusive_int< smart_ptr::shared_counter< uint64_t, false > > >;
+using intrusive_ptr_shared_counter_mt = smart_ptr::intrusive_ptr< intrusive_int< shared_counter_mt > >;
+using intrusive_ptr_thread_counter_1 = smart_ptr::intrusive_ptr< intrusive_int< thread_counter_1 > >;
+
+BENCHMARK_TEMPLATE(copy_ctor, intrusive_ptr_shared_counter_st)->UseRealTime()->Range(min_ptrs, max_ptrs);
+BENCHMARK_TEMPLATE(copy_ctor, intrusive_ptr_shared_counter_mt)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
+BENCHMARK_TEMPLATE(copy_ctor, intrusive_ptr_thread_counter_1)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
+
+// Counterpart of allocate_shared with std::allocator, the object holds its count
+template < typename Counter > static void make_intrusive(benchmark::State& state)
+{
+    for (auto _ : state)
+    {
+        for (auto i = 0; i < state.range(0); ++i)
+        {
+            auto tmp = smart_ptr::make_intrusive< intrusive_int< Counter > >(i);
+            benchmark::DoNotOptimize(tmp);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK_TEMPLATE(make_intrusive, shared_counter_mt)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
+BENCHMARK_TEMPLATE(make_intrusive, thread_counter_1)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
+
+// Fans out one pointer into range(0) copies and drops them, one count update per copy or one per batch
+template < typename Counter, bool Batch > static void fan_out(benchmark::State& state)
+{
+    auto value = smart_ptr::make_shared< int, Counter >(1);
+    std::vector< smart_ptr::shared_ptr< int, Counter > > pointers;
+    pointers.reserve(state.range(0));
+
+    for (auto _ : state)
+    {
+        if constexpr (Batch)
+        {
+            smart_ptr::copy_n(value, state.range(0), std::back_inserter(pointers));
+            smart_ptr::release_range(pointers.begin(), pointers.end());
+        }
+        else
+        {
+            for (auto i = 0; i < state.range(0); ++i)
+            {
+                pointers.push_back(value);
+            }
+        }
+
+        pointers.clear();
+    }
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK_TEMPLATE(fan_out, shared_counter_mt, false)->ThreadRange(1, max_threads)->UseRealTime()->RangeMultiplier(4)->Range(4, 256);
+BENCHMARK_TEMPLATE(fan_out, shared_counter_mt, true)->ThreadRange(1, max_threads)->UseRealTime()->RangeMultiplier(4)->Range(4, 256);
+BENCHMARK_TEMPLATE(fan_out, thread_counter_1, false)->ThreadRange(1, max_threads)->UseRealTime()->RangeMultiplier(4)->Range(4, 256);
+BENCHMARK_TEMPLATE(fan_out, thread_counter_1, true)->ThreadRange(1, max_threads)->UseRealTime()->RangeMultiplier(4)->Range(4, 256);
+
+// std::atomic< std::shared_ptr > is C++20, use the free function overloads instead
+template < typename T > class std_atomic_shared_ptr
+{
+public:
+    using value_type = std::shared_ptr< T >;
+
+    value_type load() const { return std::atomic_load(&value_); }
+    void store(value_type desired) { std::atomic_store(&value_, std::move(desired)); }
+
+private:
+    value_type value_;
+};
+
+template < typename T > static void atomic_load_read_mostly(benchmark::State& state)
+{
+    // Value is never destroyed, as its release would be pushed after the collector was destroyed
+    static T& value = *new T;
+    if (state.thread_index() == 0)
+    {
+        value.store(typename T::value_type(new int(0)));
+    }
+
+    int stores = 0;
+    for (auto _ : state)
+    {
+        // One writer replacing the value now and then, all threads read
+        if (state.thread_index() == 0 && (++stores & 1023) == 0)
+        {
+            value.store(typename T::value_type(new int(stores)));
+        }
+
+        for (auto i = 0; i < state.range(0); ++i)
+        {
+            auto tmp = value.load();
+            benchmark::DoNotOptimize(tmp);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+using atomic_shared_ptr = std_atomic_shared_ptr< int >;
+using atomic_shared_ptr_shared_counter_mt = smart_ptr::atomic_shared_ptr< int, smart_ptr::shared_counter< uint64_t, true > >;
+using atomic_shared_ptr_percpu_counter = smart_ptr::atomic_shared_ptr< int, smart_ptr::percpu_counter< uint64_t > >;
+using atomic_shared_ptr_thread_counter_1 = smart_ptr::atomic_shared_ptr< int, smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > > >;
+using atomic_shared_ptr_thread_counter_2 = smart_ptr::atomic_shared_ptr< int, smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache2< uintptr_t, uint64_t, 8 > > >;
+using atomic_shared_ptr_hazard_counter = smart_ptr::atomic_shared_ptr< int, hazard_counter_mt >;
+
+BENCHMARK_TEMPLATE(atomic_load_read_mostly, atomic_shared_ptr)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
+BENCHMARK_TEMPLATE(atomic_load_read_mostly, atomic_shared_ptr_shared_counter_mt)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
+BENCHMARK_TEMPLATE(atomic_load_read_mostly, atomic_shared_ptr_percpu_counter)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
+BENCHMARK_TEMPLATE(atomic_load_read_mostly, atomic_shared_ptr_thread_counter_1)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
+BENCHMARK_TEMPLATE(atomic_load_read_mostly, atomic_shared_ptr_thread_counter_2)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
+BENCHMARK_TEMPLATE(atomic_load_read_mostly, atomic_shared_ptr_hazard_counter)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
+
+// Counterpart of atomic_load_read_mostly that reads within a pin and does not touch the counter
+template < typename T > static void atomic_borrow_read_mostly(benchmark::State& state)
+{
+    // Value is never destroyed, as its release would be pushed after the collector was destroyed
+    static T& value = *new T;
+    if (state.thread_index() == 0)
+    {
+        value.store(typename T::value_type(new int(0)));
+    }
+
+    int stores = 0;
+    for (auto _ : state)
+    {
+        if (state.thread_index() == 0 && (++stores & 1023) == 0)
+        {
+            value.store(typename T::value_type(new int(stores)));
+        }
+
+        smart_ptr::pin_guard guard;
+        for (auto i = 0; i < state.range(0); ++i)
+        {
+            auto tmp = value.borrow(guard);
+            benchmark::DoNotOptimize(*tmp);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK_TEMPLATE(atomic_borrow_read_mostly, atomic_shared_ptr_thread_counter_1)->ThreadRange(1, max_threads)->UseRealTime()->Range(min_ptrs, max_ptrs);
 
 BENCHMARK_MAIN();
@@ -8,6 +8,7 @@
 #include <smart_ptr/shared_ptr.h>
 #include <smart_ptr/detail/thread_counter.h>
 #include <smart_ptr/detail/biased_counter.h>
+#include <smart_ptr/detail/find_index.h>
 
 #include <benchmark/benchmark.h>
 #include <thread>
@@ -16,29 +17,40 @@
 
 static const auto max_threads = std::thread::hardware_concurrency();
 
-static void find_index(benchmark::State& state)
+// Searches for a missing key, so every kernel compares the whole array. Argument is smart_ptr::simd_level.
+template < typename T, size_t N > static void find_index(benchmark::State& state)
 {
-    alignas(32) std::array< uint32_t, 16 > values = { 1 };
+    alignas(64) std::array< T, N > values;
+    for (size_t i = 0; i < N; ++i)
+        values[i] = (T)(i + 1);
 
-    for (auto _ : state)
+    auto level = (smart_ptr::simd_level)state.range(0);
+    if (level > smart_ptr::get_simd_level())
     {
-        volatile size_t index = smart_ptr::find_index(values, 0);
+        state.SkipWithError("instruction set not supported");
+        return;
     }
-}
-
-BENCHMARK(find_index)->UseRealTime();
-
-static void find_index_sse4(benchmark::State& state)
-{
-    alignas(32) std::array< uint32_t, 16 > values = { 1 };
 
+    auto find = smart_ptr::find_index_dispatch< T, N >::select(level);
+    T value = 0;
     for (auto _ : state)
     {
-        volatile size_t index = smart_ptr::find_index_sse4(values, 0);
+        benchmark::DoNotOptimize(value);
+        benchmark::DoNotOptimize(find(values, value));
     }
 }
 
-BENCHMARK(find_index_sse4)->UseRealTime();
+#define FIND_INDEX_BENCHMARK(T, N) \
+    BENCHMARK_TEMPLATE(find_index, T, N)->UseRealTime()->DenseRange((int)smart_ptr::simd_level::scalar, (int)smart_ptr::simd_level::avx512);
+
+FIND_INDEX_BENCHMARK(uint32_t, 8)
+FIND_INDEX_BENCHMARK(uint32_t, 16)
+FIND_INDEX_BENCHMARK(uint32_t, 32)
+FIND_INDEX_BENCHMARK(uint32_t, 64)
+FIND_INDEX_BENCHMARK(uint64_t, 8)
+FIND_INDEX_BENCHMARK(uint64_t, 16)
+FIND_INDEX_BENCHMARK(uint64_t, 32)
+FIND_INDEX_BENCHMARK(uint64_t, 64)
 
 static void increment_uint32_t(benchmark::State& state)
 {
@@ -96,7 +108,7 @@ static void increment_cpu_local_atomic_thread_index(benchmark::State& state)
 
     for (auto _ : state)
     {
-        ++values[state.thread_index];
+        ++values[state.thread_index()];
     }
 
     volatile uint32_t result = values[1];
@@ -110,7 +122,7 @@ static void increment_cpu_local_atomic_cpu_traits(benchmark::State& state)
 
     for (auto _ : state)
     {
-        ++values[smart_ptr::cpu_traits_win32::get_current_cpu_id()];
+        ++values[smart_ptr::default_cpu_traits::get_current_cpu_id()];
     }
 
     volatile uint32_t result = values[1];
@@ -0,0 +1,388 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#pragma once
+
+#include <smart_ptr/shared_ptr.h>
+#include <smart_ptr/borrowed_ptr.h>
+
+#include <atomic>
+#include <cstdint>
+
+namespace smart_ptr
+{
+    // Control block owning a shared_ptr that does not point to the object of its own control block,
+    // an alias or a base at a different address. The block points where the shared_ptr does.
+    template < typename T, typename Counter > class alias_control_block
+        : public control_block_base< Counter >
+    {
+        using base_type = control_block_base< Counter >;
+
+    public:
+        alias_control_block(shared_ptr< T, Counter >&& value)
+            : base_type(&operation)
+            , value_(std::move(value))
+        {}
+
+    private:
+        static void* operation(base_type* base, control_block_operation op)
+        {
+            auto cb = static_cast< alias_control_block< T, Counter >* >(base);
+            switch (op)
+            {
+            case control_block_operation::destroy:
+                cb->value_.reset();
+                break;
+
+            case control_block_operation::deallocate:
+                delete cb;
+                break;
+
+            case control_block_operation::get_ptr:
+                return const_cast< void* >(static_cast< const void* >(cb->value_.get()));
+
+            case control_block_operation::get_owner:
+                return cb->value_.cb_ ? cb->value_.cb_->get_owner() : nullptr;
+            }
+
+            return nullptr;
+        }
+
+        shared_ptr< T, Counter > value_;
+    };
+
+    // Counters that retire blocks to the hazard domain (hazard_counter) are detected by their hazard_pointer type
+    template < typename Counter, typename = void > struct is_hazard_counter: std::false_type {};
+    template < typename Counter > struct is_hazard_counter< Counter, std::void_t< typename Counter::hazard_pointer > >: std::true_type {};
+
+    // Counters that release synchronously use split reference count: the word holds control block address
+    // in the lower 48 bits and a count of references borrowed by concurrent loads in the upper 16 bits.
+    // A load borrows a reference with single fetch_add, increments the control block and returns the borrowed
+    // reference if the word did not change in between. Writers convert outstanding borrows into real increments
+    // before they replace the value, so a load that finds the value replaced can drop the converted reference.
+    // The same block can be stored again while a load is in progress. Borrows of a block are interchangeable, so
+    // the load returns any borrow the word holds, and if there is none, some other load took its converted one.
+    //
+    // Deferred counters (thread_counter) keep plain address in the word. A load pins the thread in the collector,
+    // reads the word and increments the control block, so loads only touch thread-local state. Collector does not
+    // apply decrements of a replaced value before every thread pinned at the time of replacement unpinned.
+    // Hazard counters keep plain address as well, a load protects the block with a hazard pointer and locks it.
+    //
+    // The word holds only the control block, values point to the object of their block. Other values are stored
+    // in an alias_control_block, which costs an allocation per store. compare_exchange compares the owner of
+    // the block and the pointer, so a value matches the alias it was stored as.
+    template < typename T, typename Counter > class atomic_shared_ptr
+    {
+        static_assert(sizeof(void*) == sizeof(uint64_t));
+
+        using control_block_type = control_block_base< Counter >;
+
+        static constexpr uint64_t pointer_mask = (uint64_t(1) << 48) - 1;
+        static constexpr uint64_t borrowed_one = uint64_t(1) << 48;
+
+    public:
+        using value_type = shared_ptr< T, Counter >;
+
+        constexpr atomic_shared_ptr() noexcept = default;
+
+        atomic_shared_ptr(value_type desired)
+        {
+            adopt(desired);
+            word_.store(to_word(desired.cb_), std::memory_order_relaxed);
+            desired.cb_ = nullptr;
+            desired.ptr_ = nullptr;
+        }
+
+        atomic_shared_ptr(const atomic_shared_ptr< T, Counter >&) = delete;
+        atomic_shared_ptr< T, Counter >& operator = (const atomic_shared_ptr< T, Counter >&) = delete;
+
+        ~atomic_shared_ptr()
+        {
+            auto released = to_value(get_control_block(word_.load()));
+        }
+
+        value_type load() const
+        {
+            if constexpr (is_hazard_counter< Counter >::value)
+            {
+                // A block still held by the word has a reference. If the word was replaced after it was protected,
+                // lock() fails on the retired block and the load retries with the new value.
+                typename Counter::hazard_pointer hazard;
+                while (true)
+                {
+                    auto cb = get_control_block(hazard.protect(word_));
+                    if (!cb || cb->lock())
+                    {
+                        return to_value(cb);
+                    }
+                }
+            }
+            else if constexpr (Counter::deferred)
+            {
+                typename Counter::pin_guard guard;
+                auto cb = get_control_block(word_.load());
+                if (cb)
+                {
+                    cb->increment();
+                }
+
+                return to_value(cb);
+            }
+            else
+            {
+                auto word = word_.fetch_add(borrowed_one) + borrowed_one;
+                assert((word & ~pointer_mask) != 0);
+
+                auto cb = get_control_block(word);
+                if (cb)
+                {
+                    cb->increment();
+                }
+
+                while (!word_.compare_exchange_weak(word, word - borrowed_one))
+                {
+                    if (!is_borrowed(word, cb))
+                    {
+                        // Writer has replaced the value and turned our borrowed reference into a real one
+                        if (cb)
+                        {
+                            [[maybe_unused]] bool released = cb->decrement();
+                            assert(!released);
+                        }
+                        break;
+                    }
+                }
+
+                return to_value(cb);
+            }
+        }
+
+        // Reads the value without touching the counter, it stays alive until the pin ends
+        template < typename PinGuard > borrowed_ptr< T, Counter > borrow(const PinGuard&) const
+        {
+            static_assert(std::is_same_v< PinGuard, typename Counter::pin_guard >);
+            auto cb = get_control_block(word_.load());
+            return borrowed_ptr< T, Counter >(cb, cb ? static_cast< T* >(cb->get_ptr()) : nullptr);
+        }
+
+        void store(value_type desired)
+        {
+            exchange(std::move(desired));
+        }
+
+        value_type exchange(value_type desired)
+        {
+            adopt(desired);
+            control_block_type* cb = nullptr;
+            replace(desired.cb_, cb, accept_any());
+            desired.cb_ = nullptr;
+            desired.ptr_ = nullptr;
+            return to_value(cb);
+        }
+
+        bool compare_exchange_strong(value_type& expected, value_type desired)
+        {
+            adopt(desired);
+            control_block_type* cb = nullptr;
+            if (replace(desired.cb_, cb, [&](control_block_type* current) { return holds(current, expected); }))
+            {
+                desired.cb_ = nullptr;
+                desired.ptr_ = nullptr;
+
+                // Drop the reference the word held. Expected keeps the object alive, but the word might have held
+                // an alias block of its own.
+                auto released = to_value(cb);
+                return true;
+            }
+
+            expected = load();
+            return false;
+        }
+
+        bool compare_exchange_weak(value_type& expected, value_type desired)
+        {
+            return compare_exchange_strong(expected, std::move(desired));
+        }
+
+        operator value_type() const
+        {
+            return load();
+        }
+
+        atomic_shared_ptr< T, Counter >& operator = (value_type desired)
+        {
+            store(std::move(desired));
+            return *this;
+        }
+
+        static constexpr bool is_always_lock_free = true;
+        bool is_lock_free() const { return true; }
+
+    private:
+        // Predicate of exchange, it does not read the current block
+        struct accept_any
+        {
+            bool operator()(control_block_type*) const { return true; }
+        };
+
+        static void adopt(value_type& value)
+        {
+            if (value.cb_ ? value.cb_->get_ptr() != value.ptr_ : value.ptr_ != nullptr)
+            {
+                auto ptr = value.ptr_;
+                value = value_type(new alias_control_block< T, Counter >(std::move(value)), ptr);
+            }
+        }
+
+        // Whether the word with cb holds a value that points where the value does and shares its ownership
+        static bool holds(control_block_type* cb, const value_type& value)
+        {
+            if (cb == value.cb_)
+                return cb ? cb->get_ptr() == value.ptr_ : value.ptr_ == nullptr;
+
+            return (cb ? cb->get_ptr() : nullptr) == value.ptr_ && get_owner(cb) == get_owner(value.cb_);
+        }
+
+        static control_block_type* get_owner(control_block_type* cb)
+        {
+            return cb ? cb->get_owner() : nullptr;
+        }
+
+        // Adopts the reference held for cb
+        static value_type to_value(control_block_type* cb)
+        {
+            return value_type(cb, cb ? static_cast< T* >(cb->get_ptr()) : nullptr);
+        }
+
+        static uint64_t to_word(control_block_type* cb)
+        {
+            assert(((uint64_t)cb & ~pointer_mask) == 0);
+            return (uint64_t)cb;
+        }
+
+        static control_block_type* get_control_block(uint64_t word)
+        {
+            return (control_block_type*)(word & pointer_mask);
+        }
+
+        // Whether the word still has a borrow of cb to return, otherwise a writer converted it
+        static bool is_borrowed(uint64_t word, control_block_type* cb)
+        {
+            return get_control_block(word) == cb && (word & ~pointer_mask) != 0;
+        }
+
+        // Stores desired if pred accepts the current value and returns the current value in previous,
+        // together with the reference the word held. The writer borrows the current value like a load does,
+        // so it stays alive while the writer increments it for every other borrower.
+        template < typename Predicate > bool replace(control_block_type* desired, control_block_type*& previous, Predicate pred)
+        {
+            if constexpr (Counter::deferred)
+            {
+                if constexpr (std::is_same_v< Predicate, accept_any >)
+                {
+                    return replace_deferred(desired, previous, pred);
+                }
+                else if constexpr (is_hazard_counter< Counter >::value)
+                {
+                    // Predicate reads the current block, the hazard pointer keeps it from being released meanwhile
+                    typename Counter::hazard_pointer hazard;
+                    auto word = hazard.protect(word_);
+                    while (pred(get_control_block(word)))
+                    {
+                        if (word_.compare_exchange_weak(word, to_word(desired)))
+                        {
+                            previous = get_control_block(word);
+                            return true;
+                        }
+
+                        word = hazard.protect(word_);
+                    }
+
+                    return false;
+                }
+                else
+                {
+                    // Predicate reads the current block, the pin keeps it from being released meanwhile
+                    typename Counter::pin_guard guard;
+                    return replace_deferred(desired, previous, pred);
+                }
+            }
+            else
+            {
+                auto word = word_.fetch_add(borrowed_one) + borrowed_one;
+                auto cb = get_control_block(word);
+                uint64_t converted = 0;
+                while (true)
+                {
+                    if (!is_borrowed(word, cb))
+                    {
+                        // Other writer replaced the value and converted our borrow as well
+                        release(cb, converted + 1);
+
+                        word = word_.fetch_add(borrowed_one) + borrowed_one;
+                        cb = get_control_block(word);
+                        converted = 0;
+                        continue;
+                    }
+
+                    if (!pred(cb))
+                    {
+                        if (word_.compare_exchange_weak(word, word - borrowed_one))
+                        {
+                            release(cb, converted);
+                            return false;
+                        }
+
+                        continue;
+                    }
+
+                    // Borrows of other threads, returned ones leave some increments unused
+                    auto borrowed = (word >> 48) - 1;
+                    for (; cb && converted < borrowed; ++converted)
+                    {
+                        cb->increment();
+                    }
+
+                    if (word_.compare_exchange_weak(word, to_word(desired)))
+                    {
+                        release(cb, converted - borrowed);
+                        previous = cb;
+                        return true;
+                    }
+                }
+            }
+        }
+
+        template < typename Predicate > bool replace_deferred(control_block_type* desired, control_block_type*& previous, Predicate pred)
+        {
+            auto word = word_.load();
+            while (pred(get_control_block(word)))
+            {
+                if (word_.compare_exchange_weak(word, to_word(desired)))
+                {
+                    previous = get_control_block(word);
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        static void release(control_block_type* cb, uint64_t refs)
+        {
+            for (; cb && refs > 0; --refs)
+            {
+                if (cb->decrement())
+                {
+                    cb->release();
+                }
+            }
+        }
+
+        mutable std::atomic< uint64_t > word_{};
+    };
+}
@@ -0,0 +1,139 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#pragma once
+
+#include <smart_ptr/shared_ptr.h>
+
+#include <cassert>
+#include <type_traits>
+
+namespace smart_ptr
+{
+    template < typename T, typename Counter > class atomic_shared_ptr;
+
+    // Pointer kept alive by the pin of current thread instead of a reference, borrowing and dropping it does not
+    // touch the counter. Collector of a deferred counter does not release blocks while threads pinned before
+    // their last decrement are still pinned, so an object reachable through a shared_ptr when it was borrowed
+    // stays alive until the pin ends, even if all its shared_ptrs are released meanwhile.
+    //
+    // Borrowed pointer is used only by the thread that borrowed it and within the pin, debug builds check that.
+    // To keep the object past the pin, convert it to shared_ptr while still pinned.
+    template < typename T, typename Counter > class borrowed_ptr
+    {
+        static_assert(Counter::deferred, "borrowed_ptr requires a counter that defers releases past pins");
+
+        template < typename U, typename CounterU > friend class borrowed_ptr;
+        friend class atomic_shared_ptr< T, Counter >;
+
+        template < typename Y > using enable_if_convertible = std::enable_if_t< std::is_convertible_v< Y*, T* > >;
+
+    public:
+        using element_type = T;
+        using pin_guard = typename Counter::pin_guard;
+
+        constexpr borrowed_ptr() noexcept = default;
+        constexpr borrowed_ptr(std::nullptr_t) noexcept {}
+
+        template < typename Y, typename = enable_if_convertible< Y > > borrowed_ptr(const pin_guard&, const shared_ptr< Y, Counter >& value)
+            : borrowed_ptr(value.cb_, value.ptr_)
+        {}
+
+        template < typename Y, typename = enable_if_convertible< Y > > borrowed_ptr(const borrowed_ptr< Y, Counter >& other)
+            : ptr_(other.ptr_)
+            , cb_(other.cb_)
+        #if !defined(NDEBUG)
+            , pin_(other.pin_)
+        #endif
+        {
+            check();
+        }
+
+        borrowed_ptr(const borrowed_ptr< T, Counter >&) = default;
+        borrowed_ptr< T, Counter >& operator = (const borrowed_ptr< T, Counter >&) = default;
+
+    #if !defined(NDEBUG)
+        ~borrowed_ptr()
+        {
+            check();
+        }
+    #endif
+
+        // Adds a reference, the result can be kept after the pin ends
+        template < typename Y, typename = std::enable_if_t< std::is_convertible_v< T*, Y* > > > operator shared_ptr< Y, Counter >() const
+        {
+            check();
+            if (!cb_)
+            {
+                return shared_ptr< Y, Counter >(nullptr, ptr_);
+            }
+
+            cb_->increment();
+            return shared_ptr< Y, Counter >(cb_, ptr_);
+        }
+
+        void reset()
+        {
+            *this = borrowed_ptr< T, Counter >();
+        }
+
+        explicit operator bool() const
+        {
+            return ptr_ != nullptr;
+        }
+
+        T* operator ->() const
+        {
+            assert(ptr_);
+            check();
+            return ptr_;
+        }
+
+        T& operator *() const
+        {
+            assert(ptr_);
+            check();
+            return *ptr_;
+        }
+
+        T* get() const
+        {
+            check();
+            return ptr_;
+        }
+
+    private:
+        borrowed_ptr(control_block_base< Counter >* cb, T* ptr)
+            : ptr_(ptr)
+            , cb_(cb)
+        #if !defined(NDEBUG)
+            , pin_(Counter::get_pin())
+        #endif
+        {
+            assert(!cb_ || pin_ != decltype(Counter::get_pin())());
+        }
+
+        void check() const
+        {
+        #if !defined(NDEBUG)
+            // Borrowed pointer escaped its pin or the thread that borrowed it
+            assert(!cb_ || Counter::get_pin() == pin_);
+        #endif
+        }
+
+        T* ptr_{};
+        control_block_base< Counter >* cb_{};
+    #if !defined(NDEBUG)
+        decltype(Counter::get_pin()) pin_{};
+    #endif
+    };
+
+    template < typename T, typename Counter > borrowed_ptr< T, Counter > borrow(const typename Counter::pin_guard& guard, const shared_ptr< T, Counter >& value)
+    {
+        return borrowed_ptr< T, Counter >(guard, value);
+    }
+}
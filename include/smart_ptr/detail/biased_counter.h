@@ -12,50 +12,376 @@
 
 #include <smart_ptr/detail/thread_traits.h>
 
-#include <array>
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
 
 namespace smart_ptr
 {
-    template < typename T, typename ThreadTraits = default_thread_traits > struct biased_counter
+    // Per-thread queues of objects waiting for their owner to merge biased references into the shared count.
+    //
+    // A thread becomes an owner when it creates its first object. Queued objects are merged at safe points: when
+    // the owner creates an object, when it calls merge() and when it exits. Objects of an exited owner are merged
+    // by the thread that would queue them, as nobody changes their biased references anymore. If ThreadTraits
+    // reuse the id for a new thread, that thread inherits ownership of all objects not merged yet. A thread whose id
+    // is zero or belongs to a live owner does not own objects and its objects start merged.
+    template < typename ThreadTraits = default_thread_traits > class biased_merge_queue
     {
+    public:
+        using thread_id = typename ThreadTraits::thread_id;
+
+        // Moves biased references of counter to its shared count, returns true if the object should be released
+        using merge_function = bool (*)(void* counter);
+
+        // Releases the block of the counter after merge returned true
+        using release_function = void (*)(void* block);
+
+        static biased_merge_queue& instance()
+        {
+            static biased_merge_queue value;
+            return value;
+        }
+
+        // Owner id of current thread, thread_id() if the thread does not own objects
+        static thread_id get_owner()
+        {
+            return thread_.owner;
+        }
+
+        // Registers current thread as an owner and returns its id. Called for every created object,
+        // so it also serves as a safe point. Threads that already exited their handle own nothing.
+        static thread_id attach()
+        {
+            if (thread_.current)
+            {
+                if (thread_.current->pending.load(std::memory_order_relaxed))
+                {
+                    instance().merge();
+                }
+            }
+            else if (!thread_.detached)
+            {
+                static thread_local handle handle;
+            }
+
+            return thread_.owner;
+        }
+
+        // Merges all objects queued to current thread. Safe to call whenever the thread is not inside
+        // of a counter operation, e.g. between tasks of a worker loop.
+        void merge()
+        {
+            if (!thread_.current)
+                return;
+
+            std::vector< entry > entries;
+            {
+                std::lock_guard< std::mutex > lock(mutex_);
+                entries.swap(thread_.current->entries);
+                thread_.current->pending.store(false, std::memory_order_relaxed);
+            }
+
+            process(entries);
+        }
+
+        // Queues counter for merge by its owner. Objects of an exited owner are merged under the lock,
+        // so a new thread getting the same id can not start using biased references in the meantime.
+        void push(thread_id owner, void* counter, void* block, merge_function merge, release_function release)
+        {
+            {
+                std::lock_guard< std::mutex > lock(mutex_);
+                auto it = records_.find(owner);
+                if (it != records_.end())
+                {
+                    it->second->entries.push_back({ counter, block, merge, release });
+                    it->second->pending.store(true, std::memory_order_relaxed);
+                    return;
+                }
+
+                if (!merge(counter))
+                    return;
+            }
+
+            release(block);
+        }
+
+    private:
+        struct entry
+        {
+            void* counter;
+            void* block;
+            merge_function merge;
+            release_function release;
+        };
+
+        struct record
+        {
+            std::vector< entry > entries;
+            std::atomic< bool > pending = false;
+        };
+
+        // Trivially destructible, so it stays usable while other thread_local objects are destroyed
+        struct thread_state
+        {
+            thread_id owner;
+            record* current;
+            bool detached;
+        };
+
+        struct handle
+        {
+            handle()
+            {
+                auto id = ThreadTraits::get_current_thread_id();
+                if (id == thread_id())
+                {
+                    // Such thread can not be distinguished from merged objects
+                    thread_.detached = true;
+                    return;
+                }
+
+                auto& queue = instance();
+                std::lock_guard< std::mutex > lock(queue.mutex_);
+                if (!queue.records_.emplace(id, &value).second)
+                {
+                    // Id of a live owner, objects of both threads would be biased to the same one
+                    thread_.detached = true;
+                    return;
+                }
+
+                thread_.owner = id;
+                thread_.current = &value;
+            }
+
+            ~handle()
+            {
+                if (!thread_.current)
+                    return;
+
+                // From now on the thread uses shared counts only and biased references of its objects do not change
+                std::vector< entry > entries;
+                {
+                    auto& queue = instance();
+                    std::lock_guard< std::mutex > lock(queue.mutex_);
+                    queue.records_.erase(thread_.owner);
+                    entries.swap(value.entries);
+                    thread_ = { thread_id(), nullptr, true };
+                }
+
+                process(entries);
+            }
+
+            record value;
+        };
+
+        static void process(std::vector< entry >& entries)
+        {
+            for (auto& entry : entries)
+            {
+                if (entry.merge(entry.counter))
+                {
+                    entry.release(entry.block);
+                }
+            }
+        }
+
+        static thread_local thread_state thread_;
+
+        std::mutex mutex_;
+        std::unordered_map< thread_id, record* > records_;
+    };
+
+    template < typename ThreadTraits > thread_local typename biased_merge_queue< ThreadTraits >::thread_state biased_merge_queue< ThreadTraits >::thread_;
+
+    // Owner thread counts its references in non-atomic biased count, other threads in atomic shared count. Shared count
+    // is kept above two flags: merged (biased count was moved to shared count and owner uses shared count as well)
+    // and queued (object waits in owner's merge queue).
+    //
+    // Shared count goes negative when other threads release references the owner created. The first thread to do so
+    // queues the object, as only the owner can tell whether the object is still referenced. When biased count drops
+    // to zero, the owner merges right away. If the object is queued, releasing it is always left to the queue.
+    template < typename T, typename ThreadTraits = default_thread_traits > class biased_counter
+    {
+        using merge_queue = biased_merge_queue< ThreadTraits >;
+        using thread_id = typename ThreadTraits::thread_id;
+        using shared_type = std::make_signed_t< T >;
+
+        static constexpr shared_type merged = 1;
+        static constexpr shared_type queued = 2;
+        static constexpr shared_type shared_one = 4;
+
+    public:
+        static constexpr bool deferred = false;
+
         biased_counter(void*)
-            : tid_(ThreadTraits::get_current_thread_id())
-            , refs_global_(1)
-            , refs_local_(1)
+            : biased_counter(merge_queue::attach())
         {}
 
-        void increment(void*)
+        void increment(void* block)
         {
-            if (tid_ == ThreadTraits::get_current_thread_id())
+            increment(block, 1);
+        }
+
+        void increment(void*, T refs)
+        {
+            if (is_owner())
             {
-                ++refs_local_;
+                biased_ += refs;
             }
             else
             {
-                ++refs_global_;
+                shared_.fetch_add((shared_type)refs * shared_one);
             }
         }
 
-        bool decrement(void*)
+        // Block is released through its release() if the decrement is left to the merge queue
+        template < typename Block > bool decrement(Block* block)
         {
-            if (tid_ == ThreadTraits::get_current_thread_id())
+            if (is_owner())
             {
-                if (--refs_local_ == 0)
+                if (--biased_ > 0)
+                    return false;
+
+                auto shared = shared_.fetch_or(merged);
+                return (shared & queued) == 0 && get_count(shared) == 0;
+            }
+
+            return decrement_shared(block, 1);
+        }
+
+        // Owner takes what it can from biased count, references it can not take go to shared count after merge
+        template < typename Block > bool decrement(Block* block, T refs)
+        {
+            if (is_owner())
+            {
+                auto biased = std::min< T >(refs, biased_ - 1);
+                biased_ -= biased;
+                refs -= biased;
+                if (refs == 0)
+                    return false;
+
+                if (decrement(block))
                 {
-                    return --refs_global_ == 0;
+                    assert(refs == 1);
+                    return true;
                 }
+
+                if (--refs == 0)
+                    return false;
             }
-            else
+
+            return decrement_shared(block, refs);
+        }
+
+        void increment_weak(void*)
+        {
+            ++weak_;
+        }
+
+        bool decrement_weak(void*)
+        {
+            return --weak_ == 0;
+        }
+
+        bool lock(void*)
+        {
+            if (is_owner())
             {
-                return --refs_global_ == 0;
+                ++biased_;
+                return true;
             }
 
-            return false;
+            // Object that was not merged yet has biased references, merged one is alive while shared count is positive
+            auto shared = shared_.load();
+            do
+            {
+                if ((shared & merged) && get_count(shared) == 0)
+                    return false;
+            } while (!shared_.compare_exchange_weak(shared, shared + shared_one));
+
+            return true;
+        }
+
+        bool expired(const void*) const
+        {
+            auto shared = shared_.load();
+            return (shared & merged) && get_count(shared) == 0;
         }
 
     private:
-        T refs_local_;
-        typename ThreadTraits::thread_id tid_;
-        std::atomic< T > refs_global_;
+        template < typename Block > bool decrement_shared(Block* block, T refs)
+        {
+            auto shared = shared_.load();
+            while (true)
+            {
+                auto next = shared - (shared_type)refs * shared_one;
+                bool enqueue = (shared & (merged | queued)) == 0 && get_count(next) < 0;
+                if (enqueue)
+                {
+                    next |= queued;
+                }
+
+                if (shared_.compare_exchange_weak(shared, next))
+                {
+                    if (enqueue)
+                    {
+                        merge_queue::instance().push(tid_, this, block, &merge, &release< Block >);
+                        return false;
+                    }
+
+                    return (next & (merged | queued)) == merged && get_count(next) == 0;
+                }
+            }
+        }
+
+        // Objects created by threads that can not own them start merged
+        biased_counter(thread_id owner)
+            : shared_(owner != thread_id() ? 0 : shared_one | merged)
+            , weak_(1)
+            , biased_(owner != thread_id() ? 1 : 0)
+            , tid_(owner)
+        {}
+
+        // Owner with no biased references left works with shared count like everybody else
+        bool is_owner() const
+        {
+            return tid_ == merge_queue::get_owner() && tid_ != thread_id() && biased_ > 0;
+        }
+
+        static shared_type get_count(shared_type shared)
+        {
+            return shared >> 2;
+        }
+
+        static bool merge(void* p)
+        {
+            auto counter = static_cast< biased_counter< T, ThreadTraits >* >(p);
+            auto biased = (shared_type)counter->biased_;
+            counter->biased_ = 0;
+
+            auto shared = counter->shared_.load();
+            shared_type next;
+            do
+            {
+                next = ((shared + biased * shared_one) | merged) & ~queued;
+            } while (!counter->shared_.compare_exchange_weak(shared, next));
+
+            return get_count(next) == 0;
+        }
+
+        template < typename Block > static void release(void* block)
+        {
+            static_cast< Block* >(block)->release();
+        }
+
+        // Owner's fields are last, with 32-bit counts and thread ids they share a word and there is no padding
+        std::atomic< shared_type > shared_;
+        std::atomic< T > weak_;
+        T biased_;
+        const thread_id tid_;
     };
 }
@@ -22,24 +22,39 @@ namespace smart_ptr
 
     template < typename T > struct default_destructor {};
 
-    class control_block_dtor
+    // Operations that depend on the type of the block
+    enum class control_block_operation
     {
-    public:
-        virtual ~control_block_dtor() {}
-        virtual void deallocate() = 0;
+        // Destroys the managed object, control block stays allocated while there are weak references
+        destroy,
+
+        // Frees the control block itself
+        deallocate,
+
+        // Returns address of the managed object
+        get_ptr,
+
+        // Returns the block that owns the object, blocks holding another shared_ptr return the owner of that pointer
+        get_owner,
     };
 
-    template < typename T, typename Counter > class control_block_base
-        : public control_block_dtor
+    // Control block does not depend on the type of shared_ptr, so shared_ptrs converted to a base or pointing
+    // into the owned object share it. Each shared_ptr keeps its own pointer.
+    //
+    // Instead of a vtable, the block holds a single function that implements all operations of the derived block.
+    // Counter is the first member, so counters that keep no pointer to their block find it at their own address.
+    template < typename Counter > class control_block_base
     {
     public:
-        control_block_base()
+        using operation_function = void* (*)(control_block_base< Counter >*, control_block_operation);
+
+        control_block_base(operation_function operation)
             : counter_(this)
+            , operation_(operation)
         {}
 
-        control_block_base(T* ptr)
-            : ptr_(ptr)
-        {}
+        control_block_base(const control_block_base< Counter >&) = delete;
+        control_block_base< Counter >& operator = (const control_block_base< Counter >&) = delete;
 
         void increment()
         {
@@ -49,20 +64,78 @@ namespace smart_ptr
         bool decrement()
         {
             return counter_.decrement(this);
-        }       
+        }
+
+        // Bulk updates change the count by refs in a single counter operation
+        void increment(size_t refs)
+        {
+            counter_.increment(this, refs);
+        }
+
+        bool decrement(size_t refs)
+        {
+            return counter_.decrement(this, refs);
+        }
+
+        void increment_weak()
+        {
+            counter_.increment_weak(this);
+        }
+
+        bool decrement_weak()
+        {
+            return counter_.decrement_weak(this);
+        }
+
+        bool lock()
+        {
+            return counter_.lock(this);
+        }
+
+        bool expired() const
+        {
+            return counter_.expired(this);
+        }
+
+        // Called after the last strong reference is gone. Strong references together hold one weak reference,
+        // so the block is freed here only if there are no weak_ptrs left.
+        void release()
+        {
+            destroy();
+            if (decrement_weak())
+            {
+                deallocate();
+            }
+        }
+
+        void destroy()
+        {
+            operation_(this, control_block_operation::destroy);
+        }
 
-        const T* get_ptr() const { return ptr_; }
-              T* get_ptr()       { return ptr_; }
+        void deallocate()
+        {
+            operation_(this, control_block_operation::deallocate);
+        }
+
+        // Address of the owned object
+        void* get_ptr()
+        {
+            return operation_(this, control_block_operation::get_ptr);
+        }
 
-        void set_ptr(T* p) { ptr_ = p; }
+        // Pointers share ownership if their blocks have the same owner
+        control_block_base< Counter >* get_owner()
+        {
+            return static_cast< control_block_base< Counter >* >(operation_(this, control_block_operation::get_owner));
+        }
 
     private:
-        
-        T* ptr_;
         Counter counter_;
+        operation_function operation_;
     };
 
-    template < typename Allocator > class control_block_allocator
+    template < typename Allocator, bool = std::is_empty_v< Allocator > && !std::is_final_v< Allocator > > class control_block_allocator
     {
     public:
         template < typename AllocatorT > control_block_allocator(AllocatorT&& allocator)
@@ -75,7 +148,19 @@ namespace smart_ptr
         Allocator allocator_;
     };
 
-    template < typename T > class control_block_allocator< std::allocator< T > >
+    // Stateless allocators take no space in the control block
+    template < typename Allocator > class control_block_allocator< Allocator, true >
+        : private Allocator
+    {
+    public:
+        template < typename AllocatorT > control_block_allocator(AllocatorT&& allocator)
+            : Allocator(std::forward< AllocatorT >(allocator))
+        {}
+
+        Allocator& get_allocator() { return *this; }
+    };
+
+    template < typename T > class control_block_allocator< std::allocator< T >, true >
     {
     public:
         template < typename AllocatorT > control_block_allocator(AllocatorT&& allocator) {}
@@ -109,9 +194,10 @@ namespace smart_ptr
         default_destructor< T > get_deleter() { return default_destructor< T >(); }
     };
 
-    template < typename Base, typename T, typename Allocator, typename Deleter, bool > class control_block_storage;
+    template < typename T, typename Allocator, typename Deleter, bool > class control_block_storage;
 
-    template < typename Base, typename T, typename Allocator, typename Deleter > class control_block_storage< Base, T, Allocator, Deleter, true >
+    // Object is stored in the block, its address is computed from the address of the block
+    template < typename T, typename Allocator, typename Deleter > class control_block_storage< T, Allocator, Deleter, true >
         : public control_block_allocator< typename std::allocator_traits< Allocator >::template rebind_alloc< T > >
     {
         using allocator_type = typename std::allocator_traits< Allocator >::template rebind_alloc< T >;
@@ -121,49 +207,53 @@ namespace smart_ptr
             AllocatorT&& allocator, DeleterT&&, Args&&... args
         )
             : control_block_allocator< allocator_type >(std::forward< AllocatorT >(allocator))
-        {            
+        {
             auto&& al = this->get_allocator();
-	    std::allocator_traits< allocator_type >::construct(al, get_ptr(), std::forward< Args >(args)...);
-            static_cast<Base*>(this)->set_ptr(get_ptr());
+            std::allocator_traits< allocator_type >::construct(al, get_object(), std::forward< Args >(args)...);
         }
 
-        ~control_block_storage()
-        {        
-	    auto&& al = this->get_allocator();
-            std::allocator_traits< allocator_type >::destroy(al, get_ptr());
+        void destroy()
+        {
+            auto&& al = this->get_allocator();
+            std::allocator_traits< allocator_type >::destroy(al, get_object());
         }
 
-    public:
-        T* get_ptr() { return reinterpret_cast<T*>(&storage_); }
+        T* get_object() { return reinterpret_cast<T*>(&storage_); }
 
+    private:
         std::aligned_storage_t< sizeof(T), alignof(T) > storage_;
     };
 
-    template < typename Base, typename T, typename Allocator, typename Deleter > class control_block_storage< Base, T, Allocator, Deleter, false >
+    template < typename T, typename Allocator, typename Deleter > class control_block_storage< T, Allocator, Deleter, false >
         : public control_block_allocator< Allocator >
         , public control_block_deleter< Deleter >
     {
     public:
         template < typename AllocatorT, typename DeleterT > control_block_storage(
-            AllocatorT&& allocator, DeleterT&& deleter, T* p
+            AllocatorT&& allocator, DeleterT&& deleter, T* ptr
         )
             : control_block_allocator< Allocator >(std::forward< AllocatorT >(allocator))
             , control_block_deleter< Deleter >(std::forward< DeleterT >(deleter))
-        {
-            static_cast<Base*>(this)->set_ptr(p);
-        }
+            , ptr_(ptr)
+        {}
 
-        ~control_block_storage()
+        void destroy()
         {
-            this->get_deleter()(static_cast<Base*>(this)->get_ptr());
+            this->get_deleter()(ptr_);
         }
+
+        T* get_object() { return ptr_; }
+
+    private:
+        T* ptr_;
     };
 
     template < typename T, typename Counter, typename Allocator, typename Deleter, bool Storage > class control_block
-        : public control_block_base< T, Counter >
-        , public control_block_storage< control_block< T, Counter, Allocator, Deleter, Storage >, T, Allocator, Deleter, Storage >
-        
+        : public control_block_base< Counter >
+        , public control_block_storage< T, Allocator, Deleter, Storage >
     {
+        using base_type = control_block_base< Counter >;
+        using storage_type = control_block_storage< T, Allocator, Deleter, Storage >;
         using allocator_type = typename std::allocator_traits< Allocator >::template rebind_alloc<
             control_block< T, Counter, Allocator, Deleter, Storage >
         >;
@@ -171,10 +261,16 @@ namespace smart_ptr
     public:
         template < typename AllocatorT, typename DeleterT, typename... Args >
         control_block(AllocatorT&& allocator, DeleterT&& deleter, Args&&... args)
-            : control_block_storage< control_block< T, Counter, Allocator, Deleter, Storage >, T, Allocator, Deleter, Storage >(
+            : base_type(&operation)
+            , storage_type(
                 std::forward< AllocatorT >(allocator), std::forward< DeleterT >(deleter), std::forward< Args >(args)...
-            )            
-        {}
+            )
+        {
+            // Header and storage follow each other with no padding other than alignment of the storage
+            constexpr size_t alignment = alignof(control_block< T, Counter, Allocator, Deleter, Storage >);
+            static_assert(sizeof(control_block< T, Counter, Allocator, Deleter, Storage >) <=
+                (sizeof(base_type) + sizeof(storage_type) + alignment - 1) / alignment * alignment);
+        }
 
         template < typename AllocatorT, typename DeleterT >
         static control_block< T, Counter, Allocator, Deleter, false >* allocate(AllocatorT&& allocator, DeleterT&& deleter, T* ptr)
@@ -196,11 +292,32 @@ namespace smart_ptr
             return cb;
         }
 
-        void deallocate() override
+    private:
+        static void* operation(base_type* base, control_block_operation op)
         {
-            allocator_type alloc(this->get_allocator());
-            std::allocator_traits< allocator_type >::destroy(alloc, this);
-            std::allocator_traits< allocator_type >::deallocate(alloc, this, 1);
+            auto cb = static_cast< control_block< T, Counter, Allocator, Deleter, Storage >* >(base);
+            switch (op)
+            {
+            case control_block_operation::destroy:
+                cb->storage_type::destroy();
+                break;
+
+            case control_block_operation::deallocate:
+            {
+                allocator_type alloc(cb->get_allocator());
+                std::allocator_traits< allocator_type >::destroy(alloc, cb);
+                std::allocator_traits< allocator_type >::deallocate(alloc, cb, 1);
+                break;
+            }
+
+            case control_block_operation::get_ptr:
+                return const_cast< void* >(static_cast< const void* >(cb->get_object()));
+
+            case control_block_operation::get_owner:
+                return base;
+            }
+
+            return nullptr;
         }
     };
 }
@@ -0,0 +1,104 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <sched.h>
+#include <unistd.h>
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#endif
+#endif
+
+namespace smart_ptr
+{
+    const size_t cache_line_size = 64;
+
+    // Padding wrapper keeping each value on its own cache line(s)
+    template < typename T, size_t Alignment = cache_line_size > struct alignas(Alignment) aligned
+        : T
+    {
+        using T::T;
+    };
+
+#if defined(_WIN32)
+    struct cpu_traits_win32
+    {
+        static uint32_t get_current_cpu_id()
+        {
+            return GetCurrentProcessorNumber();
+        }
+
+        static uint32_t get_cpu_count()
+        {
+            return GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+        }
+    };
+#endif
+
+#if defined(__linux__)
+    // CPU id is only a hint, thread can migrate right after reading it. Users of cpu_traits
+    // need to stay correct on any CPU and only rely on the id for locality.
+    struct cpu_traits_linux
+    {
+        static uint32_t get_current_cpu_id()
+        {
+        #if defined(RSEQ_SIG)
+            // glibc registers rseq area for every thread, kernel keeps its cpu_id up to date
+            if (__rseq_size > 0)
+            {
+                auto rseq = reinterpret_cast< const volatile struct rseq* >(
+                    reinterpret_cast< const char* >(__builtin_thread_pointer()) + __rseq_offset);
+                auto cpu = rseq->cpu_id;
+                if ((int32_t)cpu >= 0)
+                    return cpu;
+            }
+        #endif
+            auto cpu = sched_getcpu();
+            return cpu >= 0 ? cpu : 0;
+        }
+
+        static uint32_t get_cpu_count()
+        {
+            // Configured CPUs, ids of CPUs brought online later stay in range
+            auto count = sysconf(_SC_NPROCESSORS_CONF);
+            return count > 0 ? (uint32_t)count : 1;
+        }
+    };
+#endif
+
+    struct cpu_traits_generic
+    {
+        // Spreads threads over slots, without knowing the CPU
+        static uint32_t get_current_cpu_id()
+        {
+            static thread_local uint32_t id = (uint32_t)std::hash< std::thread::id >()(std::this_thread::get_id());
+            return id;
+        }
+
+        static uint32_t get_cpu_count()
+        {
+            auto count = std::thread::hardware_concurrency();
+            return count > 0 ? count : 1;
+        }
+    };
+
+#if defined(_WIN32)
+    using default_cpu_traits = cpu_traits_win32;
+#elif defined(__linux__)
+    using default_cpu_traits = cpu_traits_linux;
+#else
+    using default_cpu_traits = cpu_traits_generic;
+#endif
+}
@@ -0,0 +1,307 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SMARTPTR_X86_64
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// Kernels are compiled for their instruction set regardless of compiler flags and selected at runtime
+#if defined(__GNUC__) || defined(__clang__)
+#define SMARTPTR_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SMARTPTR_TARGET(isa)
+#endif
+
+namespace smart_ptr
+{
+    enum class simd_level
+    {
+        scalar,
+        sse2,
+        sse4,
+        avx2,
+        avx512,
+    };
+
+    inline simd_level detect_simd_level()
+    {
+    #if defined(SMARTPTR_X86_64)
+    #if defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info, 0);
+        auto max = info[0];
+
+        __cpuid(info, 1);
+        bool sse42 = info[2] & (1 << 20);
+        bool avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28));
+
+        // Vector registers need to be enabled by the OS as well
+        auto xcr0 = avx ? _xgetbv(0) : 0;
+        bool avx2 = false;
+        bool avx512 = false;
+        if (max >= 7)
+        {
+            __cpuidex(info, 7, 0);
+            avx2 = avx && (xcr0 & 0x06) == 0x06 && (info[1] & (1 << 5));
+            avx512 = avx && (xcr0 & 0xe6) == 0xe6 && (info[1] & (1 << 16));
+        }
+    #else
+        __builtin_cpu_init();
+        bool sse42 = __builtin_cpu_supports("sse4.2");
+        bool avx2 = __builtin_cpu_supports("avx2");
+        bool avx512 = __builtin_cpu_supports("avx512f");
+    #endif
+        if (avx512)
+            return simd_level::avx512;
+        if (avx2)
+            return simd_level::avx2;
+        if (sse42)
+            return simd_level::sse4;
+        return simd_level::sse2;
+    #else
+        return simd_level::scalar;
+    #endif
+    }
+
+    // Instruction set of the CPU, detected once
+    inline simd_level get_simd_level()
+    {
+        static const simd_level level = detect_simd_level();
+        return level;
+    }
+
+    // Index of the lowest set bit of non-zero value
+    inline size_t get_lowest_bit(uint64_t value)
+    {
+    #if defined(_MSC_VER) && !defined(__clang__)
+        unsigned long index;
+        _BitScanForward64(&index, value);
+        return index;
+    #else
+        return (size_t)__builtin_ctzll(value);
+    #endif
+    }
+
+    // Returns index of the first occurrence of value or N
+    template < typename T, size_t N > size_t find_index_scalar(const std::array< T, N >& values, typename std::array< T, N >::value_type value)
+    {
+        for (size_t i = 0; i < values.size(); ++i)
+        {
+            if (values[i] == value)
+                return i;
+        }
+
+        return values.size();
+    }
+
+#if defined(SMARTPTR_X86_64)
+    // Each kernel compares all keys and builds a bit mask of matches, so there is a single branch
+    // for up to 64 keys. Size of the array has to be a multiple of the vector size.
+
+    template < typename T > SMARTPTR_TARGET("sse2") uint64_t compare_sse2(const T* values, T value)
+    {
+        auto v = _mm_loadu_si128((const __m128i*)values);
+        if constexpr (sizeof(T) == 4)
+        {
+            return (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, _mm_set1_epi32((int)value))));
+        }
+        else
+        {
+            // SSE2 has no 64-bit compare, both halves need to match
+            auto cmp = _mm_cmpeq_epi32(v, _mm_set1_epi64x((long long)value));
+            cmp = _mm_and_si128(cmp, _mm_shuffle_epi32(cmp, _MM_SHUFFLE(2, 3, 0, 1)));
+            return (uint64_t)_mm_movemask_pd(_mm_castsi128_pd(cmp));
+        }
+    }
+
+    template < typename T > SMARTPTR_TARGET("sse4.2") uint64_t compare_sse4(const T* values, T value)
+    {
+        auto v = _mm_loadu_si128((const __m128i*)values);
+        if constexpr (sizeof(T) == 4)
+        {
+            return (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, _mm_set1_epi32((int)value))));
+        }
+        else
+        {
+            return (uint64_t)_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(v, _mm_set1_epi64x((long long)value))));
+        }
+    }
+
+    template < typename T > SMARTPTR_TARGET("avx2") uint64_t compare_avx2(const T* values, T value)
+    {
+        auto v = _mm256_loadu_si256((const __m256i*)values);
+        if constexpr (sizeof(T) == 4)
+        {
+            return (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, _mm256_set1_epi32((int)value))));
+        }
+        else
+        {
+            return (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v, _mm256_set1_epi64x((long long)value))));
+        }
+    }
+
+    template < typename T > SMARTPTR_TARGET("avx512f") uint64_t compare_avx512(const T* values, T value)
+    {
+        auto v = _mm512_loadu_si512((const void*)values);
+        if constexpr (sizeof(T) == 4)
+        {
+            return (uint64_t)_mm512_cmpeq_epi32_mask(v, _mm512_set1_epi32((int)value));
+        }
+        else
+        {
+            return (uint64_t)_mm512_cmpeq_epi64_mask(v, _mm512_set1_epi64((long long)value));
+        }
+    }
+
+    template < typename T, size_t N > SMARTPTR_TARGET("sse2") size_t find_index_sse2(const std::array< T, N >& values, typename std::array< T, N >::value_type value)
+    {
+        constexpr size_t lanes = 16 / sizeof(T);
+        static_assert(N % lanes == 0 && N <= 64);
+
+        uint64_t mask = 0;
+        for (size_t i = 0; i < N; i += lanes)
+        {
+            mask |= compare_sse2(values.data() + i, value) << i;
+        }
+
+        return mask ? get_lowest_bit(mask) : N;
+    }
+
+    template < typename T, size_t N > SMARTPTR_TARGET("sse4.2") size_t find_index_sse4(const std::array< T, N >& values, typename std::array< T, N >::value_type value)
+    {
+        constexpr size_t lanes = 16 / sizeof(T);
+        static_assert(N % lanes == 0 && N <= 64);
+
+        uint64_t mask = 0;
+        for (size_t i = 0; i < N; i += lanes)
+        {
+            mask |= compare_sse4(values.data() + i, value) << i;
+        }
+
+        return mask ? get_lowest_bit(mask) : N;
+    }
+
+    template < typename T, size_t N > SMARTPTR_TARGET("avx2") size_t find_index_avx2(const std::array< T, N >& values, typename std::array< T, N >::value_type value)
+    {
+        constexpr size_t lanes = 32 / sizeof(T);
+        static_assert(N % lanes == 0 && N <= 64);
+
+        uint64_t mask = 0;
+        for (size_t i = 0; i < N; i += lanes)
+        {
+            mask |= compare_avx2(values.data() + i, value) << i;
+        }
+
+        return mask ? get_lowest_bit(mask) : N;
+    }
+
+    template < typename T, size_t N > SMARTPTR_TARGET("avx512f") size_t find_index_avx512(const std::array< T, N >& values, typename std::array< T, N >::value_type value)
+    {
+        constexpr size_t lanes = 64 / sizeof(T);
+        static_assert(N % lanes == 0 && N <= 64);
+
+        uint64_t mask = 0;
+        for (size_t i = 0; i < N; i += lanes)
+        {
+            mask |= compare_avx512(values.data() + i, value) << i;
+        }
+
+        return mask ? get_lowest_bit(mask) : N;
+    }
+
+    // Calls the best kernel the CPU supports through a pointer resolved on the first call
+    template < typename T, size_t N > class find_index_dispatch
+    {
+        using function = size_t (*)(const std::array< T, N >&, T);
+
+    public:
+        static size_t find(const std::array< T, N >& values, T value)
+        {
+            return function_.load(std::memory_order_relaxed)(values, value);
+        }
+
+        static function select(simd_level level)
+        {
+            constexpr size_t size = sizeof(T) * N;
+            if constexpr (N <= 64 && size % 64 == 0)
+            {
+                if (level >= simd_level::avx512)
+                    return &find_index_avx512< T, N >;
+            }
+
+            if constexpr (N <= 64 && size % 32 == 0)
+            {
+                if (level >= simd_level::avx2)
+                    return &find_index_avx2< T, N >;
+            }
+
+            if constexpr (N <= 64 && size % 16 == 0)
+            {
+                if (level >= simd_level::sse4)
+                    return &find_index_sse4< T, N >;
+                if (level >= simd_level::sse2)
+                    return &find_index_sse2< T, N >;
+            }
+
+            return &find_index_scalar< T, N >;
+        }
+
+    private:
+        static size_t resolve(const std::array< T, N >& values, T value)
+        {
+            auto selected = select(get_simd_level());
+            function_.store(selected, std::memory_order_relaxed);
+            return selected(values, value);
+        }
+
+        static inline std::atomic< function > function_{ &resolve };
+    };
+#endif
+
+    // Returns index of the first occurrence of value or N. Kernel is picked at compile time if the target
+    // instruction set allows, otherwise at runtime.
+    template < typename T, size_t N > size_t find_index(const std::array< T, N >& values, typename std::array< T, N >::value_type value)
+    {
+    #if defined(SMARTPTR_X86_64)
+        constexpr size_t size = sizeof(T) * N;
+        if constexpr (!std::is_integral_v< T > || (sizeof(T) != 4 && sizeof(T) != 8) || N > 64 || size % 16 != 0)
+        {
+            return find_index_scalar(values, value);
+        }
+    #if defined(__AVX512F__)
+        else if constexpr (size % 64 == 0)
+        {
+            return find_index_avx512(values, value);
+        }
+    #endif
+    #if defined(__AVX2__)
+        else if constexpr (size % 32 == 0)
+        {
+            return find_index_avx2(values, value);
+        }
+    #endif
+        else
+        {
+            return find_index_dispatch< T, N >::find(values, value);
+        }
+    #else
+        return find_index_scalar(values, value);
+    #endif
+    }
+}
@@ -0,0 +1,285 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <immintrin.h>
+#include <memory>
+
+namespace smart_ptr
+{
+    // Matches of key and of empty slot (zero) in a group of 8 consecutive keys, one bit per key
+    struct hash_table_probe
+    {
+        static constexpr size_t group_size = 8;
+
+        uint32_t match;
+        uint32_t empty;
+    };
+
+#if defined(__AVX2__)
+    inline hash_table_probe probe_group(const uint64_t* keys, uint64_t key)
+    {
+        __m256i vkey = _mm256_set1_epi64x(key);
+        __m256i vzero = _mm256_setzero_si256();
+        __m256i v0 = _mm256_loadu_si256((const __m256i*)keys);
+        __m256i v1 = _mm256_loadu_si256((const __m256i*)(keys + 4));
+
+        uint32_t match = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v0, vkey)))
+            | _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v1, vkey))) << 4;
+        uint32_t empty = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v0, vzero)))
+            | _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v1, vzero))) << 4;
+        return { match, empty };
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    inline uint32_t compare_group(const __m128i* keys, __m128i value)
+    {
+        uint32_t mask = 0;
+        for (size_t i = 0; i < 4; ++i)
+        {
+            // SSE2 has no 64-bit compare, both halves need to match
+            __m128i cmp = _mm_cmpeq_epi32(_mm_loadu_si128(keys + i), value);
+            cmp = _mm_and_si128(cmp, _mm_shuffle_epi32(cmp, _MM_SHUFFLE(2, 3, 0, 1)));
+            mask |= _mm_movemask_pd(_mm_castsi128_pd(cmp)) << (2 * i);
+        }
+
+        return mask;
+    }
+
+    inline hash_table_probe probe_group(const uint64_t* keys, uint64_t key)
+    {
+        return { compare_group((const __m128i*)keys, _mm_set1_epi64x(key)), compare_group((const __m128i*)keys, _mm_setzero_si128()) };
+    }
+#else
+    inline hash_table_probe probe_group(const uint64_t* keys, uint64_t key)
+    {
+        hash_table_probe probe = { 0, 0 };
+        for (size_t i = 0; i < hash_table_probe::group_size; ++i)
+        {
+            probe.match |= uint32_t(keys[i] == key) << i;
+            probe.empty |= uint32_t(keys[i] == 0) << i;
+        }
+
+        return probe;
+    }
+#endif
+
+    // Open-addressing table with linear probing for non-zero pointer-sized keys. Keys are stored apart
+    // from values, so collisions are resolved by comparing a cache line of keys at once. Erase shifts
+    // following entries back instead of leaving tombstones, so probe sequences stay as short as the load allows.
+    //
+    // Capacity never drops below the one given to the constructor.
+    template < typename Key, typename Value > class hash_table
+    {
+        static_assert(sizeof(Key) == sizeof(uint64_t));
+
+        static constexpr size_t group_size = hash_table_probe::group_size;
+
+    public:
+        hash_table(size_t capacity = 1 << 12)
+            : min_capacity_(round_capacity(capacity))
+        {
+            allocate(min_capacity_);
+        }
+
+        hash_table(const hash_table< Key, Value >&) = delete;
+        hash_table< Key, Value >& operator = (const hash_table< Key, Value >&) = delete;
+
+        size_t size() const { return size_; }
+        size_t capacity() const { return capacity_; }
+
+        // Bytes of key and value arrays
+        size_t get_memory_size() const { return capacity_ * (sizeof(uint64_t) + sizeof(Value)); }
+        bool empty() const { return size_ == 0; }
+
+        Value* find(Key key)
+        {
+            auto index = find_index(to_key(key));
+            return index != capacity_ ? &values_[index] : nullptr;
+        }
+
+        // Returns value of the key, inserting value-initialized one if the key is not present
+        Value& operator [](Key key)
+        {
+            auto k = to_key(key);
+            auto index = find_index(k);
+            if (index != capacity_)
+                return values_[index];
+
+            if ((size_ + 1) * 2 > capacity_)
+            {
+                rehash(capacity_ * 2);
+            }
+
+            index = insert_index(k);
+            keys_[index] = k;
+            values_[index] = Value();
+            ++size_;
+            return values_[index];
+        }
+
+        bool erase(Key key)
+        {
+            auto index = find_index(to_key(key));
+            if (index == capacity_)
+                return false;
+
+            erase_index(index);
+            return true;
+        }
+
+        // Gives back memory after a burst, to be called when the owner is idle
+        void shrink()
+        {
+            if (capacity_ > min_capacity_ && size_ * 8 < capacity_)
+            {
+                auto capacity = capacity_;
+                while (capacity > min_capacity_ && size_ * 4 < capacity)
+                    capacity /= 2;
+
+                rehash(capacity);
+            }
+        }
+
+    private:
+        static uint64_t to_key(Key key)
+        {
+            auto k = (uint64_t)key;
+            assert(k != 0);
+            return k;
+        }
+
+        static size_t round_capacity(size_t capacity)
+        {
+            size_t value = group_size;
+            while (value < capacity)
+                value *= 2;
+            return value;
+        }
+
+        size_t get_home(uint64_t key) const
+        {
+            // Fibonacci hashing spreads aligned addresses over the upper bits
+            return (key * 0x9E3779B97F4A7C15ull) >> shift_;
+        }
+
+        size_t find_index(uint64_t key) const
+        {
+            // Most keys sit in their home slot, the rest of the probe sequence is compared a group at a time
+            auto index = get_home(key);
+            if (keys_[index] == key)
+                return index;
+            if (keys_[index] == 0)
+                return capacity_;
+
+            index = (index + 1) & mask_;
+            auto group = index & ~(group_size - 1);
+
+            // Slots before index in the first group do not belong to the probe sequence
+            auto probe = probe_group(&keys_[group], key);
+            auto skip = ~0u << (index - group);
+            probe.match &= skip;
+            probe.empty &= skip;
+
+            while (true)
+            {
+                // Entries are never stored past an empty slot of their probe sequence
+                if (probe.match)
+                {
+                    auto match = count_trailing_zeros(probe.match);
+                    if (!probe.empty || match < count_trailing_zeros(probe.empty))
+                        return group + match;
+                }
+
+                if (probe.empty)
+                    return capacity_;
+
+                group = (group + group_size) & mask_;
+                probe = probe_group(&keys_[group], key);
+            }
+        }
+
+        size_t insert_index(uint64_t key) const
+        {
+            auto index = get_home(key);
+            while (keys_[index] != 0)
+                index = (index + 1) & mask_;
+            return index;
+        }
+
+        void erase_index(size_t index)
+        {
+            keys_[index] = 0;
+            --size_;
+
+            // Move back every following entry whose home is not between the hole and its slot
+            for (auto next = (index + 1) & mask_; keys_[next] != 0; next = (next + 1) & mask_)
+            {
+                auto home = get_home(keys_[next]);
+                if (((next - home) & mask_) >= ((next - index) & mask_))
+                {
+                    keys_[index] = keys_[next];
+                    values_[index] = std::move(values_[next]);
+                    keys_[next] = 0;
+                    index = next;
+                }
+            }
+        }
+
+        void allocate(size_t capacity)
+        {
+            capacity_ = capacity;
+            mask_ = capacity - 1;
+            shift_ = 64;
+            for (auto value = capacity; value > 1; value /= 2)
+                --shift_;
+
+            keys_.reset(new uint64_t[capacity]());
+            values_.reset(new Value[capacity]());
+        }
+
+        void rehash(size_t capacity)
+        {
+            auto keys = std::move(keys_);
+            auto values = std::move(values_);
+            auto old_capacity = capacity_;
+            allocate(capacity);
+
+            for (size_t i = 0; i < old_capacity; ++i)
+            {
+                if (keys[i])
+                {
+                    auto index = insert_index(keys[i]);
+                    keys_[index] = keys[i];
+                    values_[index] = std::move(values[i]);
+                }
+            }
+        }
+
+        static uint32_t count_trailing_zeros(uint32_t value)
+        {
+        #if defined(_MSC_VER)
+            unsigned long index;
+            _BitScanForward(&index, value);
+            return index;
+        #else
+            return __builtin_ctz(value);
+        #endif
+        }
+
+        std::unique_ptr< uint64_t[] > keys_;
+        std::unique_ptr< Value[] > values_;
+        size_t size_ = 0;
+        size_t capacity_ = 0;
+        size_t mask_ = 0;
+        uint32_t shift_ = 0;
+        const size_t min_capacity_;
+    };
+}
@@ -0,0 +1,102 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#pragma once
+
+#include <smart_ptr/detail/hazard_pointer.h>
+
+#include <atomic>
+
+namespace smart_ptr
+{
+    // Atomic count like shared_counter, but the last decrement retires the block to the hazard domain instead of
+    // releasing it. Readers of lock-free structures protect a block with a hazard pointer and take a reference with
+    // lock(), which fails once the block is retired. Unreclaimed blocks are bounded by the number of hazard slots,
+    // not by how far a collector lags behind.
+    template < typename T > struct hazard_counter
+    {
+        // Blocks are released by hazard scans, the last decrement never returns true
+        static constexpr bool deferred = true;
+        using hazard_pointer = smart_ptr::hazard_pointer;
+
+        hazard_counter(void*)
+            : refs_(1)
+            , weak_(1)
+        {}
+
+        void increment(void*)
+        {
+            ++refs_;
+        }
+
+        void increment(void*, T refs)
+        {
+            refs_ += refs;
+        }
+
+        template < typename Block > bool decrement(Block* block)
+        {
+            if (--refs_ == 0)
+            {
+                retire(block);
+            }
+
+            return false;
+        }
+
+        template < typename Block > bool decrement(Block* block, T refs)
+        {
+            if ((refs_ -= refs) == 0)
+            {
+                retire(block);
+            }
+
+            return false;
+        }
+
+        void increment_weak(void*)
+        {
+            ++weak_;
+        }
+
+        bool decrement_weak(void*)
+        {
+            return --weak_ == 0;
+        }
+
+        bool lock(void*)
+        {
+            auto refs = refs_.load();
+            do
+            {
+                if (refs == 0)
+                    return false;
+            } while (!refs_.compare_exchange_weak(refs, refs + 1));
+
+            return true;
+        }
+
+        bool expired(const void*) const
+        {
+            return refs_.load() == 0;
+        }
+
+    private:
+        template < typename Block > static void retire(Block* block)
+        {
+            hazard_domain::instance().retire(block, &release_block< Block >);
+        }
+
+        template < typename Block > static void release_block(void* block)
+        {
+            static_cast< Block* >(block)->release();
+        }
+
+        std::atomic< T > refs_;
+        std::atomic< T > weak_;
+    };
+}
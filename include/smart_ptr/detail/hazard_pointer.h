@@ -0,0 +1,308 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace smart_ptr
+{
+    // Hazard pointers a thread can hold at once
+    const size_t hazard_slots = 4;
+
+    // A thread scans hazards when it has retired this many pointers on top of twice the number of all hazard slots.
+    // At least half of its list is reclaimed then, so retired memory is bounded by the number of hazards.
+    const size_t hazard_scan_threshold = 64;
+
+    using hazard_reclaim_function = void (*)(void* ptr);
+
+    struct hazard_retired
+    {
+        void* ptr;
+        hazard_reclaim_function reclaim;
+    };
+
+    // Hazard slots and retired pointers of a thread. Records are freed with the domain,
+    // a thread that exits leaves its record to threads started later.
+    class hazard_record
+    {
+        friend class hazard_domain;
+
+    public:
+        std::atomic< const void* >& get_slot(size_t index) { return slots_[index]; }
+
+        // Called by the owner thread
+        size_t acquire_slot()
+        {
+            assert(used_ != (1u << hazard_slots) - 1);
+            size_t index = 0;
+            while (used_ & (1u << index))
+            {
+                ++index;
+            }
+
+            used_ |= 1u << index;
+            return index;
+        }
+
+        void release_slot(size_t index)
+        {
+            assert(used_ & (1u << index));
+            used_ &= ~(1u << index);
+        }
+
+    private:
+        std::atomic< const void* > slots_[hazard_slots]{};
+        std::atomic< bool > active_ = true;
+        hazard_record* next_ = nullptr;
+
+        // Accessed by the owner thread
+        unsigned used_ = 0;
+        bool scanning_ = false;
+        std::vector< hazard_retired > retired_;
+        std::vector< hazard_retired > reclaimed_;
+        std::vector< const void* > hazards_;
+    };
+
+    // Defers reclamation of retired pointers until no thread protects them with a hazard pointer. Each thread
+    // keeps a list of its retired pointers and scans hazards of all threads once the list is long enough.
+    // Pointers retired by exited threads are taken over by the next scan.
+    class hazard_domain
+    {
+        friend class hazard_pointer;
+
+    public:
+        ~hazard_domain()
+        {
+            // Threads using the domain are gone, nothing is protected. Reclaiming can retire more pointers,
+            // those are reclaimed right away.
+            dtor_ = true;
+            for (auto& retired : orphans_)
+            {
+                retired.reclaim(retired.ptr);
+            }
+
+            auto record = records_.load();
+            while (record)
+            {
+                auto next = record->next_;
+                for (auto& retired : record->retired_)
+                {
+                    retired.reclaim(retired.ptr);
+                }
+
+                delete record;
+                record = next;
+            }
+        }
+
+        static hazard_domain& instance()
+        {
+            static hazard_domain value;
+            return value;
+        }
+
+        // Reclaims ptr with reclaim(ptr) once no hazard pointer protects it. Caller makes sure that threads
+        // can no longer find ptr, so no hazard pointer can protect it after the ones present now are reset.
+        void retire(void* ptr, hazard_reclaim_function reclaim)
+        {
+            if (dtor_)
+            {
+                reclaim(ptr);
+                return;
+            }
+
+            auto& record = this->record();
+            record.retired_.push_back({ ptr, reclaim });
+            if (record.retired_.size() >= hazard_scan_threshold + 2 * hazard_slots * records_size_.load(std::memory_order_relaxed))
+            {
+                scan(record);
+            }
+        }
+
+        // Reclaims pointers retired by current thread and by exited threads that are not protected
+        void reclaim()
+        {
+            scan(record());
+        }
+
+        // Number of pointers retired by current thread and not reclaimed yet
+        size_t get_retired_size()
+        {
+            return record().retired_.size();
+        }
+
+    private:
+        hazard_domain() = default;
+
+        void scan(hazard_record& record)
+        {
+            // Reclaiming an object can retire others, they wait for the next scan
+            if (record.scanning_)
+                return;
+
+            record.scanning_ = true;
+
+            {
+                std::unique_lock< std::mutex > lock(mutex_, std::try_to_lock);
+                if (lock && !orphans_.empty())
+                {
+                    record.retired_.insert(record.retired_.end(), orphans_.begin(), orphans_.end());
+                    orphans_.clear();
+                }
+            }
+
+            // Pairs with the store and validation in protect(). Pointers were unlinked before they were retired,
+            // so a hazard published too late for this scan to see it failed its validation.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            auto& hazards = record.hazards_;
+            for (auto r = records_.load(std::memory_order_acquire); r; r = r->next_)
+            {
+                for (auto& slot : r->slots_)
+                {
+                    if (auto ptr = slot.load())
+                    {
+                        hazards.push_back(ptr);
+                    }
+                }
+            }
+
+            std::sort(hazards.begin(), hazards.end());
+
+            auto& reclaimed = record.reclaimed_;
+            reclaimed.swap(record.retired_);
+            for (auto& retired : reclaimed)
+            {
+                if (std::binary_search(hazards.begin(), hazards.end(), retired.ptr))
+                {
+                    record.retired_.push_back(retired);
+                }
+                else
+                {
+                    retired.reclaim(retired.ptr);
+                }
+            }
+
+            reclaimed.clear();
+            hazards.clear();
+            record.scanning_ = false;
+        }
+
+        hazard_record* acquire_record()
+        {
+            for (auto record = records_.load(std::memory_order_acquire); record; record = record->next_)
+            {
+                bool active = false;
+                if (!record->active_.load(std::memory_order_relaxed) && record->active_.compare_exchange_strong(active, true))
+                {
+                    return record;
+                }
+            }
+
+            auto record = new hazard_record();
+            record->next_ = records_.load(std::memory_order_relaxed);
+            while (!records_.compare_exchange_weak(record->next_, record));
+            ++records_size_;
+            return record;
+        }
+
+        // Retired pointers of the record are left to other threads, as reclaiming them here could retire more
+        // while the thread is exiting
+        void release_record(hazard_record* record)
+        {
+            assert(record->used_ == 0);
+            if (!record->retired_.empty())
+            {
+                std::lock_guard< std::mutex > lock(mutex_);
+                orphans_.insert(orphans_.end(), record->retired_.begin(), record->retired_.end());
+                record->retired_.clear();
+            }
+
+            record->active_.store(false, std::memory_order_release);
+        }
+
+        struct handle
+        {
+            handle()
+                : value(instance().acquire_record())
+            {}
+
+            ~handle()
+            {
+                instance().release_record(value);
+            }
+
+            hazard_record* value;
+        };
+
+        static hazard_record& record()
+        {
+            static thread_local handle handle;
+            return *handle.value;
+        }
+
+        std::atomic< hazard_record* > records_ = nullptr;
+        std::atomic< size_t > records_size_ = 0;
+        std::atomic< bool > dtor_ = false;
+
+        std::mutex mutex_;
+        std::vector< hazard_retired > orphans_;
+    };
+
+    // Hazard slot of current thread. A pointer read through protect() is not reclaimed until the slot is reset
+    // or protects another pointer.
+    class hazard_pointer
+    {
+    public:
+        hazard_pointer()
+            : record_(hazard_domain::record())
+            , index_(record_.acquire_slot())
+        {}
+
+        ~hazard_pointer()
+        {
+            reset();
+            record_.release_slot(index_);
+        }
+
+        hazard_pointer(const hazard_pointer&) = delete;
+        hazard_pointer& operator = (const hazard_pointer&) = delete;
+
+        // Publishes the value of source and returns it once source is seen to still hold it after the publication
+        template < typename T > T protect(const std::atomic< T >& source)
+        {
+            static_assert(sizeof(T) == sizeof(void*));
+
+            auto& slot = record_.get_slot(index_);
+            auto value = source.load(std::memory_order_relaxed);
+            while (true)
+            {
+                slot.store((const void*)value);
+                auto current = source.load();
+                if (current == value)
+                    return value;
+
+                value = current;
+            }
+        }
+
+        void reset()
+        {
+            record_.get_slot(index_).store(nullptr, std::memory_order_release);
+        }
+
+    private:
+        hazard_record& record_;
+        size_t index_;
+    };
+}
@@ -0,0 +1,151 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace smart_ptr
+{
+    // Counts of values by magnitude: bucket i holds values in [2^i, 2^(i+1)), bucket 0 holds 0 and 1 as well
+    struct histogram
+    {
+        static constexpr size_t size = 48;
+
+        std::array< uint64_t, size > buckets{};
+
+        static size_t get_bucket(uint64_t value)
+        {
+            size_t bucket = 0;
+            while (value >>= 1)
+                ++bucket;
+            return bucket < size ? bucket : size - 1;
+        }
+
+        uint64_t count() const
+        {
+            uint64_t count = 0;
+            for (auto value : buckets)
+                count += value;
+            return count;
+        }
+
+        // Upper bound of the bucket that holds given quantile, 0 for empty histogram
+        uint64_t quantile(double q) const
+        {
+            auto total = count();
+            if (!total)
+                return 0;
+
+            uint64_t rank = (uint64_t)(q * (total - 1)) + 1;
+            uint64_t count = 0;
+            for (size_t i = 0; i < size; ++i)
+            {
+                count += buckets[i];
+                if (count >= rank)
+                    return (uint64_t(2) << i) - 1;
+            }
+
+            return ~uint64_t(0);
+        }
+
+        histogram& operator += (const histogram& other)
+        {
+            for (size_t i = 0; i < size; ++i)
+                buckets[i] += other.buckets[i];
+            return *this;
+        }
+    };
+
+    // Snapshot of thread_counter and collector state. Counters are totals since the collector started.
+    struct collector_metrics
+    {
+        // References served by thread caches
+        uint64_t cache_hits = 0;
+
+        // Messages pushed to the collector, including references thread caches could not serve
+        uint64_t pushed = 0;
+
+        // Messages waiting in collector queues, one value per thread
+        std::vector< uint64_t > queue_depths;
+
+        // Drain rounds that processed messages, and their messages
+        uint64_t rounds = 0;
+        uint64_t messages = 0;
+
+        // Objects released by the collector
+        uint64_t released = 0;
+
+        // Objects tracked in tables of reference counts
+        uint64_t control_blocks = 0;
+
+        // Bytes of tables of reference counts
+        uint64_t table_bytes = 0;
+
+        // Decrements drained, but not applied yet
+        uint64_t pending_decrements = 0;
+
+        // Drain cycles of all shards forced by memory pressure
+        uint64_t pressure_drains = 0;
+
+        // Messages in a drain round
+        histogram batch_sizes;
+
+        // Duration of drain rounds in nanoseconds
+        histogram drain_latency;
+
+        // Nanoseconds from the push of the last decrement of an object to its release. Decrements are timed per drain
+        // round by the oldest message the round popped, so the value is an upper bound.
+        histogram release_latency;
+    };
+
+    // Counter updated by a single thread at a time and read by any thread
+    class metric
+    {
+    public:
+        void add(uint64_t value)
+        {
+            value_.store(value_.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        }
+
+        void set(uint64_t value)
+        {
+            value_.store(value, std::memory_order_relaxed);
+        }
+
+        uint64_t get() const
+        {
+            return value_.load(std::memory_order_relaxed);
+        }
+
+    private:
+        std::atomic< uint64_t > value_{};
+    };
+
+    // Histogram updated by a single thread at a time and read by any thread
+    class histogram_metric
+    {
+    public:
+        void add(uint64_t value)
+        {
+            buckets_[histogram::get_bucket(value)].add(1);
+        }
+
+        void read(histogram& value) const
+        {
+            for (size_t i = 0; i < histogram::size; ++i)
+                value.buckets[i] += buckets_[i].get();
+        }
+
+    private:
+        std::array< metric, histogram::size > buckets_;
+    };
+}
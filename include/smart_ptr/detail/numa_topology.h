@@ -0,0 +1,193 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#pragma once
+
+#include <smart_ptr/detail/cpu_traits.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if __has_include(<linux/mempolicy.h>)
+#include <linux/mempolicy.h>
+#endif
+#endif
+
+namespace smart_ptr
+{
+    // NUMA nodes with CPUs, as listed in /sys/devices/system/node. Nodes are numbered from 0 in the order of their
+    // ids, nodes without CPUs are left out. Systems without the directory are a single node with all CPUs.
+    class numa_topology
+    {
+    public:
+        static const numa_topology& instance()
+        {
+            static numa_topology value(read("/sys/devices/system/node"));
+            return value;
+        }
+
+        // Reads topology from a directory laid out as /sys/devices/system/node
+        static numa_topology read(const std::string& path)
+        {
+            std::vector< std::pair< uint32_t, std::vector< uint32_t > > > nodes;
+        #if defined(__linux__)
+            if (auto dir = opendir(path.c_str()))
+            {
+                while (auto entry = readdir(dir))
+                {
+                    std::string name = entry->d_name;
+                    if (name.compare(0, 4, "node") != 0 || name.size() == 4 || name.find_first_not_of("0123456789", 4) != std::string::npos)
+                        continue;
+
+                    std::ifstream file(path + "/" + name + "/cpulist");
+                    std::string list;
+                    if (std::getline(file, list))
+                    {
+                        auto cpus = parse_cpulist(list);
+                        if (!cpus.empty())
+                            nodes.emplace_back((uint32_t)std::stoul(name.substr(4)), std::move(cpus));
+                    }
+                }
+
+                closedir(dir);
+            }
+        #else
+            (void)path;
+        #endif
+
+            if (nodes.empty())
+            {
+                std::vector< uint32_t > cpus(default_cpu_traits::get_cpu_count());
+                for (uint32_t i = 0; i < cpus.size(); ++i)
+                    cpus[i] = i;
+                nodes.emplace_back(0, std::move(cpus));
+            }
+
+            std::sort(nodes.begin(), nodes.end());
+            return numa_topology(std::move(nodes));
+        }
+
+        // Parses a list of CPUs in the format of cpulist files, "0-3,8,10-11". Returns an empty list if the format is not valid.
+        static std::vector< uint32_t > parse_cpulist(const std::string& list)
+        {
+            std::vector< uint32_t > cpus;
+            size_t position = 0;
+            while (position < list.size() && list[position] != '\n')
+            {
+                uint32_t first, last;
+                if (!parse_number(list, position, first))
+                    return {};
+
+                last = first;
+                if (position < list.size() && list[position] == '-' && (!parse_number(list, ++position, last) || last < first))
+                    return {};
+
+                for (auto cpu = first; cpu <= last; ++cpu)
+                    cpus.push_back(cpu);
+
+                if (position < list.size() && list[position] == ',')
+                    ++position;
+            }
+
+            return cpus;
+        }
+
+        size_t get_node_count() const { return nodes_.size(); }
+
+        // System id of the node, as used by /sys and memory policies
+        uint32_t get_id(size_t node) const { return ids_[node]; }
+        const std::vector< uint32_t >& get_cpus(size_t node) const { return nodes_[node]; }
+
+        // Node of the CPU, 0 for CPUs not listed
+        uint32_t get_node(uint32_t cpu) const { return cpu < cpu_nodes_.size() ? cpu_nodes_[cpu] : 0; }
+
+        // Node current thread runs on. It is only a hint, same as the CPU id it comes from.
+        uint32_t get_current_node() const
+        {
+            return nodes_.size() > 1 ? get_node(default_cpu_traits::get_current_cpu_id()) : 0;
+        }
+
+        // Restricts current thread to CPUs of the node, returns false if that is not supported
+        bool bind_thread(size_t node) const
+        {
+        #if defined(__linux__)
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (auto cpu : nodes_[node])
+            {
+                if (cpu < CPU_SETSIZE)
+                    CPU_SET(cpu, &set);
+            }
+
+            return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+        #else
+            (void)node;
+            return false;
+        #endif
+        }
+
+        // Prefers physical memory of the node for page aligned range. Pages that were touched already stay where they are.
+        bool bind_memory(void* ptr, size_t size, size_t node) const
+        {
+        #if defined(__linux__) && defined(SYS_mbind) && defined(MPOL_PREFERRED)
+            const size_t bits = sizeof(unsigned long) * 8;
+            auto id = ids_[node];
+            std::vector< unsigned long > mask(id / bits + 1);
+            mask[id / bits] = 1ul << (id % bits);
+
+            // Kernel takes one bit less than maxnode says
+            return syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, mask.data(), mask.size() * bits + 1, 0) == 0;
+        #else
+            (void)ptr;
+            (void)size;
+            (void)node;
+            return false;
+        #endif
+        }
+
+    private:
+        numa_topology(std::vector< std::pair< uint32_t, std::vector< uint32_t > > > nodes)
+        {
+            for (auto& [id, cpus] : nodes)
+            {
+                for (auto cpu : cpus)
+                {
+                    if (cpu >= cpu_nodes_.size())
+                        cpu_nodes_.resize(cpu + 1);
+                    cpu_nodes_[cpu] = (uint32_t)nodes_.size();
+                }
+
+                ids_.push_back(id);
+                nodes_.push_back(std::move(cpus));
+            }
+        }
+
+        static bool parse_number(const std::string& list, size_t& position, uint32_t& value)
+        {
+            auto start = position;
+            value = 0;
+            while (position < list.size() && list[position] >= '0' && list[position] <= '9' && position - start < 9)
+                value = value * 10 + (list[position++] - '0');
+            return position != start;
+        }
+
+        std::vector< std::vector< uint32_t > > nodes_;
+        std::vector< uint32_t > ids_;
+        std::vector< uint32_t > cpu_nodes_;
+    };
+}
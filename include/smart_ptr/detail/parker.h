@@ -0,0 +1,98 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+
+namespace smart_ptr
+{
+    inline void cpu_relax()
+    {
+    #if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+        _mm_pause();
+    #endif
+    }
+
+    // Parking place of a single thread. The thread announces itself with prepare(), checks for work once more
+    // and then parks. Any thread can unpark it, unpark() between prepare() and park() makes park() return at once.
+    class parker
+    {
+    public:
+        void prepare()
+        {
+            state_.store(parked);
+        }
+
+        // Returns after unpark(), timeout or spuriously
+        void park(std::chrono::microseconds timeout)
+        {
+        #if defined(__linux__)
+            if (state_.load() == parked)
+            {
+                auto seconds = std::chrono::duration_cast< std::chrono::seconds >(timeout);
+                struct timespec ts;
+                ts.tv_sec = (time_t)seconds.count();
+                ts.tv_nsec = (long)std::chrono::duration_cast< std::chrono::nanoseconds >(timeout - seconds).count();
+                syscall(SYS_futex, &state_, FUTEX_WAIT_PRIVATE, parked, &ts, nullptr, 0);
+            }
+        #else
+            std::unique_lock< std::mutex > lock(mutex_);
+            cv_.wait_for(lock, timeout, [&] { return state_.load() != parked; });
+        #endif
+            state_.store(running);
+        }
+
+        void cancel()
+        {
+            state_.store(running);
+        }
+
+        // Cheap when the thread is not parked
+        void unpark()
+        {
+            if (state_.load() == parked && state_.exchange(running) == parked)
+            {
+            #if defined(__linux__)
+                syscall(SYS_futex, &state_, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+            #else
+                std::lock_guard< std::mutex > lock(mutex_);
+                cv_.notify_one();
+            #endif
+            }
+        }
+
+    private:
+        static constexpr uint32_t running = 0;
+        static constexpr uint32_t parked = 1;
+
+        // Futex operates on 32-bit words
+        static_assert(sizeof(std::atomic< uint32_t >) == sizeof(uint32_t));
+        std::atomic< uint32_t > state_{ running };
+
+    #if !defined(__linux__)
+        std::mutex mutex_;
+        std::condition_variable cv_;
+    #endif
+    };
+}
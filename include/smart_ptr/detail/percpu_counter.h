@@ -0,0 +1,216 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#pragma once
+
+#include <smart_ptr/detail/cpu_traits.h>
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+
+namespace smart_ptr
+{
+    // Reference count split between per-CPU slots, each slot on its own cache line, and a central count of slots
+    // that hold references, a scalable non-zero indicator.
+    //
+    // Increments go to the slot of the current CPU. Decrements take a reference from that slot, or from any slot
+    // that has one if the reference was taken on another CPU. Slots never go negative. A slot that becomes non-empty
+    // adds one to the central count before it does, a slot that becomes empty takes it away after it did, so the
+    // central count is never below the number of non-empty slots. It drops to zero only once no references are
+    // left, and the thread that takes it there releases the object. Every increment other than lock() copies
+    // a reference that is held already, so the count can not come back from zero.
+    //
+    // Threads migrating between CPUs only make the slot choice worse, all slot updates are atomic.
+    //
+    // Costs: every object allocates its slots up front, one cache line for each CPU rounded up to a power of two
+    // (64 B x 64 = 4 KB on a 64 CPU machine), so the counter fits long lived objects shared across many threads,
+    // not large numbers of small ones. Copies and releases on a CPU whose slot holds other references touch only
+    // that slot. The first reference taken on a CPU and the release that empties its slot also update the central
+    // count, so an object that is copied and dropped right away on CPUs that hold no other reference to it pays
+    // two shared updates per copy, as shared_counter does, on top of the slot updates. Releases of references
+    // taken on another CPU scan for a non-empty slot.
+    template < typename T, typename CpuTraits = default_cpu_traits > class percpu_counter
+    {
+        using slot_type = aligned< std::atomic< uint64_t > >;
+
+        enum class take_result
+        {
+            empty,
+            taken,
+            released,
+        };
+
+    public:
+        static constexpr bool deferred = false;
+
+        percpu_counter(void*)
+            : central_(1)
+            , weak_(1)
+            , mask_(get_slot_count() - 1)
+            , slots_(new slot_type[mask_ + 1]())
+        {
+            get_local_slot().store(1);
+        }
+
+        ~percpu_counter()
+        {
+            delete[] slots_;
+        }
+
+        void increment(void*)
+        {
+            add(get_local_slot(), 1);
+        }
+
+        void increment(void*, T refs)
+        {
+            add(get_local_slot(), refs);
+        }
+
+        bool decrement(void*)
+        {
+            // Caller holds the reference while it looks for it, so some slot is non-empty all the time
+            auto start = CpuTraits::get_current_cpu_id();
+            while (true)
+            {
+                for (uint32_t i = 0; i <= mask_; ++i)
+                {
+                    switch (take(slots_[(start + i) & mask_]))
+                    {
+                    case take_result::empty:
+                        break;
+                    case take_result::taken:
+                        return false;
+                    case take_result::released:
+                        return true;
+                    }
+                }
+            }
+        }
+
+        bool decrement(void* block, T refs)
+        {
+            auto& slot = get_local_slot();
+            auto count = slot.load();
+            while (count > refs)
+            {
+                if (slot.compare_exchange_weak(count, count - refs))
+                    return false;
+            }
+
+            // References the slot can not take are released one by one, only the last one can release the object
+            for (; refs > 1; --refs)
+            {
+                [[maybe_unused]] bool released = decrement(block);
+                assert(!released);
+            }
+
+            return decrement(block);
+        }
+
+        void increment_weak(void*)
+        {
+            ++weak_;
+        }
+
+        bool decrement_weak(void*)
+        {
+            return --weak_ == 0;
+        }
+
+        // Central count taken by lock() holds the object alive while the slot is updated
+        bool lock(void*)
+        {
+            auto central = central_.load();
+            do
+            {
+                if (central == 0)
+                    return false;
+            } while (!central_.compare_exchange_weak(central, central + 1));
+
+            add(get_local_slot(), 1);
+
+            // Reference taken above keeps some slot non-empty, so this is not the last one
+            [[maybe_unused]] auto previous = central_.fetch_sub(1);
+            assert(previous > 1);
+            return true;
+        }
+
+        bool expired(const void*) const
+        {
+            return central_.load() == 0;
+        }
+
+    private:
+        static uint32_t get_slot_count()
+        {
+            static const uint32_t count = []
+            {
+                uint32_t count = 1;
+                while (count < CpuTraits::get_cpu_count())
+                    count <<= 1;
+                return count;
+            }();
+
+            return count;
+        }
+
+        slot_type& get_local_slot()
+        {
+            return slots_[CpuTraits::get_current_cpu_id() & mask_];
+        }
+
+        // Caller holds a reference, so the central count stays above zero while it is corrected
+        void add(std::atomic< uint64_t >& slot, uint64_t refs)
+        {
+            auto count = slot.load();
+            while (true)
+            {
+                if (count > 0)
+                {
+                    if (slot.compare_exchange_weak(count, count + refs))
+                        return;
+
+                    continue;
+                }
+
+                // Slot that becomes non-empty is counted first
+                central_.fetch_add(1);
+                if (slot.compare_exchange_strong(count, refs))
+                    return;
+
+                // Other thread made the slot non-empty and counted it
+                [[maybe_unused]] auto previous = central_.fetch_sub(1);
+                assert(previous > 1);
+            }
+        }
+
+        take_result take(std::atomic< uint64_t >& slot)
+        {
+            auto count = slot.load();
+            while (count > 0)
+            {
+                if (slot.compare_exchange_weak(count, count - 1))
+                {
+                    // Slot that became empty stops being counted
+                    if (count == 1 && central_.fetch_sub(1) == 1)
+                        return take_result::released;
+
+                    return take_result::taken;
+                }
+            }
+
+            return take_result::empty;
+        }
+
+        std::atomic< uint64_t > central_;
+        std::atomic< T > weak_;
+        uint32_t mask_;
+        slot_type* slots_;
+    };
+}
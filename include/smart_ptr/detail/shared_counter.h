@@ -15,8 +15,11 @@ namespace smart_ptr
 
     template < typename T > struct shared_counter< T, true >
     {
+        static constexpr bool deferred = false;
+
         shared_counter(void*)
             : refs_(1)
+            , weak_(1)
         {}
 
         void increment(void*)
@@ -24,19 +27,60 @@ namespace smart_ptr
             ++refs_;
         }
 
+        void increment(void*, T refs)
+        {
+            refs_ += refs;
+        }
+
         bool decrement(void*)
         {
             return --refs_ == 0;
         }
 
+        bool decrement(void*, T refs)
+        {
+            return (refs_ -= refs) == 0;
+        }
+
+        void increment_weak(void*)
+        {
+            ++weak_;
+        }
+
+        bool decrement_weak(void*)
+        {
+            return --weak_ == 0;
+        }
+
+        bool lock(void*)
+        {
+            auto refs = refs_.load();
+            do
+            {
+                if (refs == 0)
+                    return false;
+            } while (!refs_.compare_exchange_weak(refs, refs + 1));
+
+            return true;
+        }
+
+        bool expired(const void*) const
+        {
+            return refs_.load() == 0;
+        }
+
     private:
         std::atomic< T > refs_;
+        std::atomic< T > weak_;
     };
 
     template < typename T > struct shared_counter< T, false >
     {
+        static constexpr bool deferred = false;
+
         shared_counter(void*)
             : refs_(1)
+            , weak_(1)
         {}
 
         void increment(void*)
@@ -44,12 +88,47 @@ namespace smart_ptr
             ++refs_;
         }
 
+        void increment(void*, T refs)
+        {
+            refs_ += refs;
+        }
+
         bool decrement(void*)
         {
             return --refs_ == 0;
         }
 
+        bool decrement(void*, T refs)
+        {
+            return (refs_ -= refs) == 0;
+        }
+
+        void increment_weak(void*)
+        {
+            ++weak_;
+        }
+
+        bool decrement_weak(void*)
+        {
+            return --weak_ == 0;
+        }
+
+        bool lock(void*)
+        {
+            if (refs_ == 0)
+                return false;
+
+            ++refs_;
+            return true;
+        }
+
+        bool expired(const void*) const
+        {
+            return refs_ == 0;
+        }
+
     private:
         T refs_;
+        T weak_;
     };
 }
@@ -0,0 +1,590 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#pragma once
+
+#include <smart_ptr/detail/numa_topology.h>
+
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace smart_ptr
+{
+    struct slab_options
+    {
+        // Back slabs with huge pages. Explicit huge pages are used if the system has them reserved, transparent huge pages otherwise.
+        bool huge_pages = false;
+
+        // Take slabs from memory of the NUMA node the allocating thread runs on. Each node has its own regions
+        // and keeps slabs of exited threads for its own threads.
+        bool numa = true;
+    };
+
+    // Slabs are aligned to their size, so the slab of a block is found by masking its address
+    static constexpr size_t slab_size = 1 << 16;
+
+    // Slabs are carved from regions of the size of a huge page
+    static constexpr size_t slab_region_size = 1 << 21;
+
+    // Size classes are multiples of 16 bytes, larger or more aligned allocations go to operator new
+    static constexpr size_t slab_class_size = 16;
+    static constexpr size_t slab_class_count = 32;
+    static constexpr size_t slab_max_size = slab_class_size * slab_class_count;
+
+    // Blocks freed by other threads are returned to the owning slab once there are this many of them
+    static constexpr size_t slab_batch_size = 64;
+
+    class slab_heap;
+
+    struct slab_block
+    {
+        slab_block* next;
+    };
+
+    // Header of a slab, blocks of a single size class follow it. Only the owning heap allocates from the slab
+    // and frees to its free list, other threads return blocks through the remote list.
+    struct alignas(64) slab
+    {
+        std::atomic< slab_heap* > owner;
+        uint32_t node;
+        size_t size;
+        slab_block* free;
+        char* bump;
+        slab* next;
+
+        alignas(64) std::atomic< slab_block* > remote;
+
+        static slab* get(const void* ptr)
+        {
+            return (slab*)((uintptr_t)ptr & ~(uintptr_t)(slab_size - 1));
+        }
+
+        void init(slab_heap* heap, size_t block_size, uint32_t region_node)
+        {
+            owner.store(heap, std::memory_order_relaxed);
+            node = region_node;
+            size = block_size;
+            free = nullptr;
+            bump = (char*)this + sizeof(slab);
+            next = nullptr;
+            remote.store(nullptr, std::memory_order_relaxed);
+        }
+
+        void* pop()
+        {
+            if (!free && (char*)this + slab_size - bump < (ptrdiff_t)size)
+            {
+                collect();
+            }
+
+            if (free)
+            {
+                auto block = free;
+                free = block->next;
+                return block;
+            }
+
+            if ((char*)this + slab_size - bump >= (ptrdiff_t)size)
+            {
+                auto block = bump;
+                bump += size;
+                return block;
+            }
+
+            return nullptr;
+        }
+
+        void push(void* ptr)
+        {
+            auto block = (slab_block*)ptr;
+            block->next = free;
+            free = block;
+        }
+
+        // Takes blocks other threads returned, owner only
+        bool collect()
+        {
+            if (!remote.load(std::memory_order_relaxed))
+                return false;
+
+            auto head = remote.exchange(nullptr, std::memory_order_acquire);
+            auto tail = head;
+            while (tail->next)
+                tail = tail->next;
+            tail->next = free;
+            free = head;
+            return true;
+        }
+
+        bool available() const
+        {
+            return free || (char*)this + slab_size - bump >= (ptrdiff_t)size || remote.load(std::memory_order_relaxed);
+        }
+
+        // Returns a chain of blocks from any thread
+        void push_remote(slab_block* head, slab_block* tail)
+        {
+            auto value = remote.load(std::memory_order_relaxed);
+            do
+            {
+                tail->next = value;
+            } while (!remote.compare_exchange_weak(value, head, std::memory_order_release, std::memory_order_relaxed));
+        }
+    };
+
+    static_assert(sizeof(slab) < slab_size / 8);
+
+    inline size_t get_slab_class(size_t size)
+    {
+        assert(size > 0 && size <= slab_max_size);
+        return (size - 1) / slab_class_size;
+    }
+
+    // Slabs of one thread, one list per size class
+    class slab_heap
+    {
+    public:
+        slab_heap() = default;
+        slab_heap(const slab_heap&) = delete;
+        slab_heap& operator = (const slab_heap&) = delete;
+
+        void* allocate(size_t size)
+        {
+            auto index = get_slab_class(size);
+            auto current = current_[index];
+            if (current)
+            {
+                if (auto ptr = current->pop())
+                    return ptr;
+            }
+
+            return allocate_slow(index);
+        }
+
+        // Owner only, other threads use slab::push_remote()
+        void deallocate(void* ptr)
+        {
+            slab::get(ptr)->push(ptr);
+        }
+
+        // Hands slabs over to the pool, blocks that are still allocated are returned to them remotely
+        void release();
+
+    private:
+        void* allocate_slow(size_t index);
+
+        std::array< slab*, slab_class_count > current_{};
+        std::array< slab*, slab_class_count > slabs_{};
+    };
+
+    // Process-wide source of slabs. Slabs of exited threads keep their size class and are given to the next heap
+    // of the same node that needs it. Regions are never returned to the system.
+    class slab_pool
+    {
+    public:
+        static slab_pool& instance()
+        {
+            // Never destroyed, blocks might be freed during static destruction
+            static slab_pool* value = new slab_pool(start());
+            return *value;
+        }
+
+        // Sets options of the pool. Has to be called before the first allocation, returns false if the pool is already in use.
+        static bool configure(const slab_options& options)
+        {
+            auto& config = get_configuration();
+            std::lock_guard< std::mutex > lock(config.mutex);
+            if (config.started)
+                return false;
+
+            config.options = options;
+            return true;
+        }
+
+        const slab_options& get_options() const { return options_; }
+
+        // Node current thread takes slabs from
+        uint32_t get_current_node() const
+        {
+            return nodes_.size() > 1 ? numa_topology::instance().get_current_node() : 0;
+        }
+
+        slab* acquire(slab_heap* heap, size_t index, uint32_t node)
+        {
+            std::lock_guard< std::mutex > lock(mutex_);
+            auto& slabs = nodes_[node];
+            auto value = slabs.orphans[index];
+            if (value)
+            {
+                slabs.orphans[index] = value->next;
+                value->next = nullptr;
+                value->owner.store(heap, std::memory_order_relaxed);
+                return value;
+            }
+
+            if (slabs.free.empty())
+            {
+                allocate_region(node);
+            }
+
+            value = new (slabs.free.back()) slab;
+            slabs.free.pop_back();
+            value->init(heap, (index + 1) * slab_class_size, node);
+            return value;
+        }
+
+        void release(slab* value)
+        {
+            std::lock_guard< std::mutex > lock(mutex_);
+            auto& slabs = nodes_[value->node];
+            auto index = get_slab_class(value->size);
+            value->owner.store(nullptr, std::memory_order_relaxed);
+            value->next = slabs.orphans[index];
+            slabs.orphans[index] = value;
+        }
+
+        // Serves threads that already exited
+        void* allocate(size_t size)
+        {
+            std::lock_guard< std::mutex > lock(heap_mutex_);
+            return heap_.allocate(size);
+        }
+
+    private:
+        struct configuration
+        {
+            std::mutex mutex;
+            slab_options options;
+            bool started = false;
+        };
+
+        static configuration& get_configuration()
+        {
+            static configuration value;
+            return value;
+        }
+
+        static slab_options start()
+        {
+            auto& config = get_configuration();
+            std::lock_guard< std::mutex > lock(config.mutex);
+            config.started = true;
+            return config.options;
+        }
+
+        struct node_slabs
+        {
+            std::vector< slab* > free;
+            std::array< slab*, slab_class_count > orphans{};
+        };
+
+        slab_pool(const slab_options& options)
+            : options_(options)
+            , nodes_(options.numa ? numa_topology::instance().get_node_count() : 1)
+        {}
+
+        void allocate_region(uint32_t node)
+        {
+            auto region = (char*)allocate_huge_region();
+            if (!region)
+            {
+                region = (char*)::operator new(slab_region_size, std::align_val_t(slab_size));
+            }
+
+            // Region was not touched yet, so its pages will come from the node
+            if (nodes_.size() > 1)
+            {
+                numa_topology::instance().bind_memory(region, slab_region_size, node);
+            }
+
+            for (size_t offset = slab_region_size; offset > 0; offset -= slab_size)
+            {
+                nodes_[node].free.push_back((slab*)(region + offset - slab_size));
+            }
+        }
+
+        void* allocate_huge_region()
+        {
+        #if defined(__linux__)
+            if (!options_.huge_pages)
+                return nullptr;
+
+            auto region = mmap(nullptr, slab_region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (region != MAP_FAILED)
+                return region;
+
+            // Over-allocate so the region can be aligned to the huge page and let the kernel back it with one
+            auto memory = (char*)mmap(nullptr, slab_region_size * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED)
+                return nullptr;
+
+            auto aligned = (char*)(((uintptr_t)memory + slab_region_size - 1) & ~(uintptr_t)(slab_region_size - 1));
+            if (aligned != memory)
+                munmap(memory, aligned - memory);
+            munmap(aligned + slab_region_size, memory + slab_region_size - aligned);
+        #if defined(MADV_HUGEPAGE)
+            madvise(aligned, slab_region_size, MADV_HUGEPAGE);
+        #endif
+            return aligned;
+        #else
+            return nullptr;
+        #endif
+        }
+
+        slab_options options_;
+        std::mutex mutex_;
+        std::vector< node_slabs > nodes_;
+
+        std::mutex heap_mutex_;
+        slab_heap heap_;
+    };
+
+    inline void* slab_heap::allocate_slow(size_t index)
+    {
+        // Blocks of current slab are used up, continue with any slab of the class that got some back
+        for (auto value = slabs_[index]; value; value = value->next)
+        {
+            if (value != current_[index] && value->available())
+            {
+                current_[index] = value;
+                return value->pop();
+            }
+        }
+
+        auto& pool = slab_pool::instance();
+        auto value = pool.acquire(this, index, pool.get_current_node());
+        value->next = slabs_[index];
+        slabs_[index] = value;
+        current_[index] = value;
+
+        // Adopted slab might be full until its blocks are returned
+        if (auto ptr = value->pop())
+            return ptr;
+        return allocate_slow(index);
+    }
+
+    inline void slab_heap::release()
+    {
+        auto& pool = slab_pool::instance();
+        for (size_t i = 0; i < slab_class_count; ++i)
+        {
+            while (auto value = slabs_[i])
+            {
+                slabs_[i] = value->next;
+                pool.release(value);
+            }
+
+            current_[i] = nullptr;
+        }
+    }
+
+    // Slab allocation state of current thread. Blocks of other threads' slabs are collected in batches
+    // per slab and returned with a single atomic operation.
+    class slab_thread
+    {
+    public:
+        static void* allocate(size_t size)
+        {
+            if (auto heap = get_heap())
+                return heap->allocate(size);
+            return slab_pool::instance().allocate(size);
+        }
+
+        static void deallocate(void* ptr)
+        {
+            auto value = slab::get(ptr);
+            auto heap = get_heap();
+            auto& state = get_state();
+            if (heap && value->owner.load(std::memory_order_relaxed) == heap)
+            {
+                heap->deallocate(ptr);
+            }
+            else if (state.exited)
+            {
+                value->push_remote((slab_block*)ptr, (slab_block*)ptr);
+            }
+            else
+            {
+                deallocate_remote(state, value, (slab_block*)ptr);
+            }
+        }
+
+        // Returns blocks batched by current thread to their slabs
+        static void flush()
+        {
+            auto& state = get_state();
+            for (auto& batch : state.batches)
+            {
+                flush(batch);
+            }
+        }
+
+    private:
+        static constexpr size_t batch_count = 8;
+
+        struct remote_batch
+        {
+            slab* owner;
+            slab_block* head;
+            slab_block* tail;
+            size_t size;
+        };
+
+        // Trivially destructible, so it can be used until the thread ends
+        struct thread_state
+        {
+            slab_heap* heap;
+            bool exited;
+            size_t victim;
+            std::array< remote_batch, batch_count > batches;
+        };
+
+        struct handle
+        {
+            handle()
+            {
+                get_state().heap = new slab_heap();
+            }
+
+            ~handle()
+            {
+                auto& state = get_state();
+                flush();
+                state.heap->release();
+                delete state.heap;
+                state.heap = nullptr;
+                state.exited = true;
+            }
+        };
+
+        static thread_state& get_state()
+        {
+            static thread_local thread_state value;
+            return value;
+        }
+
+        static slab_heap* get_heap()
+        {
+            auto& state = get_state();
+            if (!state.heap && !state.exited)
+            {
+                static thread_local handle value;
+            }
+
+            return state.heap;
+        }
+
+        static void deallocate_remote(thread_state& state, slab* owner, slab_block* block)
+        {
+            remote_batch* target = nullptr;
+            for (auto& batch : state.batches)
+            {
+                if (batch.owner == owner)
+                {
+                    target = &batch;
+                    break;
+                }
+
+                if (!batch.owner && !target)
+                {
+                    target = &batch;
+                }
+            }
+
+            if (!target)
+            {
+                // Batches of slabs that were not freed to recently are flushed in turn
+                target = &state.batches[state.victim++ % batch_count];
+                flush(*target);
+            }
+
+            if (!target->owner)
+            {
+                target->owner = owner;
+                target->tail = block;
+                block->next = nullptr;
+            }
+            else
+            {
+                block->next = target->head;
+            }
+
+            target->head = block;
+            if (++target->size == slab_batch_size)
+            {
+                flush(*target);
+            }
+        }
+
+        static void flush(remote_batch& batch)
+        {
+            if (batch.owner)
+            {
+                batch.owner->push_remote(batch.head, batch.tail);
+                batch = {};
+            }
+        }
+    };
+
+    // Frees blocks batched by current thread, collector calls it after each drain round that released something
+    inline void flush_slab_allocator()
+    {
+        slab_thread::flush();
+    }
+
+    // Allocates single objects of up to slab_max_size bytes from slabs of current thread. Blocks can be freed
+    // by any thread, blocks freed by other threads return to the owning slab in batches.
+    template < typename T > class slab_allocator
+    {
+    public:
+        using value_type = T;
+
+        template < typename U > struct rebind { using other = slab_allocator< U >; };
+
+        slab_allocator() noexcept = default;
+        template < typename U > slab_allocator(const slab_allocator< U >&) noexcept {}
+
+        T* allocate(size_t n)
+        {
+            if (is_slab(n))
+                return (T*)slab_thread::allocate(n * sizeof(T));
+            return std::allocator< T >().allocate(n);
+        }
+
+        void deallocate(T* ptr, size_t n)
+        {
+            if (is_slab(n))
+            {
+                slab_thread::deallocate(ptr);
+            }
+            else
+            {
+                std::allocator< T >().deallocate(ptr, n);
+            }
+        }
+
+        template < typename U > bool operator == (const slab_allocator< U >&) const noexcept { return true; }
+        template < typename U > bool operator != (const slab_allocator< U >&) const noexcept { return false; }
+
+    private:
+        static bool is_slab(size_t n)
+        {
+            return alignof(T) <= slab_class_size && n <= slab_max_size / sizeof(T);
+        }
+    };
+}
@@ -7,47 +7,51 @@
 
 #pragma once
 
+#include <smart_ptr/detail/find_index.h>
+
 #include <array>
-#include <immintrin.h>
+#include <cassert>
+#include <cstdint>
 
 namespace smart_ptr
 {
 
-    template< typename T, size_t N >  size_t find_index(const std::array< T, N >& values, T value)
-    {
-        for (size_t i = 0; i < values.size(); ++i)
-        {
-            if (values[i] == value)
-                return i;
-        }
-
-        return values.size();
-    }
-
-#if defined(__AVX2__)
-    inline size_t find_index(const std::array< uint64_t, 8 >& values, uint64_t value)
-    {
-        __m256i v = _mm256_loadu_si256((const __m256i*)values.data());
-        __m256i vcmp = _mm256_cmpeq_epi64(v, _mm256_set1_epi64x(value));
-        unsigned bitmask = _mm256_movemask_ps(_mm256_castsi256_ps(vcmp));
-        bitmask |= 1 << 16;
-        return _tzcnt_u32(bitmask);
-    }
-#endif
-
     template < typename Key, typename Value, size_t N > class thread_cache
     {
         static_assert(sizeof(Key) <= sizeof(uint64_t));
         static_assert(sizeof(Value) <= sizeof(uint64_t));
 
     public:
-        size_t get(Key key) const
-        {            
+        // Thread local storage of the cache in bytes, every thread using the cache has its own
+        static constexpr size_t get_local_size() { return sizeof(std::array< Key, N >) + sizeof(std::array< Value, N >); }
+
+        // Returns index of the key or end()
+        size_t find(Key key) const
+        {
+            return find_index(get_local_keys(), key);
+        }
+
+        // Returns index of the key, claiming a free slot for it if it is not present, or end() if the cache is full
+        size_t get(Key key)
+        {
             auto index = find_index(get_local_keys(), key);
             if (index < N)
                 return index;
 
-            return find_index(get_local_keys(), Key());
+            index = find_index(get_local_keys(), Key());
+            if (index < N)
+            {
+                get_local_keys()[index] = key;
+                get_local_values()[index] = Value();
+            }
+
+            return index;
+        }
+
+        // Cache never evicts, so there is nothing to flush
+        template < typename Evict > size_t get(Key key, Evict&&)
+        {
+            return get(key);
         }
 
         void erase(size_t index)
@@ -56,6 +60,20 @@ namespace smart_ptr
             get_local_keys()[index] = 0;
         }
 
+        // Passes every key with its value to fn and empties the cache
+        template < typename Fn > void clear(Fn&& fn)
+        {
+            auto& keys = get_local_keys();
+            for (size_t i = 0; i < N; ++i)
+            {
+                if (keys[i])
+                {
+                    fn(keys[i], get_local_values()[i]);
+                    keys[i] = 0;
+                }
+            }
+        }
+
         size_t end() const
         {
             return N;
@@ -87,7 +105,10 @@ namespace smart_ptr
         static_assert(sizeof(Value) <= sizeof(uint64_t));
         
     public:
-        size_t get(Key key) const
+        // Thread local storage of the cache in bytes, every thread using the cache has its own
+        static constexpr size_t get_local_size() { return sizeof(std::array< Key, N >) + sizeof(std::array< Value, N >) + sizeof(std::pair< Key, size_t >); }
+
+        size_t find(Key key) const
         {
             auto index = load(key);
             if (index < N)
@@ -96,15 +117,38 @@ namespace smart_ptr
             }
 
             index = find_index(get_local_keys(), key);
-            if (index >= N)
+            if (index < N)
+            {
+                store(key, index);
+            }
+
+            return index;
+        }
+
+        size_t get(Key key)
+        {
+            auto index = find(key);
+            if (index < N)
+            {
+                return index;
+            }
+
+            index = find_index(get_local_keys(), Key());
+            if (index < N)
             {
-                index = find_index(get_local_keys(), Key());
+                get_local_keys()[index] = key;
+                get_local_values()[index] = Value();
+                store(key, index);
             }
 
-            store(key, index);
             return index;
         }
 
+        template < typename Evict > size_t get(Key key, Evict&&)
+        {
+            return get(key);
+        }
+
         void erase(size_t index)
         {
             assert(index < N);
@@ -112,6 +156,21 @@ namespace smart_ptr
             invalidate(index);
         }
 
+        // Passes every key with its value to fn and empties the cache
+        template < typename Fn > void clear(Fn&& fn)
+        {
+            auto& keys = get_local_keys();
+            for (size_t i = 0; i < N; ++i)
+            {
+                if (keys[i])
+                {
+                    fn(keys[i], get_local_values()[i]);
+                    keys[i] = 0;
+                    invalidate(i);
+                }
+            }
+        }
+
         size_t end() const
         {
             return N;
@@ -160,4 +219,224 @@ namespace smart_ptr
                 pair.second = N;
         }
     };
+
+    // Cache that gives the slot of the least recently used key to a new key when it is full. Evicted key and its value
+    // are passed to the evict callback of get() first, so the owner can move the value elsewhere.
+    template < typename Key, typename Value, size_t N > class lru_thread_cache
+    {
+        static_assert(sizeof(Key) <= sizeof(uint64_t));
+        static_assert(sizeof(Value) <= sizeof(uint64_t));
+
+    public:
+        // Thread local storage of the cache in bytes, every thread using the cache has its own
+        static constexpr size_t get_local_size() { return sizeof(data_type); }
+
+        // Returns index of the key or end(), marking the key as used
+        size_t find(Key key)
+        {
+            auto& data = get_local_data();
+            auto index = find_index(data.keys, key);
+            if (index < N)
+            {
+                data.stamps[index] = ++data.clock;
+            }
+
+            return index;
+        }
+
+        // Returns index of the key, claiming a free or the least recently used slot for it if it is not present
+        template < typename Evict > size_t get(Key key, Evict&& evict)
+        {
+            auto& data = get_local_data();
+            auto index = find_index(data.keys, key);
+            if (index >= N)
+            {
+                index = find_index(data.keys, Key());
+                if (index >= N)
+                {
+                    index = get_oldest(data);
+                    evict(data.keys[index], data.values[index]);
+                }
+
+                data.keys[index] = key;
+                data.values[index] = Value();
+            }
+
+            data.stamps[index] = ++data.clock;
+            return index;
+        }
+
+        void erase(size_t index)
+        {
+            assert(index < N);
+            get_local_data().keys[index] = 0;
+        }
+
+        // Passes every key with its value to fn and empties the cache
+        template < typename Fn > void clear(Fn&& fn)
+        {
+            auto& data = get_local_data();
+            for (size_t i = 0; i < N; ++i)
+            {
+                if (data.keys[i])
+                {
+                    fn(data.keys[i], data.values[i]);
+                    data.keys[i] = 0;
+                }
+            }
+        }
+
+        size_t end() const
+        {
+            return N;
+        }
+
+        Value& operator [](size_t index)
+        {
+            assert(index < N);
+            return get_local_data().values[index];
+        }
+
+    private:
+        struct data_type
+        {
+            alignas(32) std::array< Key, N > keys;
+            alignas(32) std::array< Value, N > values;
+            std::array< uint64_t, N > stamps;
+            uint64_t clock;
+        };
+
+        static data_type& get_local_data()
+        {
+            static thread_local data_type data;
+            return data;
+        }
+
+        static size_t get_oldest(const data_type& data)
+        {
+            size_t index = 0;
+            for (size_t i = 1; i < N; ++i)
+            {
+                if (data.stamps[i] < data.stamps[index])
+                    index = i;
+            }
+
+            return index;
+        }
+    };
+
+    // Cache for large working sets. Key is hashed to a set of Ways slots, so lookups compare a single set regardless
+    // of the cache size. When the set is full, its slots are given to new keys in round-robin order and evicted key
+    // and its value are passed to the evict callback of get() first.
+    template < typename Key, typename Value, size_t Sets, size_t Ways = 4 > class set_associative_thread_cache
+    {
+        static_assert(sizeof(Key) <= sizeof(uint64_t));
+        static_assert(sizeof(Value) <= sizeof(uint64_t));
+        static_assert(Sets > 0 && (Sets & (Sets - 1)) == 0);
+        static_assert(Ways > 0 && Ways <= 256);
+
+    public:
+        // Thread local storage of the cache in bytes, every thread using the cache has its own
+        static constexpr size_t get_local_size() { return sizeof(data_type); }
+
+        // Returns index of the key or end()
+        size_t find(Key key) const
+        {
+            auto set = get_set(key);
+            auto way = find_index(get_local_data().keys[set], key);
+            return way < Ways ? set * Ways + way : end();
+        }
+
+        // Returns index of the key, claiming a free or the next slot of its set for it if it is not present
+        template < typename Evict > size_t get(Key key, Evict&& evict)
+        {
+            auto& data = get_local_data();
+            auto set = get_set(key);
+            auto& keys = data.keys[set];
+            auto way = find_index(keys, key);
+            if (way >= Ways)
+            {
+                way = find_index(keys, Key());
+                if (way >= Ways)
+                {
+                    way = data.victims[set];
+                    data.victims[set] = (uint8_t)((way + 1) % Ways);
+                    evict(keys[way], data.values[set * Ways + way]);
+                }
+
+                keys[way] = key;
+                data.values[set * Ways + way] = Value();
+            }
+
+            return set * Ways + way;
+        }
+
+        void erase(size_t index)
+        {
+            assert(index < end());
+            get_local_data().keys[index / Ways][index % Ways] = 0;
+        }
+
+        // Passes every key with its value to fn and empties the cache
+        template < typename Fn > void clear(Fn&& fn)
+        {
+            auto& data = get_local_data();
+            for (size_t i = 0; i < end(); ++i)
+            {
+                auto& key = data.keys[i / Ways][i % Ways];
+                if (key)
+                {
+                    fn(key, data.values[i]);
+                    key = 0;
+                }
+            }
+        }
+
+        size_t end() const
+        {
+            return Sets * Ways;
+        }
+
+        Value& operator [](size_t index)
+        {
+            assert(index < end());
+            return get_local_data().values[index];
+        }
+
+    private:
+        struct data_type
+        {
+            alignas(64) std::array< std::array< Key, Ways >, Sets > keys;
+            alignas(64) std::array< Value, Sets * Ways > values;
+            std::array< uint8_t, Sets > victims;
+        };
+
+        static data_type& get_local_data()
+        {
+            static thread_local data_type data;
+            return data;
+        }
+
+        static size_t get_set(Key key)
+        {
+            if constexpr (Sets == 1)
+            {
+                return 0;
+            }
+            else
+            {
+                // Fibonacci hashing spreads aligned addresses over the upper bits
+                constexpr uint32_t shift = 64 - get_log2(Sets);
+                return (size_t)(((uint64_t)key * 0x9E3779B97F4A7C15ull) >> shift);
+            }
+        }
+
+        static constexpr uint32_t get_log2(size_t value)
+        {
+            uint32_t log2 = 0;
+            while (value >>= 1)
+                ++log2;
+            return log2;
+        }
+    };
 }
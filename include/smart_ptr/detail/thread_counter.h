@@ -8,6 +8,11 @@
 #pragma once
 
 #include <smart_ptr/detail/thread_cache.h>
+#include <smart_ptr/detail/hash_table.h>
+#include <smart_ptr/detail/metrics.h>
+#include <smart_ptr/detail/numa_topology.h>
+#include <smart_ptr/detail/parker.h>
+#include <smart_ptr/detail/slab_allocator.h>
 #include <smart_ptr/shared_ptr.h>
 #include <smart_ptr/detail/shared_counter.h>
 
@@ -16,67 +21,749 @@
 #include <thread>
 #include <mutex>
 #include <vector>
-#include <unordered_map>
 #include <cassert>
 #include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <limits>
+#include <memory>
 #include <new>
 
+#if defined(__linux__)
+#include <unistd.h>
+#endif
+
 namespace smart_ptr
 {
     const size_t collector_queue_size = 1 << 12;
+
+    // Initial capacity of collector's table of reference counts, it grows as needed and shrinks back when idle
+    const size_t collector_table_size = 1 << 12;
+
+    // Idle drain rounds a drain thread spins and then yields before it parks
+    const size_t collector_spin_rounds = 64;
+    const size_t collector_yield_rounds = 64;
+
+    // Parked drain thread still checks its queues this often, as threads that push less than wakeup threshold do not wake it
+    const std::chrono::milliseconds collector_park_time(10);
+
+    // How often the first drain thread checks memory pressure, if it is configured
+    const std::chrono::milliseconds collector_pressure_interval(10);
+
+    // Message is a thread_counter_base address with the lowest bit set for increment. Upper 16 bits above
+    // the address hold the number of references minus one.
     using collector_message = uintptr_t;
-    
-    class collector_queue: public queue::bounded_queue_spsc2< collector_message, queue::static_storage< collector_message, collector_queue_size > >
+
+    static_assert(sizeof(collector_message) == sizeof(uint64_t));
+    const collector_message collector_address_mask = (collector_message(1) << 48) - 2;
+    const size_t collector_max_refs = size_t(1) << 16;
+
+    using collector_queue = queue::bounded_queue_spsc2< collector_message, queue::static_storage< collector_message, collector_queue_size > >;
+
+    // What a thread does when its queue to a collector shard is full
+    enum class collector_backpressure
+    {
+        // Runs a drain round of the shard itself. Pinned threads and threads already draining spin or grow instead.
+        help,
+
+        // Waits for the drain thread
+        spin,
+
+        // Keeps messages that did not fit in an unbounded overflow list
+        grow,
+    };
+
+    struct collector_options
+    {
+        // Number of drain threads, rounded up to a multiple of NUMA nodes
+        size_t shards = std::max(std::thread::hardware_concurrency() / 8, 1u);
+
+        // Splits shards evenly between NUMA nodes and keeps their drain threads on CPUs of the node. Counters go
+        // to shards of the node they were created on, which is where their blocks were allocated from slabs.
+        bool numa = true;
+
+        collector_backpressure backpressure = collector_backpressure::help;
+
+        // Number of messages a thread pushes to a queue before it wakes up a parked drain thread
+        size_t wakeup_threshold = collector_queue_size / 8;
+
+        // Bounded lag: a thread with more than this many messages to a shard that the collector did not drain yet
+        // waits until half of them are drained, so objects waiting for release are bounded by threads, shards and
+        // the limit. 0 leaves the lag bounded only by queue sizes, or not at all with grow backpressure.
+        size_t max_pending_messages = 0;
+
+        // What a thread over the lag limit does, help or spin. Pinned threads and threads already draining spin
+        // or do not wait at all.
+        collector_backpressure lag_backpressure = collector_backpressure::help;
+
+        // Memory pressure makes the first drain thread run collector::flush() for all shards right away: resident
+        // memory above rss_limit bytes (Linux only) or memory_pressure returning true. Both are off by default.
+        size_t rss_limit = 0;
+        std::function< bool() > memory_pressure;
+
+        // Maintains metrics returned by collector::get_metrics(). Costs a relaxed store per thread_counter
+        // operation, a clock read for the first push after the collector popped the thread's queue and a few
+        // clock reads per drain round. Can be changed later with collector::set_metrics().
+        bool metrics = false;
+    };
+
+    // Messages of a single producer thread to one collector shard
+    class collector_channel
+    {
+    public:
+        struct metrics
+        {
+            metric pushed;
+            metric popped;
+
+            // Steady clock ticks of the first push since the collector last took the value, 0 if there was none
+            std::atomic< int64_t > first_push = 0;
+        };
+
+        collector_queue& get_queue() { return queue_; }
+        metrics& get_metrics() { return metrics_; }
+
+        // Records the time of the push if the collector took the previous one, called by the owner thread before the push
+        void stamp_push()
+        {
+            if (!metrics_.first_push.load(std::memory_order_relaxed))
+                metrics_.first_push.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+        }
+
+        // Time of the oldest message pushed since the last call, 0 if there was none. Called by the collector before it
+        // pops, so messages it pops are not newer. A push racing with the call can leave its message without time.
+        int64_t take_first_push() { return metrics_.first_push.exchange(0, std::memory_order_relaxed); }
+
+        // Counts pushes of the owner thread, returns true every threshold messages
+        bool count_push(size_t threshold)
+        {
+            if (++pushed_ < threshold)
+                return false;
+
+            pushed_ = 0;
+            return true;
+        }
+
+        // Counts every message pushed by the owner thread and popped by the collector, for the lag limit
+        void count_pushed() { ++pushed_total_; }
+        void count_popped(size_t popped) { popped_total_.add(popped); }
+
+        // Messages pushed by the owner thread and not popped yet, called by the owner thread
+        size_t get_pending() const { return pushed_total_ - popped_total_.get(); }
+
+        // Messages pushed by the owner thread, called by the owner thread
+        size_t get_pushed() const { return pushed_total_; }
+
+        void push_overflow(collector_message message)
+        {
+            std::lock_guard< std::mutex > lock(overflow_mutex_);
+            overflow_.push_back(message);
+            overflowed_.store(true);
+        }
+
+        // Swaps overflowed messages with (empty) messages, returns false if there were none
+        bool pop_overflow(std::vector< collector_message >& messages)
+        {
+            if (!overflowed_.load())
+                return false;
+
+            std::lock_guard< std::mutex > lock(overflow_mutex_);
+            overflow_.swap(messages);
+            overflowed_.store(false);
+            return true;
+        }
+
+    private:
+        collector_queue queue_;
+        metrics metrics_;
+        size_t pushed_ = 0;
+        size_t pushed_total_ = 0;
+        metric popped_total_;
+        std::atomic< bool > overflowed_ = false;
+        std::mutex overflow_mutex_;
+        std::vector< collector_message > overflow_;
+    };
+
+    // Channels of a single producer thread, one for every collector shard
+    class collector_producer
     {
     public:
+        collector_producer(size_t shards)
+            : channels_(new collector_channel[shards])
+        {}
+
+        collector_channel& get_channel(size_t shard) { return channels_[shard]; }
+        metric& get_cache_hits() { return cache_hits_; }
+
         void set_released(bool released) { released_ = released; }
         bool is_released() const { return released_; }
+
+        // Functions called by the owner thread when it exits, before the producer is released
+        void add_exit_hook(void (*hook)()) { exit_hooks_.push_back(hook); }
+
+        // Functions that return references cached by the owner thread, called by collector::flush() on that thread
+        void add_flush_hook(void (*hook)()) { flush_hooks_.push_back(hook); }
+
+        void run_flush_hooks()
+        {
+            for (auto hook : flush_hooks_)
+            {
+                hook();
+            }
+        }
+
+        void run_exit_hooks()
+        {
+            // Hooks can push and so add more hooks
+            for (size_t i = 0; i < exit_hooks_.size(); ++i)
+            {
+                exit_hooks_[i]();
+            }
+        }
+
+        // Pins are nested, only the outermost one is published to the collector
+        void pin(uint64_t epoch)
+        {
+            if (pins_++ == 0)
+            {
+                ++pin_serial_;
+                pinned_.store(epoch);
+            }
+        }
+
+        void unpin()
+        {
+            assert(pins_ > 0);
+            if (--pins_ == 0)
+                pinned_.store(0, std::memory_order_release);
+        }
+
+        // Called by the owner thread
+        bool is_pinned() const { return pins_ > 0; }
+
+        // Number of the outermost pin, called by the owner thread
+        uint64_t get_pin_serial() const { return pin_serial_; }
+
+        // Collector epoch observed when the owner thread pinned itself, 0 if it is not pinned
+        uint64_t get_pinned() const { return pinned_.load(); }
+
     private:
+        std::unique_ptr< collector_channel[] > channels_;
+        metric cache_hits_;
+        std::vector< void (*)() > exit_hooks_;
+        std::vector< void (*)() > flush_hooks_;
         bool released_ = false;
+        size_t pins_ = 0;
+        uint64_t pin_serial_ = 0;
+        alignas(64) std::atomic< uint64_t > pinned_ = 0;
+    };
+
+    // Identifies a pinned region of a thread, it is used to check that borrowed pointers do not outlive their pin
+    struct pin_id
+    {
+        const collector_producer* producer = nullptr;
+        uint64_t serial = 0;
+
+        bool operator == (const pin_id& other) const { return producer == other.producer && serial == other.serial; }
+        bool operator != (const pin_id& other) const { return !(*this == other); }
     };
 
-    // Collector queue is not used without lock from different threads, so it uses non-atomic shared_ptr counter
-    using collector_queue_ptr = shared_ptr< collector_queue, shared_counter< uint64_t, false > >;
+    // Collector producer is not used without lock from different threads, so it uses non-atomic shared_ptr counter
+    using collector_producer_ptr = shared_ptr< collector_producer, shared_counter< uint64_t, false > >;
+
+    // Part of thread_counter that is accessed by collector
+    class thread_counter_base
+    {
+        static constexpr int64_t destroyed = std::numeric_limits< int64_t >::min();
+
+    public:
+        // Releases the block that holds the counter, the block is a control block or an intrusive object
+        using release_function = void (*)(thread_counter_base* counter);
+
+        thread_counter_base(release_function release, uint32_t node)
+            : release_(release)
+            , locked_(0)
+            , weak_(1)
+            , node_(node)
+        {}
+
+        uint32_t get_node() const { return node_; }
+
+        void increment_weak(void*)
+        {
+            ++weak_;
+        }
+
+        bool decrement_weak(void*)
+        {
+            return --weak_ == 0;
+        }
+
+        // References created by weak_ptr::lock() are not sent to collector, they are counted here instead
+        // so the collector can atomically decide between destruction and a concurrent lock().
+        bool lock(void*)
+        {
+            auto locked = locked_.load();
+            do
+            {
+                if (locked == destroyed)
+                    return false;
+            } while (!locked_.compare_exchange_weak(locked, locked + 1));
+
+            return true;
+        }
 
+        bool expired(const void*) const
+        {
+            return locked_.load() == destroyed;
+        }
+
+        // Called by collector when its tally of references drops to zero or below.
+        // Tally together with locked references is the real reference count.
+        bool release(int64_t refs)
+        {
+            int64_t locked = -refs;
+            if (!locked_.compare_exchange_strong(locked, destroyed))
+                return false;
+
+            release_(this);
+            return true;
+        }
+
+    private:
+        release_function release_;
+        std::atomic< int64_t > locked_;
+        std::atomic< uint32_t > weak_;
+
+        // NUMA node of the thread that created the counter, selects shards of the collector
+        uint32_t node_;
+    };
+
+    // Collector is split into shards, each with its own drain thread and table of reference counts. Messages are routed
+    // by counter address, so all messages of a counter end up in the same shard, in the order they were pushed by each thread.
+    // On NUMA systems every node has its own shards, a counter is routed among shards of the node it was created on.
+    //
+    // Drain thread with nothing to do spins, yields and then parks until a thread pushes wakeup threshold messages
+    // to its shard, fills the queue or park time elapses.
     class collector
     {
     public:
-        collector()
+        collector(const collector_options& options)
+            : nodes_(options.numa ? numa_topology::instance().get_node_count() : 1)
+            , options_(round_shards(options, nodes_))
+            , max_pending_messages_(options.max_pending_messages)
+            , metrics_(options.metrics)
+            , shards_(new shard[options_.shards])
         {
-            thread_ = std::thread([&]
+            for (size_t i = 0; i < options_.shards; ++i)
             {
-                drain_state state;
-                while (!dtor_)
-                {
-                    drain(state);
-                }
-            });
+                shards_[i].index = i;
+                shards_[i].node = i / (options_.shards / nodes_);
+                shards_[i].thread = std::thread([this, i] { run(i); });
+            }
         }
 
         ~collector()
-        {            
+        {
             dtor_ = true;
-            thread_.join();
+            for (size_t i = 0; i < options_.shards; ++i)
+            {
+                shards_[i].parker.unpark();
+                shards_[i].thread.join();
+            }
 
-            drain_state state;
-            while(drain(state));
+            for (size_t i = 0; i < options_.shards; ++i)
+            {
+                while(drain(i));
+            }
         }
 
         static collector& instance()
         {
-            static collector value;
+            static collector value(start());
+            return value;
+        }
+
+        // Sets options of the collector. Has to be called before the first thread_counter is created,
+        // returns false if the collector is already running.
+        static bool configure(const collector_options& options)
+        {
+            assert(options.shards > 0);
+            assert(options.wakeup_threshold > 0);
+            auto& config = get_configuration();
+            std::lock_guard< std::mutex > lock(config.mutex);
+            if (config.started)
+                return false;
+
+            config.options = options;
+            return true;
+        }
+
+        const collector_options& get_options() const { return options_; }
+        size_t get_shard_count() const { return options_.shards; }
+        size_t get_node_count() const { return nodes_; }
+
+        // NUMA node of current thread that new counters are assigned to
+        uint32_t get_current_node() const
+        {
+            return nodes_ > 1 ? numa_topology::instance().get_current_node() : 0;
+        }
+
+        // A message carries up to collector_max_refs references, larger deltas take more messages
+        void increment(thread_counter_base* counter, size_t refs = 1)
+        {
+            for (; refs > collector_max_refs; refs -= collector_max_refs)
+            {
+                push(counter, make_message(counter, collector_max_refs) | 1);
+            }
+
+            push(counter, make_message(counter, refs) | 1);
+        }
+
+        void decrement(thread_counter_base* counter, size_t refs = 1)
+        {
+            for (; refs > collector_max_refs; refs -= collector_max_refs)
+            {
+                push(counter, make_message(counter, collector_max_refs));
+            }
+
+            push(counter, make_message(counter, refs));
+        }
+
+        // While a thread is pinned, collector does not start a new drain round, so pointers
+        // read during the pin stay valid until the thread increments them or unpins.
+        void pin()
+        {
+            producer().pin(epoch_.load());
+        }
+
+        void unpin()
+        {
+            producer().unpin();
+        }
+
+        // Outermost pin of current thread, default value if the thread is not pinned
+        pin_id get_pin()
+        {
+            auto& producer = this->producer();
+            return producer.is_pinned() ? pin_id{ &producer, producer.get_pin_serial() } : pin_id();
+        }
+
+        // Returns references cached by current thread, then blocks until messages pushed before the call are drained
+        // and objects they released are destroyed, together with objects released by those destructors. Caches of
+        // other threads keep their references. Waits for pinned threads like any drain round, so it must not be
+        // called while pinned.
+        void flush()
+        {
+            assert(!producer().is_pinned());
+            assert(!is_draining());
+            if (!is_exited())
+            {
+                producer().run_flush_hooks();
+            }
+
+            is_draining() = true;
+            reclaim();
+            is_draining() = false;
+        }
+
+        // Registers a function current thread calls when it exits, while it can still push messages.
+        // Returns false if the thread is already past that point.
+        bool at_thread_exit(void (*hook)())
+        {
+            if (is_exited())
+                return false;
+
+            producer().add_exit_hook(hook);
+            return true;
+        }
+
+        // Registers a function that returns references cached by current thread, flush() calls it before it drains.
+        // Returns false if the thread already exited.
+        bool at_flush(void (*hook)())
+        {
+            if (is_exited())
+                return false;
+
+            producer().add_flush_hook(hook);
+            return true;
+        }
+
+        // Changes the lag limit of a running collector, 0 disables it. See collector_options::max_pending_messages.
+        void set_max_pending_messages(size_t limit)
+        {
+            max_pending_messages_.store(limit, std::memory_order_relaxed);
+        }
+
+        // Enables or disables metrics of a running collector. Metrics count only what happened while they were enabled.
+        // See collector_options::metrics.
+        void set_metrics(bool enabled)
+        {
+            metrics_.store(enabled, std::memory_order_relaxed);
+        }
+
+        // Messages of current thread that the collector did not drain yet
+        size_t get_pending_messages()
+        {
+            auto& producer = this->producer();
+            size_t pending = 0;
+            for (size_t i = 0; i < options_.shards; ++i)
+            {
+                pending += producer.get_channel(i).get_pending();
+            }
+
+            return pending;
+        }
+
+        // Counts a reference served by the thread cache of current thread
+        void count_cache_hit()
+        {
+            if (has_metrics())
+                producer().get_cache_hits().add(1);
+        }
+
+        // Returns empty metrics while they are disabled
+        collector_metrics get_metrics()
+        {
+            collector_metrics metrics;
+            if (!has_metrics())
+                return metrics;
+
+            {
+                std::lock_guard< std::mutex > lock(mutex_);
+                metrics.cache_hits = retired_cache_hits_;
+                metrics.pushed = retired_pushed_;
+                metrics.pressure_drains = pressure_drains_.get();
+
+                // Producers of exited threads are counted in retired totals already
+                for (auto& producer : shards_[0].producers)
+                {
+                    if (producer->is_released())
+                        continue;
+
+                    uint64_t depth = 0;
+                    for (size_t i = 0; i < options_.shards; ++i)
+                    {
+                        // Pop is counted after push, only messages pushed before metrics were enabled can be popped more
+                        auto& channel = producer->get_channel(i).get_metrics();
+                        auto popped = channel.popped.get();
+                        auto pushed = channel.pushed.get();
+                        metrics.pushed += pushed;
+                        depth += pushed > popped ? pushed - popped : 0;
+                    }
+
+                    metrics.cache_hits += producer->get_cache_hits().get();
+                    metrics.queue_depths.push_back(depth);
+                }
+            }
+
+            for (size_t i = 0; i < options_.shards; ++i)
+            {
+                // Round updates several metrics, they are consistent with each other between rounds
+                std::lock_guard< std::mutex > lock(shards_[i].drain_mutex);
+                auto& shard = shards_[i].metrics;
+                metrics.rounds += shard.rounds.get();
+                metrics.messages += shard.messages.get();
+                metrics.released += shard.released.get();
+                metrics.control_blocks += shard.control_blocks.get();
+                metrics.table_bytes += shard.table_bytes.get();
+                metrics.pending_decrements += shard.pending_decrements.get();
+                shard.batch_sizes.read(metrics.batch_sizes);
+                shard.drain_latency.read(metrics.drain_latency);
+                shard.release_latency.read(metrics.release_latency);
+            }
+
+            return metrics;
+        }
+
+    private:
+        using clock = std::chrono::steady_clock;
+
+        bool has_metrics() const { return metrics_.load(std::memory_order_relaxed); }
+
+        struct configuration
+        {
+            std::mutex mutex;
+            collector_options options;
+            bool started = false;
+        };
+
+        static configuration& get_configuration()
+        {
+            static configuration value;
             return value;
         }
 
-        void push(collector_message msg)
-        {
-            queue().push(msg);
+        static collector_options start()
+        {
+            auto& config = get_configuration();
+            std::lock_guard< std::mutex > lock(config.mutex);
+            config.started = true;
+            return config.options;
+        }
+
+        // Every node gets the same number of shards
+        static collector_options round_shards(collector_options options, size_t nodes)
+        {
+            options.shards = (options.shards + nodes - 1) / nodes * nodes;
+            return options;
+        }
+
+        // Set for drain threads and threads helping to drain, they must not wait for a drain round
+        static bool& is_draining()
+        {
+            static thread_local bool value = false;
+            return value;
+        }
+
+        static collector_message make_message(const thread_counter_base* counter, size_t refs)
+        {
+            assert(((collector_message)counter & ~collector_address_mask) == 0);
+            assert(refs > 0 && refs <= collector_max_refs);
+            return (collector_message)counter | (collector_message)(refs - 1) << 48;
+        }
+
+        static thread_counter_base* get_counter(collector_message message)
+        {
+            return (thread_counter_base*)(message & collector_address_mask);
+        }
+
+        static int64_t get_refs(collector_message message)
+        {
+            return (int64_t)(message >> 48) + 1;
+        }
+
+        // Address is mixed independently of hash_table's hashing, so counters of a shard still spread over its table.
+        // Counter itself is read only with several nodes, it is usually in cache of the thread using the object.
+        size_t get_shard(const thread_counter_base* counter) const
+        {
+            if (options_.shards == 1)
+                return 0;
+
+            auto shards = options_.shards / nodes_;
+            auto first = nodes_ > 1 ? counter->get_node() % nodes_ * shards : 0;
+            if (shards == 1)
+                return first;
+
+            auto hash = (uint64_t)counter >> 4;
+            hash ^= hash >> 33;
+            hash *= 0xff51afd7ed558ccdull;
+            hash ^= hash >> 33;
+            return first + (size_t)(((hash & 0xffffffff) * shards) >> 32);
+        }
+
+        void push(const thread_counter_base* counter, collector_message message)
+        {
+            auto index = get_shard(counter);
+            if (is_exited())
+            {
+                push_exited(index, message);
+                return;
+            }
+
+            auto& producer = this->producer();
+            auto& channel = producer.get_channel(index);
+            if (has_metrics())
+            {
+                channel.get_metrics().pushed.add(1);
+                channel.stamp_push();
+            }
+
+            channel.count_pushed();
+            if (!channel.get_queue().push(message))
+            {
+                push_full(producer, index, message);
+            }
+            else if (channel.count_push(options_.wakeup_threshold))
+            {
+                // Pairs with the drain thread checking its queues after it announced parking
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                shards_[index].parker.unpark();
+            }
+
+            auto limit = max_pending_messages_.load(std::memory_order_relaxed);
+            if (limit && channel.get_pending() > limit && !is_draining())
+            {
+                catch_up(producer, index, limit);
+            }
+        }
+
+        // Waits for the collector to drain half of the lag limit. As with full queues, a pinned thread only spins,
+        // the collector keeps popping its queues while it waits for the pin.
+        void catch_up(collector_producer& producer, size_t index, size_t limit)
+        {
+            auto& shard = shards_[index];
+            auto& channel = producer.get_channel(index);
+            shard.parker.unpark();
+
+            auto backpressure = options_.lag_backpressure;
+            if (producer.is_pinned())
+            {
+                backpressure = collector_backpressure::spin;
+            }
+
+            assert(backpressure != collector_backpressure::grow);
+            while (channel.get_pending() > limit / 2)
+            {
+                if (backpressure == collector_backpressure::help && shard.drain_mutex.try_lock())
+                {
+                    is_draining() = true;
+                    drain(shard);
+                    is_draining() = false;
+                    shard.drain_mutex.unlock();
+                }
+                else
+                {
+                    std::this_thread::yield();
+                }
+            }
+        }
+
+        // Collector drains queues of pinned threads while it waits for them, so waiting for a full queue can not deadlock.
+        // A pinned thread can not run a drain round though, as the round would wait for it to unpin.
+        void push_full(collector_producer& producer, size_t index, collector_message message)
+        {
+            auto& shard = shards_[index];
+            auto& channel = producer.get_channel(index);
+            shard.parker.unpark();
+
+            auto backpressure = options_.backpressure;
+            if (is_draining())
+            {
+                backpressure = collector_backpressure::grow;
+            }
+            else if (backpressure == collector_backpressure::help && producer.is_pinned())
+            {
+                backpressure = collector_backpressure::spin;
+            }
+
+            if (backpressure == collector_backpressure::grow)
+            {
+                channel.push_overflow(message);
+                return;
+            }
+
+            do
+            {
+                if (backpressure == collector_backpressure::help && shard.drain_mutex.try_lock())
+                {
+                    // Objects released during the round might push as well
+                    is_draining() = true;
+                    drain(shard);
+                    is_draining() = false;
+                    shard.drain_mutex.unlock();
+                }
+                else
+                {
+                    std::this_thread::yield();
+                }
+            } while (!channel.get_queue().push(message));
         }
 
-    private:
-        static collector_queue& queue()
+        static collector_producer& producer()
         {
-            static thread_local handle< collector_queue* > handle;
+            static thread_local handle< collector_producer* > handle;
             return *handle.value;
         }
 
@@ -85,162 +772,706 @@ namespace smart_ptr
             template < typename... Args > handle(Args&&... args)
                 : value(std::forward< Args >(args)...)
             {
-                value = instance().acquire_queue();
+                value = instance().acquire_producer();
             }
 
             ~handle()
             {
-                instance().release_queue(value);
+                value->run_exit_hooks();
+                is_exited() = true;
+                instance().release_producer(value);
             }
 
             T value;
         };
 
-        collector_queue* acquire_queue()
+        // Set once the producer of current thread is released. Thread local objects destroyed after that
+        // still push, their messages go to a shared list of the shard.
+        static bool& is_exited()
+        {
+            static thread_local bool value = false;
+            return value;
+        }
+
+        void push_exited(size_t index, collector_message message)
+        {
+            auto& shard = shards_[index];
+            {
+                std::lock_guard< std::mutex > lock(shard.exited_mutex);
+                shard.exited.push_back(message);
+                shard.has_exited.store(true);
+            }
+
+            shard.parker.unpark();
+        }
+
+        collector_producer* acquire_producer()
         {
             std::lock_guard< std::mutex > lock(mutex_);
 
-            queues_.push_back(make_shared< collector_queue, shared_counter< uint64_t, false > >());
-            return queues_.back().get();
+            auto producer = make_shared< collector_producer, shared_counter< uint64_t, false > >(options_.shards);
+            for (size_t i = 0; i < options_.shards; ++i)
+            {
+                shards_[i].producers.push_back(producer);
+            }
+
+            return producer.get();
         }
 
-        void release_queue(collector_queue* queue)
+        void release_producer(collector_producer* producer)
         {
             std::lock_guard< std::mutex > lock(mutex_);
 
-            auto it = std::find_if(queues_.begin(), queues_.end(), [=](auto value) { return value.get() == queue; });
-            assert(it != queues_.end());
+            auto& producers = shards_[0].producers;
+            auto it = std::find_if(producers.begin(), producers.end(), [=](auto value) { return value.get() == producer; });
+            assert(it != producers.end());
             (*it)->set_released(true);
+
+            retired_cache_hits_ += producer->get_cache_hits().get();
+            for (size_t i = 0; i < options_.shards; ++i)
+            {
+                retired_pushed_ += producer->get_channel(i).get_metrics().pushed.get();
+            }
         }
 
         struct drain_state
         {
-            std::vector< collector_queue_ptr > queues;
-            std::vector< control_block_dtor* > zeroes;
+            std::vector< collector_producer_ptr > producers;
+            std::vector< collector_message > decrements;
+            std::vector< collector_message > deferred;
+            std::vector< collector_message > overflow;
             std::array< collector_message, collector_queue_size > messages;
-        };        
 
-        size_t drain(drain_state& state)
+            // Push of the oldest message drained by current round and by the round that drained deferred decrements.
+            // Rounds that popped only messages without time use their start.
+            clock::time_point pushed = clock::time_point::max();
+            clock::time_point deferred_pushed;
+        };
+
+        struct shard_metrics
+        {
+            metric rounds;
+            metric messages;
+            metric released;
+            metric control_blocks;
+            metric table_bytes;
+            metric pending_decrements;
+            histogram_metric batch_sizes;
+            histogram_metric drain_latency;
+            histogram_metric release_latency;
+        };
+
+        struct alignas(64) shard
+        {
+            size_t index;
+            size_t node;
+            std::thread thread;
+            smart_ptr::parker parker;
+
+            // Held during a drain round, by the drain thread or by a helping thread
+            std::mutex drain_mutex;
+            drain_state state;
+            hash_table< thread_counter_base*, int64_t > control_blocks{ collector_table_size };
+            shard_metrics metrics;
+
+            // Accessed under collector's lock
+            std::vector< collector_producer_ptr > producers;
+
+            // Messages pushed by threads after their producer was released
+            std::mutex exited_mutex;
+            std::vector< collector_message > exited;
+            std::atomic< bool > has_exited = false;
+        };
+
+        void run(size_t index)
+        {
+            auto& shard = shards_[index];
+            is_draining() = true;
+
+            if (nodes_ > 1)
+            {
+                numa_topology::instance().bind_thread(shard.node);
+            }
+
+            bool pressure = index == 0 && (options_.rss_limit || options_.memory_pressure);
+            auto check = clock::now();
+
+            size_t idle = 0;
+            while (!dtor_)
+            {
+                if (pressure && clock::now() >= check)
+                {
+                    check = clock::now() + collector_pressure_interval;
+                    if (is_under_pressure())
+                    {
+                        reclaim();
+                        if (has_metrics())
+                            pressure_drains_.add(1);
+                    }
+                }
+
+                if (drain(index))
+                {
+                    idle = 0;
+                    continue;
+                }
+
+                // New messages usually come soon after the last ones, so the thread gives up the CPU gradually
+                if (++idle < collector_spin_rounds)
+                {
+                    for (size_t i = 0; i < 64; ++i)
+                    {
+                        cpu_relax();
+                    }
+                }
+                else if (idle < collector_spin_rounds + collector_yield_rounds)
+                {
+                    std::this_thread::yield();
+                }
+                else
+                {
+                    // Threads that pushed before they could see the announcement are drained by this round
+                    shard.parker.prepare();
+                    if (!dtor_ && !drain(index))
+                    {
+                        shard.parker.park(collector_park_time);
+                    }
+                    else
+                    {
+                        shard.parker.cancel();
+                        idle = 0;
+                    }
+                }
+            }
+        }
+
+        // Runs two rounds of every shard: the first one drains what was pushed so far, the second one applies
+        // its decrements. Drain threads are locked out, so all objects are released by current thread and
+        // their destructors push to its queues. Whatever a pass pushed is applied by the next one, so passes
+        // repeat until one pushes nothing. Locks are taken in shard order, drain threads and helpers hold only one.
+        void reclaim()
+        {
+            for (size_t i = 0; i < options_.shards; ++i)
+            {
+                shards_[i].drain_mutex.lock();
+            }
+
+            auto& producer = this->producer();
+            auto get_pushed = [&]
+            {
+                size_t pushed = 0;
+                for (size_t i = 0; i < options_.shards; ++i)
+                {
+                    pushed += producer.get_channel(i).get_pushed();
+                }
+
+                return pushed;
+            };
+
+            size_t pushed = get_pushed();
+            size_t last = 0;
+            do
+            {
+                last = pushed;
+                for (size_t i = 0; i < options_.shards; ++i)
+                {
+                    drain(shards_[i]);
+                    drain(shards_[i]);
+                }
+
+                pushed = get_pushed();
+            } while (pushed != last);
+
+            for (size_t i = 0; i < options_.shards; ++i)
+            {
+                shards_[i].drain_mutex.unlock();
+            }
+        }
+
+        bool is_under_pressure() const
+        {
+            if (options_.memory_pressure && options_.memory_pressure())
+                return true;
+
+            return options_.rss_limit && get_resident_memory() > options_.rss_limit;
+        }
+
+        // Resident memory of the process in bytes, 0 where it is not known
+        static size_t get_resident_memory()
+        {
+        #if defined(__linux__)
+            size_t size = 0;
+            size_t resident = 0;
+            if (auto file = std::fopen("/proc/self/statm", "r"))
+            {
+                if (std::fscanf(file, "%zu %zu", &size, &resident) != 2)
+                    resident = 0;
+                std::fclose(file);
+            }
+
+            return resident * (size_t)sysconf(_SC_PAGESIZE);
+        #else
+            return 0;
+        #endif
+        }
+
+        size_t drain(size_t index)
+        {
+            auto& shard = shards_[index];
+            std::lock_guard< std::mutex > lock(shard.drain_mutex);
+            auto processed = drain(shard);
+            if (!processed)
+            {
+                shard.control_blocks.shrink();
+                if (has_metrics())
+                {
+                    shard.metrics.table_bytes.set(shard.control_blocks.get_memory_size());
+                }
+            }
+
+            return processed;
+        }
+
+        // Runs a drain round, caller holds the drain lock of the shard
+        size_t drain(shard& shard)
         {
+            auto& state = shard.state;
+
             {
                 // During this lock, threads cannot join or exit the collector.
                 std::lock_guard< std::mutex > lock(mutex_);
 
-                // Copy all queues
-                state.queues = queues_;
+                // Copy all producers
+                state.producers = shard.producers;
 
-                // Remove released queues from queues_. This will drain them one last time.
-                queues_.erase(std::remove_if(queues_.begin(), queues_.end(), [](auto queue) { return queue->is_released(); }), queues_.end());
+                // Remove released producers from the shard. This will drain them one last time.
+                shard.producers.erase(std::remove_if(shard.producers.begin(), shard.producers.end(), [](auto producer) { return producer->is_released(); }), shard.producers.end());
             }
 
-            size_t size = 0;
-            for (auto& queue : state.queues)
+            // Wait for threads pinned before this round. Anything they pushed while pinned is drained below,
+            // before the decrements of previous round are applied. Threads that pin later observe the new epoch.
+            // Epoch is shared by all shards, it only needs to grow.
+            auto metrics = has_metrics();
+            auto start = metrics ? clock::now() : clock::time_point();
+            auto epoch = ++epoch_;
+            size_t processed = 0;
+            while (is_pinned(state, epoch))
+            {
+                // Pinned thread might be pushing to a full queue
+                auto size = pop(shard);
+                if (!size)
+                {
+                    std::this_thread::yield();
+                }
+
+                processed += size;
+            }
+
+            processed += pop(shard);
+
+            auto now = metrics ? clock::now() : clock::time_point();
+            size_t released = 0;
+
+            // Decrements are applied one round later. An increment that happened before a decrement in another thread
+            // was pushed before that decrement was drained, so it has been drained by now. That way queue order
+            // between threads can not make the tally drop to zero while the object is still referenced.
+            for (auto message : state.deferred)
+            {
+                auto counter = get_counter(message);
+                auto refs = shard.control_blocks.find(counter);
+                assert(refs);
+                if ((*refs -= get_refs(message)) <= 0 && counter->release(*refs))
+                {
+                    shard.control_blocks.erase(counter);
+                    ++released;
+                }
+            }
+
+            // Control blocks freed to slabs of other threads are handed back to them together
+            if (released)
+            {
+                flush_slab_allocator();
+            }
+
+            if (metrics)
+            {
+                update_metrics(shard, processed, released, start, now);
+            }
+
+            // Copies of producers are kept until the next round, their pointers are not atomic and can only be released under the lock
+            processed += state.deferred.size();
+            state.deferred.clear();
+            std::swap(state.deferred, state.decrements);
+            state.deferred_pushed = std::min(state.pushed, start);
+            state.pushed = clock::time_point::max();
+
+            return processed;
+        }
+
+        void update_metrics(shard& shard, size_t messages, size_t released, clock::time_point start, clock::time_point now)
+        {
+            auto& metrics = shard.metrics;
+            if (messages)
+            {
+                metrics.rounds.add(1);
+                metrics.messages.add(messages);
+                metrics.batch_sizes.add(messages);
+                metrics.drain_latency.add((uint64_t)std::chrono::duration_cast< std::chrono::nanoseconds >(clock::now() - start).count());
+            }
+
+            // Rounds that ran without metrics did not take the time of their decrements
+            if (released && shard.state.deferred_pushed != clock::time_point())
+            {
+                metrics.released.add(released);
+                auto latency = (uint64_t)std::chrono::duration_cast< std::chrono::nanoseconds >(now - shard.state.deferred_pushed).count();
+                for (size_t i = 0; i < released; ++i)
+                {
+                    metrics.release_latency.add(latency);
+                }
+            }
+
+            metrics.control_blocks.set(shard.control_blocks.size());
+            metrics.table_bytes.set(shard.control_blocks.get_memory_size());
+            metrics.pending_decrements.set(shard.state.decrements.size());
+        }
+
+        bool is_pinned(const drain_state& state, uint64_t epoch) const
+        {
+            for (auto& producer : state.producers)
             {
-                while (size = queue->pop<false>(state.messages))
+                auto pinned = producer->get_pinned();
+                if (pinned && pinned < epoch)
+                    return true;
+            }
+
+            return false;
+        }
+
+        // Overflow is taken after the queue. Messages of a thread are not processed in push order then,
+        // but all messages pushed before the round started are processed in the round.
+        size_t pop(shard& shard)
+        {
+            auto& state = shard.state;
+
+            size_t processed = 0;
+            for (auto& producer : state.producers)
+            {
+                auto& channel = producer->get_channel(shard.index);
+                if (has_metrics())
+                {
+                    if (auto pushed = channel.take_first_push())
+                        state.pushed = std::min(state.pushed, clock::time_point(clock::duration(pushed)));
+                }
+
+                size_t size = 0;
+                size_t popped = 0;
+                while ((size = channel.get_queue().pop<false>(state.messages)))
+                {
+                    popped += size;
+                    process(shard, state.messages.data(), size);
+                }
+
+                if (channel.pop_overflow(state.overflow))
+                {
+                    popped += state.overflow.size();
+                    process(shard, state.overflow.data(), state.overflow.size());
+                    state.overflow.clear();
+                }
+
+                if (popped)
                 {
-                    for (size_t i = 0; i < size; ++i)
+                    channel.count_popped(popped);
+                    if (has_metrics())
                     {
-                        auto ptr = (control_block_dtor*)(state.messages[size] & ~1);
-                        auto inc = state.messages[size] & 1;
-
-                        auto& cnt = control_blocks_[ptr];
-                        if (inc)
-                        {
-                            cnt += 1;
-                        }
-                        else
-                        {
-                            assert(cnt >= 0);
-                            cnt -= 1;
-                            if (cnt == 0)
-                            {
-                                state.zeroes.push_back(ptr);
-                            }
-                        }
+                        channel.get_metrics().popped.add(popped);
                     }
                 }
+
+                processed += popped;
+            }
+
+            // Exited threads pushed their queued messages before these, so the decrements here are applied after them
+            if (shard.has_exited.load())
+            {
+                {
+                    std::lock_guard< std::mutex > lock(shard.exited_mutex);
+                    shard.exited.swap(state.overflow);
+                    shard.has_exited.store(false);
+                }
+
+                processed += state.overflow.size();
+                process(shard, state.overflow.data(), state.overflow.size());
+                state.overflow.clear();
             }
 
-            size_t deallocated = 0;
-            for (auto ptr : state.zeroes)
+            return processed;
+        }
+
+        void process(shard& shard, const collector_message* messages, size_t size)
+        {
+            for (size_t i = 0; i < size; ++i)
             {
-                auto it = control_blocks_.find(ptr);
-                assert(it != control_blocks_.end());
-                if (it->second == 0)
+                if (messages[i] & 1)
                 {
-                    it->first->deallocate();
-                    it = control_blocks_.erase(it);
-                    ++deallocated;
+                    shard.control_blocks[get_counter(messages[i])] += get_refs(messages[i]);
                 }
                 else
                 {
-                    ++it;
+                    shard.state.decrements.push_back(messages[i]);
                 }
             }
-
-            state.zeroes.clear();
-            state.queues.clear();
-
-            return deallocated;
         }
 
         // Accessed from multiple threads
         alignas(64) std::mutex mutex_;
-        std::thread thread_;
         std::atomic< bool > dtor_ = false;
-        std::vector< collector_queue_ptr > queues_;
+        const size_t nodes_;
+        const collector_options options_;
+        std::atomic< size_t > max_pending_messages_;
+        std::atomic< bool > metrics_;
+        std::unique_ptr< shard[] > shards_;
+        uint64_t retired_cache_hits_ = 0;
+        uint64_t retired_pushed_ = 0;
+        metric pressure_drains_;
+        alignas(64) std::atomic< uint64_t > epoch_ = 1;
+    };
+
+    class pin_guard
+    {
+    public:
+        pin_guard() { collector::instance().pin(); }
+        ~pin_guard() { collector::instance().unpin(); }
 
-        // Accessed from single thread
-        alignas(64) std::unordered_map< control_block_dtor*, uint64_t > control_blocks_;
+        pin_guard(const pin_guard&) = delete;
+        pin_guard& operator = (const pin_guard&) = delete;
     };
 
     template < typename T, typename ThreadCache > struct thread_counter
+        : thread_counter_base
     {
-        thread_counter(control_block_dtor* cb)
+        // Releases are processed by collector, the last decrement never returns true
+        static constexpr bool deferred = true;
+        using pin_guard = smart_ptr::pin_guard;
+
+        // Pin of current thread, used by debug checks of borrowed pointers
+        static pin_id get_pin() { return collector::instance().get_pin(); }
+
+        // Maximum number of released references a thread keeps for itself per cache slot
+        static constexpr T max_cached_refs = 64;
+        static_assert(max_cached_refs <= collector_max_refs);
+
+        // Block is released through its release() by the collector. Counter has to be the first member of the block,
+        // so the block is found at the address of the counter.
+        template < typename Block > thread_counter([[maybe_unused]] Block* block)
+            : thread_counter_base(&release_block< Block >, collector::instance().get_current_node())
         {
-            collector::instance().push((uintptr_t)cb & 1);
+            assert((void*)block == (void*)this);
+            if (is_cache_ready())
+            {
+                // Slot left by a released object at the same address has no spare references, as they would keep
+                // the object alive, but it can still count held ones that were released by other threads
+                auto index = cache_.get((uintptr_t)this, &return_slot);
+                if (index != cache_.end())
+                {
+                    assert(get_spare(cache_[index]) == 0);
+                    cache_[index] = held_one;
+                }
+            }
+
+            collector::instance().increment(this);
         }
 
         ~thread_counter()
         {}
 
-        void increment(control_block_dtor* cb)
+        // The cache keeps references released by this thread that the collector still counts. Increments consume them,
+        // decrements return them, and only what can not be satisfied locally goes to the collector. As the collector
+        // tally never drops below real reference count, cached references can be freely passed between threads.
+        //
+        // Spare references are kept only while the thread holds references it took itself. Once it released as many
+        // as it took, the spare ones go to the collector with the last release, so the cache does not keep alive
+        // objects the thread no longer uses. References the thread passed to other threads still count as held
+        // until they are evicted, flushed or the thread exits.
+
+        // Returns references cached by current thread to the collector, one message per slot. Runs when the thread
+        // exits and in collector::flush(), a long-lived thread can call it to let go of objects it passed to other threads.
+        static void flush_cache()
+        {
+            cache_.clear(&return_slot);
+        }
+
+        void increment(void*)
         {
-            // It would be interesting to be able to use LRU eviction here. But that is complicated because of
-            // refcounts would be kept on two places. Now they are either in the cache or in the collector and cannot move once placed.
-            auto index = cache_.get((uintptr_t)this);
+            if (!is_cache_ready())
+            {
+                collector::instance().increment(this);
+                return;
+            }
+
+            auto index = cache_.get((uintptr_t)this, &return_slot);
             if (index != cache_.end())
             {
-                if (cache_[index]++ == 0)
+                auto slot = cache_[index];
+                if (get_spare(slot) > 0)
                 {
-                    // Very slow on this place.
-                    //collector::queue().push(cb);
+                    cache_[index] = slot + held_one - 1;
+                    collector::instance().count_cache_hit();
+                    return;
                 }
 
+                cache_[index] = slot + held_one;
+            }
+
+            collector::instance().increment(this);
+        }
+
+        // Takes cached references first, the rest is a single message
+        void increment(void*, T refs)
+        {
+            if (!is_cache_ready())
+            {
+                collector::instance().increment(this, refs);
                 return;
             }
-            
-            collector::instance().push((uintptr_t)cb & 1);
+
+            auto index = cache_.get((uintptr_t)this, &return_slot);
+            if (index != cache_.end())
+            {
+                auto slot = cache_[index];
+                auto cached = std::min< slot_type >(get_spare(slot), refs);
+                cache_[index] = slot + held_one * refs - cached;
+                refs -= cached;
+                if (cached > 0)
+                {
+                    collector::instance().count_cache_hit();
+                }
+            }
+
+            if (refs > 0)
+            {
+                collector::instance().increment(this, refs);
+            }
         }
 
-        bool decrement(control_block_dtor* cb)
+        bool decrement(void*)
         {
-            auto index = cache_.get((uintptr_t)this);
+            auto index = cache_.find((uintptr_t)this);
             if (index != cache_.end())
             {
-                if(cache_[index]-- > 0)
+                auto slot = cache_[index];
+                if (get_held(slot) <= 1)
+                {
+                    // Thread released what it took, spare references go with this one
+                    cache_.erase(index);
+                    collector::instance().decrement(this, get_spare(slot) + 1);
+                    return false;
+                }
+
+                if (get_spare(slot) < max_cached_refs)
+                {
+                    cache_[index] = slot - held_one + 1;
+                    collector::instance().count_cache_hit();
                     return false;
+                }
 
-                cache_.erase(index);
+                cache_[index] = slot - held_one;
             }
-            
-            collector::instance().push((uintptr_t)cb);
+
+            collector::instance().decrement(this);
 
             // Always return false as the destruction is done from the collector thread
             return false;
         }
 
+        // Fills the cache slot, the rest is a single message
+        bool decrement(void*, T refs)
+        {
+            auto index = cache_.find((uintptr_t)this);
+            if (index != cache_.end())
+            {
+                auto slot = cache_[index];
+                if (get_held(slot) <= refs)
+                {
+                    cache_.erase(index);
+                    refs += get_spare(slot);
+                }
+                else
+                {
+                    auto cached = std::min< slot_type >(max_cached_refs - get_spare(slot), refs);
+                    cache_[index] = slot - held_one * refs + cached;
+                    refs -= cached;
+                    if (cached > 0)
+                    {
+                        collector::instance().count_cache_hit();
+                    }
+                }
+            }
+
+            if (refs > 0)
+            {
+                collector::instance().decrement(this, refs);
+            }
+
+            return false;
+        }
+
     private:
-        ThreadCache cache_;
+        template < typename Block > static void release_block(thread_counter_base* counter)
+        {
+            reinterpret_cast< Block* >(counter)->release();
+        }
+
+        // Slot keeps spare references in its lower half and references the thread holds in its upper half
+        using slot_type = std::remove_reference_t< decltype(std::declval< ThreadCache& >()[0]) >;
+        static_assert(sizeof(slot_type) == sizeof(uint64_t));
+        static constexpr slot_type held_one = slot_type(1) << 32;
+
+        static slot_type get_spare(slot_type slot) { return slot & (held_one - 1); }
+        static slot_type get_held(slot_type slot) { return slot >> 32; }
+
+        // Evicted and flushed slots return their spare references in a single message
+        static void return_slot(uintptr_t key, slot_type slot)
+        {
+            if (get_spare(slot) > 0)
+            {
+                collector::instance().decrement((thread_counter_base*)key, get_spare(slot));
+            }
+        }
+
+        enum class cache_state : uint8_t
+        {
+            unused,
+            ready,
+            exited,
+        };
+
+        // Slots are claimed only by constructors and increments. The first one registers the flush of the cache at thread
+        // exit and in collector::flush(), increments of an exiting thread bypass the cache, so no references are left behind.
+        static bool is_cache_ready()
+        {
+            auto& state = cache_state_;
+            if (state == cache_state::ready)
+                return true;
+
+            if (state == cache_state::unused)
+            {
+                state = cache_state::exited;
+                if (collector::instance().at_thread_exit([]
+                {
+                    cache_state_ = cache_state::exited;
+                    flush_cache();
+                }))
+                {
+                    collector::instance().at_flush(&flush_cache);
+                    state = cache_state::ready;
+                }
+            }
+
+            return state == cache_state::ready;
+        }
+
+        // Caches keep their data in thread-local storage
+        static inline ThreadCache cache_;
+        static inline thread_local cache_state cache_state_ = cache_state::unused;
     };
 }
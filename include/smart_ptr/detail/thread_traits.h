@@ -7,6 +7,8 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <thread>
 
 #if defined(_WIN32)
@@ -25,16 +27,15 @@ namespace smart_ptr
         }
     };
 
+    // Threads are numbered in order they ask for the id, as part of std::thread::id does not have to be unique.
+    // Numbers are not reused, zero is returned once after every 2^32 threads.
     struct std_thread_traits_uint32_t
     {
         using thread_id = uint32_t;
         static thread_id get_current_thread_id()
         {
-            static thread_local thread_id id = []()
-            {
-		auto id = std::this_thread::get_id();
-                return *reinterpret_cast<thread_id*>(&id);
-            }();
+            static std::atomic< thread_id > next(1);
+            static thread_local thread_id id = next.fetch_add(1, std::memory_order_relaxed);
             return id;
         }
     };
@@ -0,0 +1,183 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <utility>
+
+namespace smart_ptr
+{
+    template < typename T > class intrusive_ptr;
+
+    // Base of T that keeps the reference count in the object, so there is no control block to allocate and no
+    // pointer to follow. Counter is one of the counter policies of shared_ptr, counters that release objects
+    // out of line (thread_counter, biased_counter) call release() of the base, so T needs no virtual functions.
+    //
+    // A new object holds one reference that the first intrusive_ptr adopts. Objects have to be allocated with new
+    // and owned by intrusive_ptr, as deferred counters release them after the last intrusive_ptr is gone.
+    // Types derived from T need a virtual destructor of T.
+    template < typename T, typename Counter > class intrusive_ref_counted
+    {
+        template < typename U > friend class intrusive_ptr;
+
+    public:
+        using counter_type = Counter;
+        using intrusive_type = intrusive_ref_counted< T, Counter >;
+
+        // Destroys the object, called by counters that release it out of line
+        void release()
+        {
+            delete static_cast< T* >(this);
+        }
+
+    protected:
+        intrusive_ref_counted()
+            : counter_(this)
+        {}
+
+        // Copy of an object is a new object with a count of its own
+        intrusive_ref_counted(const intrusive_ref_counted< T, Counter >&)
+            : counter_(this)
+        {}
+
+        intrusive_ref_counted< T, Counter >& operator = (const intrusive_ref_counted< T, Counter >&)
+        {
+            return *this;
+        }
+
+        ~intrusive_ref_counted() = default;
+
+    private:
+        void increment()
+        {
+            counter_.increment(this);
+        }
+
+        void decrement()
+        {
+            if (counter_.decrement(this))
+            {
+                release();
+            }
+        }
+
+        Counter counter_;
+    };
+
+    template < typename T > class intrusive_ptr
+    {
+        using intrusive_type = typename T::intrusive_type;
+
+    public:
+        using element_type = T;
+
+        constexpr intrusive_ptr() noexcept = default;
+        constexpr intrusive_ptr(std::nullptr_t) noexcept {}
+
+        // Adopts the reference the object was created with
+        explicit intrusive_ptr(T* ptr)
+            : ptr_(ptr)
+        {}
+
+        intrusive_ptr(const intrusive_ptr< T >& other)
+            : ptr_(other.ptr_)
+        {
+            increment();
+        }
+
+        intrusive_ptr(intrusive_ptr< T >&& other) noexcept
+            : ptr_(nullptr)
+        {
+            std::swap(ptr_, other.ptr_);
+        }
+
+        ~intrusive_ptr()
+        {
+            decrement();
+        }
+
+        intrusive_ptr< T >& operator = (const intrusive_ptr< T >& other)
+        {
+            if (ptr_ != other.ptr_)
+            {
+                decrement();
+                ptr_ = other.ptr_;
+                increment();
+            }
+            return *this;
+        }
+
+        intrusive_ptr< T >& operator = (intrusive_ptr< T >&& other)
+        {
+            if (this != &other)
+            {
+                decrement();
+                std::swap(ptr_, other.ptr_);
+            }
+            return *this;
+        }
+
+        void reset()
+        {
+            decrement();
+        }
+
+        void swap(intrusive_ptr< T >& other) noexcept
+        {
+            std::swap(ptr_, other.ptr_);
+        }
+
+        explicit operator bool() const
+        {
+            return ptr_ != nullptr;
+        }
+
+        T* operator ->() const
+        {
+            assert(ptr_);
+            return ptr_;
+        }
+
+        T& operator *() const
+        {
+            assert(ptr_);
+            return *ptr_;
+        }
+
+        T* get() const
+        {
+            return ptr_;
+        }
+
+    private:
+        void increment()
+        {
+            if (ptr_)
+            {
+                static_cast< intrusive_type* >(ptr_)->increment();
+            }
+        }
+
+        void decrement()
+        {
+            if (ptr_)
+            {
+                static_cast< intrusive_type* >(ptr_)->decrement();
+                ptr_ = nullptr;
+            }
+        }
+
+        T* ptr_{};
+    };
+
+    template < typename T, typename... Args > intrusive_ptr< T > make_intrusive(Args&&... args)
+    {
+        return intrusive_ptr< T >(new T(std::forward< Args >(args)...));
+    }
+}
@@ -0,0 +1,244 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#pragma once
+
+#include <smart_ptr/shared_ptr.h>
+
+#include <cassert>
+#include <memory>
+#include <type_traits>
+
+namespace smart_ptr
+{
+    // Local block holds a single reference of the control block for all local_shared_ptrs that share it
+    template < typename Counter > class local_control_block
+    {
+        using allocator_type = default_allocator< local_control_block< Counter > >;
+
+    public:
+        // Adopts reference already counted in cb
+        static local_control_block< Counter >* allocate(control_block_base< Counter >* cb)
+        {
+            allocator_type allocator;
+            auto local = std::allocator_traits< allocator_type >::allocate(allocator, 1);
+            std::allocator_traits< allocator_type >::construct(allocator, local, cb);
+            return local;
+        }
+
+        local_control_block(control_block_base< Counter >* cb)
+            : refs_(1)
+            , cb_(cb)
+        {}
+
+        void increment()
+        {
+            ++refs_;
+        }
+
+        void decrement()
+        {
+            if (--refs_ == 0)
+            {
+                if (cb_->decrement())
+                {
+                    cb_->release();
+                }
+
+                allocator_type allocator;
+                std::allocator_traits< allocator_type >::destroy(allocator, this);
+                std::allocator_traits< allocator_type >::deallocate(allocator, this, 1);
+            }
+        }
+
+        control_block_base< Counter >* get_control_block() const { return cb_; }
+
+    private:
+        size_t refs_;
+        control_block_base< Counter >* cb_;
+    };
+
+    // Shared pointer confined to a single thread. Copies only update a plain count in the local block,
+    // whatever Counter does, and the control block sees a single reference for all of them. Converts to
+    // and from shared_ptr to pass the object to other threads.
+    template < typename T, typename Counter > class local_shared_ptr
+    {
+        template < typename U, typename CounterU > friend class local_shared_ptr;
+
+        template < typename Y > using enable_if_convertible = std::enable_if_t< std::is_convertible_v< Y*, T* > >;
+
+    public:
+        using element_type = T;
+
+        constexpr local_shared_ptr() noexcept = default;
+        constexpr local_shared_ptr(std::nullptr_t) noexcept {}
+
+        template < typename Y, typename = enable_if_convertible< Y > > explicit local_shared_ptr(Y* ptr)
+            : local_shared_ptr(shared_ptr< T, Counter >(ptr))
+        {}
+
+        template < typename Y, typename = enable_if_convertible< Y > > local_shared_ptr(const shared_ptr< Y, Counter >& other)
+            : local_shared_ptr(shared_ptr< Y, Counter >(other))
+        {}
+
+        // Takes the reference of other
+        template < typename Y, typename = enable_if_convertible< Y > > local_shared_ptr(shared_ptr< Y, Counter >&& other)
+            : ptr_(other.ptr_)
+            , local_(other.cb_ ? local_control_block< Counter >::allocate(other.cb_) : nullptr)
+        {
+            other.ptr_ = nullptr;
+            other.cb_ = nullptr;
+        }
+
+        local_shared_ptr(const local_shared_ptr< T, Counter >& other)
+            : ptr_(other.ptr_)
+            , local_(other.local_)
+        {
+            increment();
+        }
+
+        local_shared_ptr(local_shared_ptr< T, Counter >&& other) noexcept
+        {
+            swap(other);
+        }
+
+        template < typename Y, typename = enable_if_convertible< Y > > local_shared_ptr(const local_shared_ptr< Y, Counter >& other)
+            : ptr_(other.ptr_)
+            , local_(other.local_)
+        {
+            increment();
+        }
+
+        template < typename Y, typename = enable_if_convertible< Y > > local_shared_ptr(local_shared_ptr< Y, Counter >&& other) noexcept
+            : ptr_(other.ptr_)
+            , local_(other.local_)
+        {
+            other.ptr_ = nullptr;
+            other.local_ = nullptr;
+        }
+
+        // Shares ownership of other and points to ptr, usually a member of the object other owns
+        template < typename Y > local_shared_ptr(const local_shared_ptr< Y, Counter >& other, T* ptr)
+            : ptr_(ptr)
+            , local_(other.local_)
+        {
+            increment();
+        }
+
+        ~local_shared_ptr()
+        {
+            decrement();
+        }
+
+        local_shared_ptr< T, Counter >& operator = (const local_shared_ptr< T, Counter >& other)
+        {
+            assign(other);
+            return *this;
+        }
+
+        local_shared_ptr< T, Counter >& operator = (local_shared_ptr< T, Counter >&& other) noexcept
+        {
+            if (this != &other)
+            {
+                decrement();
+                swap(other);
+            }
+            return *this;
+        }
+
+        template < typename Y, typename = enable_if_convertible< Y > > local_shared_ptr< T, Counter >& operator = (const local_shared_ptr< Y, Counter >& other)
+        {
+            assign(other);
+            return *this;
+        }
+
+        // Adds a reference to the control block, the result can be passed to other threads
+        template < typename Y, typename = std::enable_if_t< std::is_convertible_v< T*, Y* > > > operator shared_ptr< Y, Counter >() const
+        {
+            if (!local_)
+            {
+                return shared_ptr< Y, Counter >();
+            }
+
+            auto cb = local_->get_control_block();
+            cb->increment();
+            return shared_ptr< Y, Counter >(cb, ptr_);
+        }
+
+        void reset()
+        {
+            decrement();
+        }
+
+        void swap(local_shared_ptr< T, Counter >& other) noexcept
+        {
+            std::swap(ptr_, other.ptr_);
+            std::swap(local_, other.local_);
+        }
+
+        explicit operator bool() const
+        {
+            return ptr_ != nullptr;
+        }
+
+        T* operator ->() const
+        {
+            assert(ptr_);
+            return ptr_;
+        }
+
+        T& operator *() const
+        {
+            assert(ptr_);
+            return *ptr_;
+        }
+
+        T* get() const
+        {
+            return ptr_;
+        }
+
+    private:
+        template < typename Y > void assign(const local_shared_ptr< Y, Counter >& other)
+        {
+            if (local_ != other.local_)
+            {
+                decrement();
+                local_ = other.local_;
+                increment();
+            }
+            ptr_ = other.ptr_;
+        }
+
+        void increment()
+        {
+            if (local_)
+            {
+                local_->increment();
+            }
+        }
+
+        void decrement()
+        {
+            if (local_)
+            {
+                local_->decrement();
+                local_ = nullptr;
+            }
+
+            ptr_ = nullptr;
+        }
+
+        T* ptr_{};
+        local_control_block< Counter >* local_{};
+    };
+
+    template < typename T, typename Counter, typename... Args > local_shared_ptr< T, Counter > make_local_shared(Args&&... args)
+    {
+        return local_shared_ptr< T, Counter >(make_shared< T, Counter >(std::forward< Args >(args)...));
+    }
+}
@@ -8,50 +8,119 @@
 #pragma once
 
 #include <smart_ptr/detail/control_block.h>
+#if defined(SMARTPTR_SLAB_ALLOCATOR)
+#include <smart_ptr/detail/slab_allocator.h>
+#endif
 
 #include <cassert>
+#include <type_traits>
 
 namespace smart_ptr
 {
+    // Allocator of control blocks and of objects created by make_shared
+#if defined(SMARTPTR_SLAB_ALLOCATOR)
+    template < typename T > using default_allocator = slab_allocator< T >;
+#else
+    template < typename T > using default_allocator = std::allocator< T >;
+#endif
+
+    template < typename T, typename Counter > class weak_ptr;
+    template < typename T, typename Counter > class atomic_shared_ptr;
+    template < typename T, typename Counter > class alias_control_block;
+    template < typename T, typename Counter > class local_shared_ptr;
+    template < typename T, typename Counter > class borrowed_ptr;
+    template < typename Counter, size_t Size > class shared_ptr_batch;
+
     template < typename T, typename Counter > class shared_ptr
     {
+        template < typename U, typename CounterU > friend class shared_ptr;
         template < typename U, typename Allocator, typename CounterU, typename... Args > friend shared_ptr< U, CounterU > allocate_shared(Allocator&&, Args&&...);
+        template < typename U, typename CounterU > friend class weak_ptr;
+        template < typename U, typename CounterU > friend class local_shared_ptr;
+        template < typename U, typename CounterU > friend class borrowed_ptr;
+        template < typename CounterU, size_t Size > friend class shared_ptr_batch;
+        template < typename U, typename CounterU, typename OutputIt > friend OutputIt copy_n(const shared_ptr< U, CounterU >&, size_t, OutputIt);
+        friend class atomic_shared_ptr< T, Counter >;
+        friend class alias_control_block< T, Counter >;
+
+        template < typename Y > using enable_if_convertible = std::enable_if_t< std::is_convertible_v< Y*, T* > >;
 
-        shared_ptr(control_block< T, Counter, std::allocator< T >, default_destructor< T >, true >* cb)
-            : cb_(cb)
+        // Adopts reference already counted in cb
+        shared_ptr(control_block_base< Counter >* cb, T* ptr)
+            : ptr_(ptr)
+            , cb_(cb)
         {}
 
     public:
         using element_type = T;
+        using weak_type = weak_ptr< T, Counter >;
+        using counter_type = Counter;
 
         constexpr shared_ptr() noexcept = default;
         constexpr shared_ptr(std::nullptr_t) noexcept {}
 
-        template < typename Y > explicit shared_ptr(Y* ptr)
-            : cb_(control_block< T, Counter, std::allocator< T >, default_deleter< T >, false >::template allocate(
-                std::allocator< T >(), default_deleter< T >(), ptr))
+        // Control block deletes the pointer as Y, so Y is destroyed even if T has no virtual destructor
+        template < typename Y, typename = enable_if_convertible< Y > > explicit shared_ptr(Y* ptr)
+            : ptr_(ptr)
+            , cb_(control_block< Y, Counter, default_allocator< Y >, default_deleter< Y >, false >::template allocate(
+                default_allocator< Y >(), default_deleter< Y >(), ptr))
         {}
 
-        template< typename Y, class Deleter > shared_ptr(Y* ptr, Deleter&& deleter)
-            : cb_(control_block< T, Counter, std::allocator< T >, Deleter, false >::template allocate(
-                std::allocator< T >(), std::forward< Deleter >(deleter), ptr))
+        template< typename Y, class Deleter, typename = enable_if_convertible< Y > > shared_ptr(Y* ptr, Deleter&& deleter)
+            : ptr_(ptr)
+            , cb_(control_block< Y, Counter, default_allocator< Y >, std::decay_t< Deleter >, false >::template allocate(
+                default_allocator< Y >(), std::forward< Deleter >(deleter), ptr))
         {}
 
-        template< typename Y, class Deleter, class Allocator > shared_ptr(Y* ptr, Deleter&& deleter, Allocator&& alloc)
-            : cb_(control_block< T, Counter, Allocator, Deleter, false >::template allocate(
+        template< typename Y, class Deleter, class Allocator, typename = enable_if_convertible< Y > > shared_ptr(Y* ptr, Deleter&& deleter, Allocator&& alloc)
+            : ptr_(ptr)
+            , cb_(control_block< Y, Counter, std::decay_t< Allocator >, std::decay_t< Deleter >, false >::template allocate(
                 std::forward< Allocator >(alloc), std::forward< Deleter >(deleter), ptr))
         {}
 
         shared_ptr(const shared_ptr< T, Counter >& other)
-            : cb_(other.cb_)
+            : ptr_(other.ptr_)
+            , cb_(other.cb_)
         {
             increment();
         }
 
-        shared_ptr(shared_ptr< T, Counter >&& other)
-            : cb_(nullptr)
+        shared_ptr(shared_ptr< T, Counter >&& other) noexcept
         {
-            std::swap(cb_, other.cb_);
+            swap(other);
+        }
+
+        // Shares ownership of other, converted to a base or a different cv-qualification
+        template < typename Y, typename = enable_if_convertible< Y > > shared_ptr(const shared_ptr< Y, Counter >& other)
+            : ptr_(other.ptr_)
+            , cb_(other.cb_)
+        {
+            increment();
+        }
+
+        template < typename Y, typename = enable_if_convertible< Y > > shared_ptr(shared_ptr< Y, Counter >&& other) noexcept
+            : ptr_(other.ptr_)
+            , cb_(other.cb_)
+        {
+            other.ptr_ = nullptr;
+            other.cb_ = nullptr;
+        }
+
+        // Shares ownership of other and points to ptr, usually a member of the object other owns
+        template < typename Y > shared_ptr(const shared_ptr< Y, Counter >& other, T* ptr)
+            : ptr_(ptr)
+            , cb_(other.cb_)
+        {
+            increment();
+        }
+
+        // Takes the reference of other without touching the counter
+        template < typename Y > shared_ptr(shared_ptr< Y, Counter >&& other, T* ptr) noexcept
+            : ptr_(ptr)
+            , cb_(other.cb_)
+        {
+            other.ptr_ = nullptr;
+            other.cb_ = nullptr;
         }
 
         ~shared_ptr()
@@ -60,57 +129,100 @@ namespace smart_ptr
         }
 
         shared_ptr< T, Counter >& operator = (const shared_ptr< T, Counter >& other)
+        {
+            assign(other);
+            return *this;
+        }
+
+        shared_ptr< T, Counter >& operator = (shared_ptr< T, Counter >&& other) noexcept
+        {
+            if (this != &other)
+            {
+                decrement();
+                swap(other);
+            }
+            return *this;
+        }
+
+        template < typename Y, typename = enable_if_convertible< Y > > shared_ptr< T, Counter >& operator = (const shared_ptr< Y, Counter >& other)
+        {
+            assign(other);
+            return *this;
+        }
+
+        template < typename Y, typename = enable_if_convertible< Y > > shared_ptr< T, Counter >& operator = (shared_ptr< Y, Counter >&& other) noexcept
         {
             decrement();
+            ptr_ = other.ptr_;
             cb_ = other.cb_;
-            increment();
+            other.ptr_ = nullptr;
+            other.cb_ = nullptr;
             return *this;
         }
 
-        shared_ptr< T, Counter >& operator = (shared_ptr< T, Counter >&& other)
+        void reset()
         {
             decrement();
+        }
+
+        void swap(shared_ptr< T, Counter >& other) noexcept
+        {
+            std::swap(ptr_, other.ptr_);
             std::swap(cb_, other.cb_);
-            return *this;
+        }
+
+        explicit operator bool() const
+        {
+            return ptr_ != nullptr;
         }
 
         T* operator ->()
         {
-            assert(cb_);
-            return cb_->get_ptr();
+            assert(ptr_);
+            return ptr_;
         }
 
         const T* operator ->() const
         {
-            assert(cb_);
-            return cb_->get_ptr();
+            assert(ptr_);
+            return ptr_;
         }
 
         T& operator *()
         {
-            assert(cb_);
-            return cb_->get_ptr();
+            assert(ptr_);
+            return *ptr_;
         }
 
         const T& operator *() const
         {
-            assert(cb_);
-            return cb_->get_ptr();
+            assert(ptr_);
+            return *ptr_;
         }
 
         T* get()
         {
-            assert(cb_);
-            return cb_->get_ptr();
+            return ptr_;
         }
 
         const T* get() const
         {
-            assert(cb_);
-            return cb_->get_ptr();
+            return ptr_;
         }
 
     private:
+        template < typename Y > void assign(const shared_ptr< Y, Counter >& other)
+        {
+            // Aliases of the same object only differ in the pointer
+            if (cb_ != other.cb_)
+            {
+                decrement();
+                cb_ = other.cb_;
+                increment();
+            }
+            ptr_ = other.ptr_;
+        }
+
         void increment()
         {
             if(cb_)
@@ -121,27 +233,80 @@ namespace smart_ptr
 
         void decrement()
         {
-            if (cb_ && cb_->decrement())
+            if (cb_)
             {
-                cb_->deallocate();
+                if (cb_->decrement())
+                {
+                    cb_->release();
+                }
+
                 cb_ = nullptr;
             }
+
+            ptr_ = nullptr;
         }
-        
-        control_block_base< T, Counter >* cb_{};
+
+        T* ptr_{};
+        control_block_base< Counter >* cb_{};
     };
-    
+
     template < typename T, typename Allocator, typename Counter, typename... Args >
     shared_ptr< T, Counter > allocate_shared(Allocator&& allocator, Args&&... args)
     {
-        return shared_ptr< T, Counter >(control_block< T, Counter, Allocator, default_destructor< T >, true >::template allocate(
+        control_block_base< Counter >* cb = control_block< T, Counter, std::decay_t< Allocator >, default_destructor< T >, true >::template allocate(
             std::forward< Allocator >(allocator), default_destructor< T >(), std::forward< Args >(args)...
-        ));
+        );
+        return shared_ptr< T, Counter >(cb, static_cast< T* >(cb->get_ptr()));
     }
 
     template < typename T, typename Counter, typename... Args >
     shared_ptr< T, Counter > make_shared(Args&&... args)
     {
-        return allocate_shared< T, std::allocator< T >, Counter >(std::allocator< T >(), std::forward< Args >(args)...);
+        return allocate_shared< T, default_allocator< T >, Counter >(default_allocator< T >(), std::forward< Args >(args)...);
+    }
+
+    // Casts share the control block of the source. Casts of an rvalue take its reference, so the counter is not touched.
+
+    template < typename T, typename U, typename Counter > shared_ptr< T, Counter > static_pointer_cast(const shared_ptr< U, Counter >& other)
+    {
+        return shared_ptr< T, Counter >(other, static_cast< T* >(const_cast< U* >(other.get())));
+    }
+
+    template < typename T, typename U, typename Counter > shared_ptr< T, Counter > static_pointer_cast(shared_ptr< U, Counter >&& other)
+    {
+        auto ptr = static_cast< T* >(other.get());
+        return shared_ptr< T, Counter >(std::move(other), ptr);
+    }
+
+    template < typename T, typename U, typename Counter > shared_ptr< T, Counter > const_pointer_cast(const shared_ptr< U, Counter >& other)
+    {
+        return shared_ptr< T, Counter >(other, const_cast< T* >(const_cast< U* >(other.get())));
+    }
+
+    template < typename T, typename U, typename Counter > shared_ptr< T, Counter > const_pointer_cast(shared_ptr< U, Counter >&& other)
+    {
+        auto ptr = const_cast< T* >(other.get());
+        return shared_ptr< T, Counter >(std::move(other), ptr);
+    }
+
+    // Returns an empty pointer if the object is not a T, the source keeps its reference then
+    template < typename T, typename U, typename Counter > shared_ptr< T, Counter > dynamic_pointer_cast(const shared_ptr< U, Counter >& other)
+    {
+        if (auto ptr = dynamic_cast< T* >(const_cast< U* >(other.get())))
+        {
+            return shared_ptr< T, Counter >(other, ptr);
+        }
+
+        return shared_ptr< T, Counter >();
+    }
+
+    template < typename T, typename U, typename Counter > shared_ptr< T, Counter > dynamic_pointer_cast(shared_ptr< U, Counter >&& other)
+    {
+        if (auto ptr = dynamic_cast< T* >(other.get()))
+        {
+            return shared_ptr< T, Counter >(std::move(other), ptr);
+        }
+
+        return shared_ptr< T, Counter >();
     }
 }
@@ -0,0 +1,174 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#pragma once
+
+#include <smart_ptr/shared_ptr.h>
+#include <smart_ptr/detail/find_index.h>
+
+#include <array>
+#include <cstdint>
+#include <iterator>
+
+namespace smart_ptr
+{
+    // Collects releases made through it and applies them per control block as a single decrement. With thread_counter,
+    // that is one collector message per block instead of one per reference.
+    //
+    // Released references stay counted until flush(), so a copy made through the batch takes over a released reference
+    // of the same block if there is one and increments the count only otherwise. Copies are counted when they are
+    // returned and can be destroyed like any other pointer. Releases only happen later than they would, objects are
+    // destroyed by flush() if their count drops to zero.
+    // Batch is used by a single thread, flush() is called when it runs out of room and by the destructor.
+    template < typename Counter, size_t Size = 64 > class shared_ptr_batch
+    {
+    public:
+        shared_ptr_batch() = default;
+        shared_ptr_batch(const shared_ptr_batch< Counter, Size >&) = delete;
+        shared_ptr_batch< Counter, Size >& operator = (const shared_ptr_batch< Counter, Size >&) = delete;
+
+        ~shared_ptr_batch()
+        {
+            flush();
+        }
+
+        template < typename T > shared_ptr< T, Counter > copy(const shared_ptr< T, Counter >& value)
+        {
+            if (!value.cb_)
+            {
+                return shared_ptr< T, Counter >(nullptr, value.ptr_);
+            }
+
+            if (!take(value.cb_))
+            {
+                value.cb_->increment();
+            }
+
+            return shared_ptr< T, Counter >(value.cb_, value.ptr_);
+        }
+
+        // Resets value, the reference is released by flush() unless a copy takes it over
+        template < typename T > void release(shared_ptr< T, Counter >& value)
+        {
+            if (value.cb_)
+            {
+                add(value.cb_);
+            }
+
+            value.cb_ = nullptr;
+            value.ptr_ = nullptr;
+        }
+
+        void flush()
+        {
+            for (size_t i = 0; i < size_; ++i)
+            {
+                auto cb = reinterpret_cast< control_block_base< Counter >* >(blocks_[i]);
+                if (refs_[i] > 0 && cb->decrement(refs_[i]))
+                {
+                    cb->release();
+                }
+
+                blocks_[i] = 0;
+            }
+
+            size_ = 0;
+        }
+
+    private:
+        // Takes a released reference of cb, returns false if there is none
+        bool take(control_block_base< Counter >* cb)
+        {
+            auto index = find_index(blocks_, reinterpret_cast< uintptr_t >(cb));
+            if (index == Size || refs_[index] == 0)
+                return false;
+
+            --refs_[index];
+            return true;
+        }
+
+        // Adds a released reference of cb
+        void add(control_block_base< Counter >* cb)
+        {
+            auto block = reinterpret_cast< uintptr_t >(cb);
+            auto index = find_index(blocks_, block);
+            if (index == Size)
+            {
+                if (size_ == Size)
+                {
+                    flush();
+                }
+
+                index = size_++;
+                blocks_[index] = block;
+                refs_[index] = 0;
+            }
+
+            ++refs_[index];
+        }
+
+        // Unused slots are zero, so a lookup can scan all of them
+        std::array< uintptr_t, Size > blocks_{};
+        std::array< size_t, Size > refs_{};
+        size_t size_ = 0;
+    };
+
+    // Writes n copies of value to out with a single increment of the count. The count is incremented before
+    // the first copy is written, so copies are counted as soon as out holds them, even if writing releases value.
+    template < typename T, typename Counter, typename OutputIt > OutputIt copy_n(const shared_ptr< T, Counter >& value, size_t n, OutputIt out)
+    {
+        auto cb = value.cb_;
+        auto ptr = value.ptr_;
+        if (!cb || n == 0)
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                *out++ = shared_ptr< T, Counter >(nullptr, ptr);
+            }
+
+            return out;
+        }
+
+        // References of copies not written yet, released if writing to out throws
+        struct pending_refs
+        {
+            control_block_base< Counter >* cb;
+            size_t refs;
+
+            ~pending_refs()
+            {
+                if (refs && cb->decrement(refs))
+                {
+                    cb->release();
+                }
+            }
+        };
+
+        cb->increment(n);
+        pending_refs pending{ cb, n };
+        while (pending.refs > 0)
+        {
+            shared_ptr< T, Counter > copy(cb, ptr);
+            --pending.refs;
+            *out++ = std::move(copy);
+        }
+
+        return out;
+    }
+
+    // Resets all pointers of the range with one decrement per control block. Pointers to the same object
+    // do not need to be next to each other, the batch coalesces up to 64 blocks between flushes.
+    template < typename It > void release_range(It first, It last)
+    {
+        using pointer_type = typename std::iterator_traits< It >::value_type;
+        shared_ptr_batch< typename pointer_type::counter_type > batch;
+        for (; first != last; ++first)
+        {
+            batch.release(*first);
+        }
+    }
+}
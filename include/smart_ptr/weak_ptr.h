@@ -0,0 +1,150 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#pragma once
+
+#include <smart_ptr/shared_ptr.h>
+
+namespace smart_ptr
+{
+    template < typename T, typename Counter > class weak_ptr
+    {
+        template < typename U, typename CounterU > friend class weak_ptr;
+
+        template < typename Y > using enable_if_convertible = std::enable_if_t< std::is_convertible_v< Y*, T* > >;
+
+    public:
+        using element_type = T;
+
+        constexpr weak_ptr() noexcept = default;
+
+        template < typename Y, typename = enable_if_convertible< Y > > weak_ptr(const shared_ptr< Y, Counter >& other)
+            : ptr_(other.ptr_)
+            , cb_(other.cb_)
+        {
+            increment();
+        }
+
+        weak_ptr(const weak_ptr< T, Counter >& other)
+            : ptr_(other.ptr_)
+            , cb_(other.cb_)
+        {
+            increment();
+        }
+
+        weak_ptr(weak_ptr< T, Counter >&& other) noexcept
+        {
+            swap(other);
+        }
+
+        template < typename Y, typename = enable_if_convertible< Y > > weak_ptr(const weak_ptr< Y, Counter >& other)
+            : ptr_(convert(other))
+            , cb_(other.cb_)
+        {
+            increment();
+        }
+
+        ~weak_ptr()
+        {
+            decrement();
+        }
+
+        template < typename Y, typename = enable_if_convertible< Y > > weak_ptr< T, Counter >& operator = (const shared_ptr< Y, Counter >& other)
+        {
+            assign(other.ptr_, other.cb_);
+            return *this;
+        }
+
+        weak_ptr< T, Counter >& operator = (const weak_ptr< T, Counter >& other)
+        {
+            assign(other.ptr_, other.cb_);
+            return *this;
+        }
+
+        weak_ptr< T, Counter >& operator = (weak_ptr< T, Counter >&& other) noexcept
+        {
+            if (this != &other)
+            {
+                decrement();
+                swap(other);
+            }
+            return *this;
+        }
+
+        shared_ptr< T, Counter > lock() const
+        {
+            if (cb_ && cb_->lock())
+            {
+                return shared_ptr< T, Counter >(cb_, ptr_);
+            }
+
+            return shared_ptr< T, Counter >();
+        }
+
+        // With deferred counters (thread_counter) the object expires only after the collector processes the last release
+        bool expired() const
+        {
+            return !cb_ || cb_->expired();
+        }
+
+        void reset()
+        {
+            decrement();
+        }
+
+        void swap(weak_ptr< T, Counter >& other) noexcept
+        {
+            std::swap(ptr_, other.ptr_);
+            std::swap(cb_, other.cb_);
+        }
+
+    private:
+        // Conversion to a virtual base reads the object, so it is held while the pointer converts. Pointer
+        // to an expired object is not converted.
+        template < typename Y > static T* convert(const weak_ptr< Y, Counter >& other)
+        {
+            return other.lock().get();
+        }
+
+        void assign(T* ptr, control_block_base< Counter >* cb)
+        {
+            if (cb_ != cb)
+            {
+                decrement();
+                cb_ = cb;
+                increment();
+            }
+            ptr_ = ptr;
+        }
+
+        void increment()
+        {
+            if (cb_)
+            {
+                cb_->increment_weak();
+            }
+        }
+
+        void decrement()
+        {
+            if (cb_)
+            {
+                if (cb_->decrement_weak())
+                {
+                    cb_->deallocate();
+                }
+
+                cb_ = nullptr;
+            }
+
+            ptr_ = nullptr;
+        }
+
+        T* ptr_{};
+        control_block_base< Counter >* cb_{};
+    };
+}
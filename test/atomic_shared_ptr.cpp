@@ -0,0 +1,205 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#if defined(_WIN32)
+    // TODO: move to cmake
+    #define _ENABLE_EXTENDED_ALIGNED_STORAGE // Specifically enable standard behavior
+#endif
+
+#include <smart_ptr/shared_ptr.h>
+#include <smart_ptr/atomic_shared_ptr.h>
+#include <smart_ptr/detail/shared_counter.h>
+#include <smart_ptr/detail/biased_counter.h>
+#include <smart_ptr/detail/percpu_counter.h>
+#include <smart_ptr/detail/thread_counter.h>
+#include <smart_ptr/detail/thread_cache.h>
+#include <smart_ptr/detail/hazard_counter.h>
+
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+#include "counted_value.h"
+
+using atomic_shared_ptr_types = ::testing::Types<
+    smart_ptr::atomic_shared_ptr< int, smart_ptr::shared_counter< uint64_t, true > >
+    , smart_ptr::atomic_shared_ptr< int, smart_ptr::percpu_counter< uint64_t > >
+    , smart_ptr::atomic_shared_ptr< int, smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > > >
+    , smart_ptr::atomic_shared_ptr< int, smart_ptr::thread_counter< uint64_t, smart_ptr::lru_thread_cache< uintptr_t, uint64_t, 2 > > >
+    , smart_ptr::atomic_shared_ptr< int, smart_ptr::thread_counter< uint64_t, smart_ptr::set_associative_thread_cache< uintptr_t, uint64_t, 4, 2 > > >
+    , smart_ptr::atomic_shared_ptr< int, smart_ptr::hazard_counter< uint64_t > >
+>;
+
+template < typename T > struct atomic_shared_ptr_test: public testing::Test {};
+
+template < typename T > struct counter_of;
+template < typename T, typename Counter > struct counter_of< smart_ptr::atomic_shared_ptr< T, Counter > > { using type = Counter; };
+TYPED_TEST_SUITE(atomic_shared_ptr_test, atomic_shared_ptr_types);
+
+TYPED_TEST(atomic_shared_ptr_test, load_store)
+{
+    using shared_ptr = typename TypeParam::value_type;
+
+    TypeParam a;
+    ASSERT_FALSE(a.load());
+
+    a.store(shared_ptr(new int(1)));
+    auto p1 = a.load();
+    ASSERT_EQ(*p1, 1);
+
+    auto p2 = a.exchange(shared_ptr(new int(2)));
+    ASSERT_EQ(*p2, 1);
+    ASSERT_EQ(*a.load(), 2);
+    ASSERT_EQ(*p1, 1);
+}
+
+TYPED_TEST(atomic_shared_ptr_test, compare_exchange)
+{
+    using shared_ptr = typename TypeParam::value_type;
+
+    shared_ptr p1(new int(1));
+    TypeParam a(p1);
+
+    shared_ptr expected;
+    ASSERT_FALSE(a.compare_exchange_strong(expected, shared_ptr(new int(2))));
+    ASSERT_EQ(expected.get(), p1.get());
+
+    ASSERT_TRUE(a.compare_exchange_strong(expected, shared_ptr(new int(3))));
+    ASSERT_EQ(*a.load(), 3);
+    ASSERT_EQ(*expected, 1);
+}
+
+TYPED_TEST(atomic_shared_ptr_test, load_store_threads)
+{
+    using shared_ptr = typename TypeParam::value_type;
+
+    TypeParam a(shared_ptr(new int(0)));
+    std::atomic< bool > done = false;
+
+    std::vector< std::thread > readers;
+    for (size_t i = 0; i < 4; ++i)
+    {
+        readers.emplace_back([&]
+        {
+            int last = 0;
+            while (!done)
+            {
+                auto p = a.load();
+                ASSERT_TRUE(p);
+                ASSERT_GE(*p, last);
+                last = *p;
+            }
+        });
+    }
+
+    for (int i = 1; i < 10000; ++i)
+    {
+        a.store(shared_ptr(new int(i)));
+    }
+
+    done = true;
+    for (auto& reader : readers)
+    {
+        reader.join();
+    }
+
+    ASSERT_EQ(*a.load(), 9999);
+}
+
+TYPED_TEST(atomic_shared_ptr_test, store_same_values)
+{
+    using counter = typename counter_of< TypeParam >::type;
+
+    using value = counted_value< TypeParam >;
+    using shared_ptr = smart_ptr::shared_ptr< value, counter >;
+    flush_releases< counter >();
+    value::destroyed = 0;
+
+    // Writers store the same two blocks over and over, so loads see a block replaced and stored again
+    {
+        shared_ptr values[] = { shared_ptr(new value), shared_ptr(new value) };
+        smart_ptr::atomic_shared_ptr< value, counter > a(values[0]);
+        std::atomic< bool > done = false;
+
+        std::vector< std::thread > readers;
+        for (size_t i = 0; i < 4; ++i)
+        {
+            readers.emplace_back([&]
+            {
+                while (!done)
+                {
+                    auto p = a.load();
+                    ASSERT_TRUE(p.get() == values[0].get() || p.get() == values[1].get());
+                }
+            });
+        }
+
+        std::vector< std::thread > writers;
+        for (size_t i = 0; i < 2; ++i)
+        {
+            writers.emplace_back([&, i]
+            {
+                for (size_t j = 0; j < 20000; ++j)
+                {
+                    a.store(values[(i + j) & 1]);
+                }
+            });
+        }
+
+        for (auto& writer : writers)
+        {
+            writer.join();
+        }
+
+        done = true;
+        for (auto& reader : readers)
+        {
+            reader.join();
+        }
+    }
+
+    // Borrows converted for the wrong load would leave a reference behind or release a value twice
+    check_destroyed< counter, value >(2);
+}
+
+TYPED_TEST(atomic_shared_ptr_test, aliasing)
+{
+    using shared_ptr = typename TypeParam::value_type;
+    using counter = typename counter_of< TypeParam >::type;
+
+    struct pair
+    {
+        int first = 1;
+        int second = 2;
+    };
+
+    smart_ptr::shared_ptr< pair, counter > p(new pair);
+    shared_ptr second(p, &p->second);
+
+    // Word holds a block of its own that keeps the alias, the value still matches what was stored
+    TypeParam a(second);
+    ASSERT_EQ(a.load().get(), &p->second);
+
+    shared_ptr first(p, &p->first);
+    ASSERT_FALSE(a.compare_exchange_strong(first, shared_ptr(p, &p->first)));
+    ASSERT_EQ(first.get(), &p->second);
+
+    smart_ptr::shared_ptr< int, counter > other(new int);
+    shared_ptr other_second(other, &p->second);
+    ASSERT_FALSE(a.compare_exchange_strong(other_second, shared_ptr(p, &p->first)));
+
+    // Loaded value holds the block of the word, the replacement gets a block of its own
+    auto loaded = a.load();
+    ASSERT_TRUE(a.compare_exchange_strong(loaded, shared_ptr(p, &p->second)));
+
+    ASSERT_TRUE(a.compare_exchange_strong(second, shared_ptr(p, &p->first)));
+    ASSERT_EQ(second.get(), &p->second);
+    ASSERT_EQ(*a.load(), 1);
+
+    a.store(shared_ptr(new int(3)));
+    ASSERT_EQ(*a.load(), 3);
+}
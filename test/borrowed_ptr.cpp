@@ -0,0 +1,107 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#include <smart_ptr/borrowed_ptr.h>
+#include <smart_ptr/atomic_shared_ptr.h>
+#include <smart_ptr/detail/thread_counter.h>
+#include <smart_ptr/detail/thread_cache.h>
+
+#include <gtest/gtest.h>
+#include <chrono>
+#include <thread>
+
+#include "counted_value.h"
+
+struct borrowed_value: counted_value< borrowed_value > {};
+
+using borrowed_counter = smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > >;
+
+TEST(borrowed_ptr_test, pin)
+{
+    borrowed_value::destroyed = 0;
+    smart_ptr::shared_ptr< borrowed_value, borrowed_counter > p(new borrowed_value);
+    {
+        smart_ptr::pin_guard guard;
+        auto b = smart_ptr::borrow(guard, p);
+
+        // Last reference is released by another thread, collector keeps the object while we are pinned
+        std::thread([p = std::move(p)]() mutable { p.reset(); }).join();
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        ASSERT_EQ(borrowed_value::destroyed, 0);
+        ASSERT_EQ(b->data, 1);
+    }
+
+    check_destroyed< borrowed_counter, borrowed_value >(1);
+}
+
+TEST(borrowed_ptr_test, shared_ptr)
+{
+    borrowed_value::destroyed = 0;
+    smart_ptr::shared_ptr< borrowed_value, borrowed_counter > p(new borrowed_value);
+    smart_ptr::shared_ptr< borrowed_value, borrowed_counter > s;
+    {
+        smart_ptr::pin_guard guard;
+        smart_ptr::borrowed_ptr< borrowed_value, borrowed_counter > b(guard, p);
+        std::thread([p = std::move(p)]() mutable { p.reset(); }).join();
+
+        // Reference taken while pinned keeps the object past the pin
+        s = b;
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    ASSERT_EQ(borrowed_value::destroyed, 0);
+    ASSERT_EQ(s->data, 1);
+
+    std::thread([s = std::move(s)]() mutable { s.reset(); }).join();
+    check_destroyed< borrowed_counter, borrowed_value >(1);
+}
+
+TEST(borrowed_ptr_test, atomic_shared_ptr)
+{
+    borrowed_value::destroyed = 0;
+    smart_ptr::atomic_shared_ptr< borrowed_value, borrowed_counter > value(smart_ptr::shared_ptr< borrowed_value, borrowed_counter >(new borrowed_value));
+    {
+        smart_ptr::pin_guard guard;
+        auto b = value.borrow(guard);
+        std::thread([&]{ value.store(nullptr); }).join();
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        ASSERT_EQ(borrowed_value::destroyed, 0);
+        ASSERT_EQ(b->data, 1);
+        ASSERT_FALSE(value.borrow(guard));
+    }
+
+    check_destroyed< borrowed_counter, borrowed_value >(1);
+}
+
+TEST(borrowed_ptr_test, pin_id)
+{
+    using pin_id = smart_ptr::pin_id;
+    ASSERT_EQ(borrowed_counter::get_pin(), pin_id());
+
+    pin_id outer;
+    {
+        smart_ptr::pin_guard guard;
+        outer = borrowed_counter::get_pin();
+        ASSERT_NE(outer, pin_id());
+        {
+            // Nested pins are part of the outermost one
+            smart_ptr::pin_guard nested;
+            ASSERT_EQ(borrowed_counter::get_pin(), outer);
+        }
+
+        std::thread([&]
+        {
+            smart_ptr::pin_guard guard;
+            ASSERT_NE(borrowed_counter::get_pin(), outer);
+        }).join();
+    }
+
+    ASSERT_EQ(borrowed_counter::get_pin(), pin_id());
+
+    smart_ptr::pin_guard guard;
+    ASSERT_NE(borrowed_counter::get_pin(), outer);
+}
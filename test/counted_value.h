@@ -0,0 +1,55 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#pragma once
+
+#include <smart_ptr/detail/biased_counter.h>
+#include <smart_ptr/detail/hazard_counter.h>
+#include <smart_ptr/detail/thread_counter.h>
+
+#include <gtest/gtest.h>
+#include <atomic>
+#include <type_traits>
+
+// Value that counts its destructions. Tests pass their own Tag, so objects another test leaves to a collector
+// do not change the count.
+template < typename Tag > struct counted_value
+{
+    counted_value(int data = 1): data(data) {}
+    ~counted_value() { ++destroyed; }
+
+    int data;
+    static inline std::atomic< int > destroyed;
+};
+
+// Counters released by hazard scans protect their blocks with hazard pointers
+template < typename Counter, typename = void > struct is_hazard_counter: std::false_type {};
+template < typename Counter > struct is_hazard_counter< Counter, std::void_t< typename Counter::hazard_pointer > >: std::true_type {};
+
+// Applies releases that Counter defers, so objects without references are destroyed
+template < typename Counter > void flush_releases()
+{
+    if constexpr (is_hazard_counter< Counter >::value)
+    {
+        smart_ptr::hazard_domain::instance().reclaim();
+    }
+    else if constexpr (Counter::deferred)
+    {
+        smart_ptr::collector::instance().flush();
+    }
+    else
+    {
+        smart_ptr::biased_merge_queue<>::instance().merge();
+    }
+}
+
+// Asserts that count objects were destroyed once the releases are applied
+template < typename Counter, typename Value > void check_destroyed(int count)
+{
+    flush_releases< Counter >();
+    ASSERT_EQ(Value::destroyed, count);
+}
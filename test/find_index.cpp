@@ -0,0 +1,90 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#include <smart_ptr/detail/find_index.h>
+
+#include <gtest/gtest.h>
+#include <vector>
+
+template < typename T, size_t N > struct find_index_params
+{
+    using value_type = T;
+    static constexpr size_t size = N;
+};
+
+using find_index_types = ::testing::Types<
+    find_index_params< uint32_t, 8 >
+    , find_index_params< uint32_t, 16 >
+    , find_index_params< uint32_t, 32 >
+    , find_index_params< uint32_t, 64 >
+    , find_index_params< uint64_t, 8 >
+    , find_index_params< uint64_t, 16 >
+    , find_index_params< uint64_t, 32 >
+    , find_index_params< uint64_t, 64 >
+>;
+
+template < typename T > struct find_index_test: public testing::Test
+{
+    using value_type = typename T::value_type;
+    using array_type = std::array< value_type, T::size >;
+    using function = size_t (*)(const array_type&, value_type);
+
+    // Kernels of every instruction set the CPU supports
+    static std::vector< function > get_functions()
+    {
+        std::vector< function > functions = { &smart_ptr::find_index_scalar< value_type, T::size >, &smart_ptr::find_index< value_type, T::size > };
+    #if defined(SMARTPTR_X86_64)
+        for (auto level : { smart_ptr::simd_level::sse2, smart_ptr::simd_level::sse4, smart_ptr::simd_level::avx2, smart_ptr::simd_level::avx512 })
+        {
+            if (level <= smart_ptr::get_simd_level())
+                functions.push_back(smart_ptr::find_index_dispatch< value_type, T::size >::select(level));
+        }
+    #endif
+        return functions;
+    }
+};
+
+TYPED_TEST_SUITE(find_index_test, find_index_types);
+
+TYPED_TEST(find_index_test, find)
+{
+    using value_type = typename TestFixture::value_type;
+    typename TestFixture::array_type values;
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+        // Values that differ in one half only catch 64-bit compares done on 32-bit lanes
+        values[i] = (value_type)(i + 1) << (sizeof(value_type) * 4);
+    }
+
+    for (auto function : TestFixture::get_functions())
+    {
+        for (size_t i = 0; i < values.size(); ++i)
+        {
+            ASSERT_EQ(function(values, values[i]), i);
+        }
+
+        ASSERT_EQ(function(values, 0), values.size());
+        ASSERT_EQ(function(values, 1), values.size());
+        ASSERT_EQ(function(values, (value_type)1 << (sizeof(value_type) * 4)), 0);
+    }
+}
+
+TYPED_TEST(find_index_test, first_match)
+{
+    typename TestFixture::array_type values = {};
+    for (auto function : TestFixture::get_functions())
+    {
+        ASSERT_EQ(function(values, 0), 0);
+        for (size_t i = values.size() - 1; i > 0; --i)
+        {
+            values[i] = 1;
+            ASSERT_EQ(function(values, 1), i);
+        }
+
+        values.fill(0);
+    }
+}
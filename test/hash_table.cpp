@@ -0,0 +1,94 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#include <smart_ptr/detail/hash_table.h>
+
+#include <gtest/gtest.h>
+#include <random>
+#include <unordered_map>
+
+TEST(hash_table_test, insert_find_erase)
+{
+    smart_ptr::hash_table< uintptr_t, int64_t > table(16);
+    ASSERT_TRUE(table.empty());
+    ASSERT_EQ(table.find(8), nullptr);
+
+    table[8] = 1;
+    table[16] += 2;
+    ASSERT_EQ(table.size(), 2);
+    ASSERT_EQ(*table.find(8), 1);
+    ASSERT_EQ(*table.find(16), 2);
+
+    ASSERT_TRUE(table.erase(8));
+    ASSERT_FALSE(table.erase(8));
+    ASSERT_EQ(table.find(8), nullptr);
+    ASSERT_EQ(*table.find(16), 2);
+    ASSERT_EQ(table.size(), 1);
+}
+
+TEST(hash_table_test, grow_shrink)
+{
+    smart_ptr::hash_table< uintptr_t, int64_t > table(16);
+    for (uintptr_t i = 1; i <= 1000; ++i)
+    {
+        table[i * 16] = i;
+    }
+
+    ASSERT_EQ(table.size(), 1000);
+    ASSERT_GE(table.capacity(), 2000);
+    ASSERT_EQ(table.get_memory_size(), table.capacity() * 16);
+
+    for (uintptr_t i = 1; i <= 990; ++i)
+    {
+        ASSERT_TRUE(table.erase(i * 16));
+    }
+
+    table.shrink();
+    ASSERT_LT(table.capacity(), 2000);
+    ASSERT_GE(table.capacity(), 16);
+    for (uintptr_t i = 991; i <= 1000; ++i)
+    {
+        ASSERT_EQ(*table.find(i * 16), i);
+    }
+}
+
+TEST(hash_table_test, random)
+{
+    // Small key range keeps the table dense, so erase has long runs to shift
+    std::mt19937 random;
+    std::uniform_int_distribution< uintptr_t > keys(1, 4096);
+    smart_ptr::hash_table< uintptr_t, int64_t > table(16);
+    std::unordered_map< uintptr_t, int64_t > reference;
+
+    for (size_t i = 0; i < 200000; ++i)
+    {
+        auto key = keys(random) * 8;
+        switch (random() % 4)
+        {
+        case 0:
+        case 1:
+            ++table[key];
+            ++reference[key];
+            break;
+        case 2:
+            ASSERT_EQ(table.erase(key), reference.erase(key) == 1);
+            break;
+        case 3:
+            table.shrink();
+            break;
+        }
+
+        ASSERT_EQ(table.size(), reference.size());
+    }
+
+    for (auto& [key, value] : reference)
+    {
+        auto found = table.find(key);
+        ASSERT_NE(found, nullptr);
+        ASSERT_EQ(*found, value);
+    }
+}
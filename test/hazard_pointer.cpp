@@ -0,0 +1,113 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#include <smart_ptr/detail/hazard_pointer.h>
+#include <smart_ptr/detail/hazard_counter.h>
+#include <smart_ptr/atomic_shared_ptr.h>
+
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+#include "counted_value.h"
+
+struct hazard_value: counted_value< hazard_value >
+{
+    static void reclaim(void* ptr) { delete static_cast< hazard_value* >(ptr); }
+};
+
+TEST(hazard_pointer_test, protect)
+{
+    auto& domain = smart_ptr::hazard_domain::instance();
+    domain.reclaim();
+    hazard_value::destroyed = 0;
+
+    std::atomic< hazard_value* > source(new hazard_value);
+    {
+        smart_ptr::hazard_pointer hazard;
+        auto value = hazard.protect(source);
+        ASSERT_EQ(value, source.load());
+
+        // Protected pointer survives scans
+        source = nullptr;
+        domain.retire(value, &hazard_value::reclaim);
+        domain.reclaim();
+        ASSERT_EQ(hazard_value::destroyed, 0);
+        ASSERT_EQ(domain.get_retired_size(), 1);
+
+        hazard.reset();
+        domain.reclaim();
+        ASSERT_EQ(hazard_value::destroyed, 1);
+    }
+}
+
+TEST(hazard_pointer_test, retire_bounded)
+{
+    auto& domain = smart_ptr::hazard_domain::instance();
+    domain.reclaim();
+    hazard_value::destroyed = 0;
+
+    // Retired pointers are reclaimed in batches without explicit scans
+    const int count = 10000;
+    for (int i = 0; i < count; ++i)
+    {
+        domain.retire(new hazard_value, &hazard_value::reclaim);
+        ASSERT_LT(domain.get_retired_size(), smart_ptr::hazard_scan_threshold + 2 * smart_ptr::hazard_slots * 64);
+    }
+
+    domain.reclaim();
+    ASSERT_EQ(hazard_value::destroyed, count);
+}
+
+TEST(hazard_pointer_test, thread_exit)
+{
+    auto& domain = smart_ptr::hazard_domain::instance();
+    hazard_value::destroyed = 0;
+
+    // Pointers retired by an exited thread are taken over by the next scan
+    std::thread([&] { domain.retire(new hazard_value, &hazard_value::reclaim); }).join();
+    domain.reclaim();
+    ASSERT_EQ(hazard_value::destroyed, 1);
+}
+
+TEST(hazard_pointer_test, atomic_shared_ptr)
+{
+    using counter = smart_ptr::hazard_counter< uint64_t >;
+    using value_type = smart_ptr::shared_ptr< int, counter >;
+
+    smart_ptr::atomic_shared_ptr< int, counter > value(value_type(new int(0)));
+    std::atomic< bool > done = false;
+
+    std::vector< std::thread > readers;
+    for (int i = 0; i < 3; ++i)
+    {
+        readers.emplace_back([&]
+        {
+            int last = 0;
+            while (!done)
+            {
+                auto p = value.load();
+                ASSERT_TRUE(p);
+                ASSERT_GE(*p, last);
+                last = *p;
+            }
+        });
+    }
+
+    for (int i = 1; i < 10000; ++i)
+    {
+        value.store(value_type(new int(i)));
+    }
+
+    done = true;
+    for (auto& reader : readers)
+    {
+        reader.join();
+    }
+
+    ASSERT_EQ(*value.load(), 9999);
+}
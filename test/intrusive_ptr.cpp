@@ -0,0 +1,163 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#include <smart_ptr/intrusive_ptr.h>
+#include <smart_ptr/detail/shared_counter.h>
+#include <smart_ptr/detail/biased_counter.h>
+#include <smart_ptr/detail/percpu_counter.h>
+#include <smart_ptr/detail/thread_counter.h>
+#include <smart_ptr/detail/thread_cache.h>
+#include <smart_ptr/detail/hazard_counter.h>
+
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+#include "counted_value.h"
+
+using intrusive_counter_types = ::testing::Types<
+    smart_ptr::shared_counter< uint64_t, false >
+    , smart_ptr::shared_counter< uint64_t, true >
+    , smart_ptr::biased_counter< uint64_t >
+    , smart_ptr::percpu_counter< uint64_t >
+    , smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > >
+    , smart_ptr::hazard_counter< uint64_t >
+>;
+
+template < typename Counter > struct intrusive_value
+    : smart_ptr::intrusive_ref_counted< intrusive_value< Counter >, Counter >
+    , counted_value< intrusive_value< Counter > >
+{
+    using counted_value< intrusive_value< Counter > >::counted_value;
+};
+
+template < typename T > struct intrusive_ptr_test: public testing::Test
+{
+    using value = intrusive_value< T >;
+    using pointer = smart_ptr::intrusive_ptr< value >;
+
+    // Objects of earlier tests are destroyed before the count starts
+    void SetUp() override
+    {
+        flush_releases< T >();
+        value::destroyed = 0;
+    }
+
+    static void check_destroyed(int count) { ::check_destroyed< T, value >(count); }
+};
+
+TYPED_TEST_SUITE(intrusive_ptr_test, intrusive_counter_types);
+
+TYPED_TEST(intrusive_ptr_test, ctor)
+{
+    using pointer = typename TestFixture::pointer;
+    {
+        pointer p1 = smart_ptr::make_intrusive< typename TestFixture::value >(1);
+        pointer p2(p1);
+        pointer p3;
+        p3 = p1;
+        pointer p4(std::move(p2));
+        ASSERT_FALSE(p2);
+        ASSERT_EQ(p4->data, 1);
+        ASSERT_EQ(p3.get(), p1.get());
+
+        p1.reset();
+        ASSERT_FALSE(p1);
+        ASSERT_EQ((*p3).data, 1);
+    }
+
+    TestFixture::check_destroyed(1);
+}
+
+TYPED_TEST(intrusive_ptr_test, copy_value)
+{
+    using value = typename TestFixture::value;
+    {
+        auto p1 = smart_ptr::make_intrusive< value >(1);
+
+        // Copied object starts with a count of its own
+        auto p2 = smart_ptr::make_intrusive< value >(*p1);
+        p1.reset();
+        ASSERT_EQ(p2->data, 1);
+    }
+
+    TestFixture::check_destroyed(2);
+}
+
+// Counters that can be shared between threads
+using intrusive_mt_counter_types = ::testing::Types<
+    smart_ptr::shared_counter< uint64_t, true >
+    , smart_ptr::biased_counter< uint64_t >
+    , smart_ptr::percpu_counter< uint64_t >
+    , smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > >
+    , smart_ptr::hazard_counter< uint64_t >
+>;
+
+template < typename T > struct intrusive_ptr_mt_test: intrusive_ptr_test< T > {};
+TYPED_TEST_SUITE(intrusive_ptr_mt_test, intrusive_mt_counter_types);
+
+TYPED_TEST(intrusive_ptr_mt_test, release_on_workers)
+{
+    using value = typename TestFixture::value;
+    const int count = 1000;
+
+    std::vector< typename TestFixture::pointer > pointers;
+    for (int i = 0; i < count; ++i)
+    {
+        pointers.emplace_back(new value(i));
+    }
+
+    std::vector< std::thread > threads;
+    for (size_t i = 0; i < 4; ++i)
+    {
+        threads.emplace_back([pointers]() mutable
+        {
+            for (auto& p : pointers)
+            {
+                auto copy = p;
+                ASSERT_EQ(copy.get(), p.get());
+            }
+        });
+    }
+
+    pointers.clear();
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    TestFixture::check_destroyed(count);
+}
+
+// Typed tests leave objects the collector releases later, so this test counts its own type
+struct intrusive_thread_value
+    : smart_ptr::intrusive_ref_counted< intrusive_thread_value, smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > > >
+    , counted_value< intrusive_thread_value >
+{
+    using counted_value< intrusive_thread_value >::counted_value;
+};
+
+TEST(intrusive_ptr_test, thread_counter)
+{
+    using value = intrusive_thread_value;
+    const int count = 1000;
+
+    // Objects are moved around, so no thread caches their references and the collector releases all of them
+    value::destroyed = 0;
+    std::vector< smart_ptr::intrusive_ptr< value > > pointers;
+    std::thread([&]
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            pointers.push_back(smart_ptr::make_intrusive< value >(i));
+        }
+    }).join();
+
+    pointers.clear();
+
+    check_destroyed< value::counter_type, value >(count);
+}
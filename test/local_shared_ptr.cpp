@@ -0,0 +1,139 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#include <smart_ptr/local_shared_ptr.h>
+#include <smart_ptr/detail/shared_counter.h>
+#include <smart_ptr/detail/biased_counter.h>
+#include <smart_ptr/detail/percpu_counter.h>
+#include <smart_ptr/detail/thread_counter.h>
+#include <smart_ptr/detail/thread_cache.h>
+#include <smart_ptr/detail/hazard_counter.h>
+
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+#include "counted_value.h"
+
+using local_shared_ptr_counter_types = ::testing::Types<
+    smart_ptr::shared_counter< uint64_t, true >
+    , smart_ptr::biased_counter< uint64_t >
+    , smart_ptr::percpu_counter< uint64_t >
+    , smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > >
+    , smart_ptr::hazard_counter< uint64_t >
+>;
+
+template < typename Counter > struct local_shared_ptr_test: public testing::Test
+{
+    using value = counted_value< local_shared_ptr_test< Counter > >;
+    using pointer = smart_ptr::local_shared_ptr< value, Counter >;
+    using shared_pointer = smart_ptr::shared_ptr< value, Counter >;
+
+    // Objects of earlier tests are destroyed before the count starts
+    void SetUp() override
+    {
+        flush_releases< Counter >();
+        value::destroyed = 0;
+    }
+
+    static void check_destroyed(int count) { ::check_destroyed< Counter, value >(count); }
+};
+
+TYPED_TEST_SUITE(local_shared_ptr_test, local_shared_ptr_counter_types);
+
+TYPED_TEST(local_shared_ptr_test, ctor)
+{
+    using pointer = typename TestFixture::pointer;
+    using value = typename TestFixture::value;
+    {
+        pointer p1(new value);
+        pointer p2(p1);
+        pointer p3;
+        p3 = p2;
+        pointer p4(std::move(p2));
+        ASSERT_FALSE(p2);
+        ASSERT_EQ(p3.get(), p1.get());
+        ASSERT_EQ(p4->data, 1);
+
+        smart_ptr::local_shared_ptr< int, TypeParam > member(p4, &p4->data);
+        p1.reset();
+        p3.reset();
+        p4.reset();
+        ASSERT_EQ(*member, 1);
+        ASSERT_EQ(value::destroyed, 0);
+    }
+
+    TestFixture::check_destroyed(1);
+}
+
+TYPED_TEST(local_shared_ptr_test, shared_ptr)
+{
+    using value = typename TestFixture::value;
+    using shared_pointer = typename TestFixture::shared_pointer;
+    {
+        auto p1 = smart_ptr::make_local_shared< value, TypeParam >();
+        shared_pointer s1 = p1;
+        p1.reset();
+        ASSERT_EQ(s1->data, 1);
+
+        // Shared pointer passes the object to another thread, which works with local copies of its own
+        std::thread([s1]
+        {
+            typename TestFixture::pointer p2(s1);
+            auto p3 = p2;
+            ASSERT_EQ(p3.get(), s1.get());
+        }).join();
+
+        typename TestFixture::pointer p4(std::move(s1));
+        ASSERT_FALSE(s1);
+        ASSERT_EQ(p4->data, 1);
+    }
+
+    TestFixture::check_destroyed(1);
+}
+
+// Shared counter that counts its operations
+struct counting_counter
+    : smart_ptr::shared_counter< uint64_t, true >
+{
+    static constexpr bool deferred = false;
+
+    counting_counter(void* block)
+        : smart_ptr::shared_counter< uint64_t, true >(block)
+    {}
+
+    void increment(void* block)
+    {
+        ++operations;
+        smart_ptr::shared_counter< uint64_t, true >::increment(block);
+    }
+
+    bool decrement(void* block)
+    {
+        ++operations;
+        return smart_ptr::shared_counter< uint64_t, true >::decrement(block);
+    }
+
+    static inline size_t operations;
+};
+
+TEST(local_shared_ptr_test, local_copies)
+{
+    counting_counter::operations = 0;
+    auto p = smart_ptr::make_local_shared< int, counting_counter >(1);
+    {
+        std::vector< smart_ptr::local_shared_ptr< int, counting_counter > > copies(100, p);
+        ASSERT_EQ(*copies.back(), 1);
+    }
+    ASSERT_EQ(counting_counter::operations, 0);
+
+    smart_ptr::shared_ptr< int, counting_counter > s = p;
+    ASSERT_EQ(counting_counter::operations, 1);
+
+    p.reset();
+    ASSERT_EQ(counting_counter::operations, 2);
+}
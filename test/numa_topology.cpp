@@ -0,0 +1,92 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#include <smart_ptr/detail/numa_topology.h>
+#include <smart_ptr/detail/slab_allocator.h>
+#include <smart_ptr/detail/thread_counter.h>
+
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+TEST(numa_topology_test, parse_cpulist)
+{
+    using topology = smart_ptr::numa_topology;
+    ASSERT_EQ(topology::parse_cpulist("0"), std::vector< uint32_t >({ 0 }));
+    ASSERT_EQ(topology::parse_cpulist("0-3,8,10-11\n"), std::vector< uint32_t >({ 0, 1, 2, 3, 8, 10, 11 }));
+    ASSERT_TRUE(topology::parse_cpulist("").empty());
+    ASSERT_TRUE(topology::parse_cpulist("\n").empty());
+    ASSERT_TRUE(topology::parse_cpulist("3-1").empty());
+    ASSERT_TRUE(topology::parse_cpulist("0-").empty());
+    ASSERT_TRUE(topology::parse_cpulist("a").empty());
+}
+
+#if defined(__linux__)
+TEST(numa_topology_test, read)
+{
+    char path[] = "/tmp/smart_ptr_numa_XXXXXX";
+    ASSERT_TRUE(mkdtemp(path));
+
+    // Node ids do not have to be contiguous, nodes without CPUs are left out
+    std::vector< std::pair< std::string, std::string > > nodes = { { "node2", "4-7\n" }, { "node0", "0-3\n" }, { "node3", "\n" } };
+    for (auto& [name, cpus] : nodes)
+    {
+        auto dir = std::string(path) + "/" + name;
+        ASSERT_EQ(mkdir(dir.c_str(), 0700), 0);
+        std::ofstream(dir + "/cpulist") << cpus;
+    }
+
+    auto topology = smart_ptr::numa_topology::read(path);
+
+    for (auto& [name, cpus] : nodes)
+    {
+        auto dir = std::string(path) + "/" + name;
+        std::remove((dir + "/cpulist").c_str());
+        rmdir(dir.c_str());
+    }
+    rmdir(path);
+
+    ASSERT_EQ(topology.get_node_count(), 2);
+    ASSERT_EQ(topology.get_id(0), 0);
+    ASSERT_EQ(topology.get_id(1), 2);
+    ASSERT_EQ(topology.get_cpus(1), std::vector< uint32_t >({ 4, 5, 6, 7 }));
+    ASSERT_EQ(topology.get_node(3), 0);
+    ASSERT_EQ(topology.get_node(4), 1);
+    ASSERT_EQ(topology.get_node(100), 0);
+}
+#endif
+
+TEST(numa_topology_test, single_node)
+{
+    // Systems without the directory have all CPUs in one node
+    auto topology = smart_ptr::numa_topology::read("/nonexistent");
+    ASSERT_EQ(topology.get_node_count(), 1);
+    ASSERT_EQ(topology.get_cpus(0).size(), smart_ptr::default_cpu_traits::get_cpu_count());
+    ASSERT_EQ(topology.get_current_node(), 0);
+}
+
+TEST(numa_topology_test, placement)
+{
+    auto& topology = smart_ptr::numa_topology::instance();
+    ASSERT_GE(topology.get_node_count(), 1);
+    ASSERT_LT(topology.get_current_node(), topology.get_node_count());
+
+    // Slabs and counters belong to a node of the collector, which are the nodes of the system unless configured off
+    using counter = smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > >;
+    auto p = smart_ptr::allocate_shared< int, smart_ptr::slab_allocator< int >, counter >(smart_ptr::slab_allocator< int >(), 1);
+    auto& collector = smart_ptr::collector::instance();
+    ASSERT_LT(smart_ptr::slab::get(p.get())->node, topology.get_node_count());
+    ASSERT_LT(collector.get_current_node(), collector.get_node_count());
+    ASSERT_EQ(collector.get_shard_count() % collector.get_node_count(), 0);
+}
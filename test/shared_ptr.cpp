@@ -11,20 +11,48 @@
 #endif
 
 #include <smart_ptr/shared_ptr.h>
+#include <smart_ptr/weak_ptr.h>
+#include <smart_ptr/shared_ptr_batch.h>
 #include <smart_ptr/detail/shared_counter.h>
 #include <smart_ptr/detail/biased_counter.h>
+#include <smart_ptr/detail/percpu_counter.h>
 #include <smart_ptr/detail/thread_counter.h>
 #include <smart_ptr/detail/thread_cache.h>
+#include <smart_ptr/detail/hazard_counter.h>
 
 #include <gtest/gtest.h>
+#include <chrono>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "counted_value.h"
+
+// Set by tests to simulate memory pressure, the collector clears it when it reacts
+static std::atomic< bool > memory_pressure;
+
+// Collector starts with the first thread_counter, tests run it with several shards even on small machines
+static bool collector_configured = []
+{
+    smart_ptr::collector_options options;
+    options.shards = 3;
+    options.metrics = true;
+    options.memory_pressure = [] { return memory_pressure.exchange(false); };
+    return smart_ptr::collector::configure(options);
+}();
 
 using shared_ptr_types = ::testing::Types<
     std::shared_ptr< int >
     , smart_ptr::shared_ptr< int, smart_ptr::shared_counter< uint64_t, false > >
     , smart_ptr::shared_ptr< int, smart_ptr::shared_counter< uint64_t, true > >
     , smart_ptr::shared_ptr< int, smart_ptr::biased_counter< uint64_t > >
+    , smart_ptr::shared_ptr< int, smart_ptr::percpu_counter< uint64_t > >
     , smart_ptr::shared_ptr< int, smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > > >
+    , smart_ptr::shared_ptr< int, smart_ptr::thread_counter< uint64_t, smart_ptr::lru_thread_cache< uintptr_t, uint64_t, 8 > > >
+    , smart_ptr::shared_ptr< int, smart_ptr::thread_counter< uint64_t, smart_ptr::set_associative_thread_cache< uintptr_t, uint64_t, 64 > > >
+    , smart_ptr::shared_ptr< int, smart_ptr::hazard_counter< uint64_t > >
 >;
 
 template <typename T> struct shared_ptr_test: public testing::Test {};
@@ -39,7 +67,706 @@ TYPED_TEST(shared_ptr_test, ctor)
     TypeParam p4(new int(1), [](int* ptr) { delete ptr; });   
 }
 
+// Block is the counter, a pointer to the function implementing its operations and the object or a pointer to it
+template < typename T, typename Counter, bool Storage > constexpr size_t control_block_size = sizeof(smart_ptr::control_block< T, Counter, std::allocator< T >,
+    std::conditional_t< Storage, smart_ptr::default_destructor< T >, smart_ptr::default_deleter< T > >, Storage >);
+
+static_assert(control_block_size< int, smart_ptr::shared_counter< uint32_t, true >, true > == 24);
+static_assert(control_block_size< int, smart_ptr::shared_counter< uint32_t, true >, false > == 24);
+static_assert(control_block_size< int, smart_ptr::shared_counter< uint64_t, true >, true > == 32);
+static_assert(control_block_size< int, smart_ptr::biased_counter< uint32_t, smart_ptr::std_thread_traits_uint32_t >, true > == 32);
+static_assert(control_block_size< int, smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > >, true > == 40);
+
 TEST(shared_ptr_test, make_shared)
 {
     smart_ptr::make_shared< int, smart_ptr::shared_counter< uint64_t, true > >(1);
 }
+
+// Policies that release synchronously, so destruction can be checked as soon as the last reference is gone.
+// Biased counter releases objects queued to the owner at its safe points, so tests call merge() where one is needed.
+using shared_ptr_mt_types = ::testing::Types<
+    std::shared_ptr< int >
+    , smart_ptr::shared_ptr< int, smart_ptr::shared_counter< uint64_t, true > >
+    , smart_ptr::shared_ptr< int, smart_ptr::biased_counter< uint64_t > >
+    , smart_ptr::shared_ptr< int, smart_ptr::percpu_counter< uint64_t > >
+>;
+
+template < typename Ptr, typename U > struct rebind_pointer;
+template < typename T, typename U > struct rebind_pointer< std::shared_ptr< T >, U > { using type = std::shared_ptr< U >; };
+template < typename T, typename Counter, typename U > struct rebind_pointer< smart_ptr::shared_ptr< T, Counter >, U > { using type = smart_ptr::shared_ptr< U, Counter >; };
+
+template <typename T> struct shared_ptr_mt_test: public testing::Test
+{
+    struct value
+    {
+        ~value() { ++destroyed; }
+        int data = 0;
+        static inline std::atomic< int > destroyed;
+    };
+
+    // Value is at a non-zero offset of derived and has no virtual destructor
+    struct base
+    {
+        virtual ~base() = default;
+    };
+
+    struct derived: base, value
+    {
+        ~derived() { ++destroyed; }
+        int member = 1;
+        static inline std::atomic< int > destroyed;
+    };
+
+    using pointer = typename rebind_pointer< T, value >::type;
+    using weak_pointer = typename pointer::weak_type;
+    template < typename U > using rebind = typename rebind_pointer< T, U >::type;
+
+    // std::shared_ptr takes the reference of rvalues in aliasing constructor and casts since C++20
+    static constexpr bool moves_rvalues = !std::is_same_v< T, std::shared_ptr< int > > || __cplusplus >= 202002L;
+
+    void SetUp() override { value::destroyed = 0; derived::destroyed = 0; }
+
+    static void merge() { smart_ptr::biased_merge_queue<>::instance().merge(); }
+};
+
+TYPED_TEST_SUITE(shared_ptr_mt_test, shared_ptr_mt_types);
+
+TYPED_TEST(shared_ptr_mt_test, lock)
+{
+    using value = typename TestFixture::value;
+
+    for (int iteration = 0; iteration < 100; ++iteration)
+    {
+        typename TestFixture::pointer p(new value);
+        typename TestFixture::weak_pointer w(p);
+
+        std::vector< std::thread > threads;
+        for (size_t i = 0; i < 4; ++i)
+        {
+            threads.emplace_back([p, w]() mutable
+            {
+                for (int j = 0; j < 1000; ++j)
+                {
+                    auto copy = p;
+                    auto locked = w.lock();
+                    ASSERT_TRUE(locked);
+                }
+                p.reset();
+            });
+        }
+
+        p.reset();
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        TestFixture::merge();
+        ASSERT_TRUE(w.expired());
+        ASSERT_EQ(value::destroyed, iteration + 1);
+    }
+}
+
+TYPED_TEST(shared_ptr_mt_test, release_on_workers)
+{
+    using value = typename TestFixture::value;
+    const int count = 1000;
+
+    std::vector< typename TestFixture::pointer > pointers;
+    for (int i = 0; i < count; ++i)
+    {
+        pointers.emplace_back(new value);
+    }
+
+    std::vector< std::thread > threads;
+    for (size_t i = 0; i < 4; ++i)
+    {
+        threads.emplace_back([i, pointers]() mutable
+        {
+            // Workers drop references in different order, some of them before the creating thread does
+            for (size_t j = 0; j < pointers.size(); ++j)
+            {
+                auto& p = pointers[(j * (2 * i + 1)) % pointers.size()];
+                auto copy = p;
+                p.reset();
+            }
+        });
+    }
+
+    pointers.clear();
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    TestFixture::merge();
+    ASSERT_EQ(value::destroyed, count);
+}
+
+TYPED_TEST(shared_ptr_mt_test, owner_exits)
+{
+    using value = typename TestFixture::value;
+    const int count = 1000;
+
+    std::vector< typename TestFixture::pointer > pointers;
+    std::vector< typename TestFixture::weak_pointer > weak_pointers;
+    std::thread([&]
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            pointers.emplace_back(new value);
+            weak_pointers.emplace_back(pointers.back());
+
+            // Some objects get more than one biased reference
+            if (i % 2)
+            {
+                auto copy = pointers.back();
+                pointers.push_back(copy);
+            }
+        }
+    }).join();
+
+    std::vector< std::thread > threads;
+    for (size_t i = 0; i < 2; ++i)
+    {
+        threads.emplace_back([&, i]
+        {
+            for (size_t j = i; j < pointers.size(); j += 2)
+            {
+                pointers[j].reset();
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    ASSERT_EQ(value::destroyed, count);
+    for (auto& w : weak_pointers)
+    {
+        ASSERT_TRUE(w.expired());
+        ASSERT_FALSE(w.lock());
+    }
+}
+
+TYPED_TEST(shared_ptr_mt_test, convert)
+{
+    using value = typename TestFixture::value;
+    using derived = typename TestFixture::derived;
+    using pointer = typename TestFixture::pointer;
+    using derived_pointer = typename TestFixture::template rebind< derived >;
+
+    {
+        pointer p1(new derived);
+        derived_pointer d(new derived);
+        pointer p2(d);
+        ASSERT_EQ(p2.get(), static_cast< value* >(d.get()));
+        ASSERT_NE((void*)p2.get(), (void*)d.get());
+
+        pointer p3(std::move(d));
+        ASSERT_FALSE(d);
+        ASSERT_EQ(p3.get(), p2.get());
+
+        p1 = p3;
+        ASSERT_EQ(p1.get(), p2.get());
+
+        typename TestFixture::weak_pointer w(p1);
+        p1.reset();
+        p2.reset();
+        ASSERT_EQ(w.lock().get(), p3.get());
+    }
+
+    TestFixture::merge();
+    ASSERT_EQ(derived::destroyed, 2);
+    ASSERT_EQ(value::destroyed, 2);
+}
+
+TYPED_TEST(shared_ptr_mt_test, aliasing)
+{
+    using derived = typename TestFixture::derived;
+    using derived_pointer = typename TestFixture::template rebind< derived >;
+    using int_pointer = typename TestFixture::template rebind< int >;
+
+    derived_pointer d(new derived);
+    int_pointer m1(d, &d->member);
+    int_pointer m2(std::move(d), &m1.get()[0]);
+    ASSERT_EQ(*m2, 1);
+    if constexpr (TestFixture::moves_rvalues)
+    {
+        ASSERT_FALSE(d);
+    }
+    d.reset();
+
+    // Member keeps the whole object alive
+    m1.reset();
+    TestFixture::merge();
+    ASSERT_EQ(derived::destroyed, 0);
+
+    m2.reset();
+    TestFixture::merge();
+    ASSERT_EQ(derived::destroyed, 1);
+}
+
+TYPED_TEST(shared_ptr_mt_test, cast)
+{
+    using namespace smart_ptr;
+    using namespace std;
+
+    using value = typename TestFixture::value;
+    using base = typename TestFixture::base;
+    using derived = typename TestFixture::derived;
+    using base_pointer = typename TestFixture::template rebind< base >;
+
+    {
+        base_pointer b(new derived);
+        auto d1 = static_pointer_cast< derived >(b);
+        ASSERT_EQ(d1->member, 1);
+
+        auto v = static_pointer_cast< value >(d1);
+        auto d2 = dynamic_pointer_cast< derived >(b);
+        ASSERT_EQ(d2.get(), d1.get());
+
+        auto c = const_pointer_cast< const derived >(d2);
+        ASSERT_EQ(c.get(), d1.get());
+
+        // Casts of rvalues take the reference of the source
+        auto d3 = static_pointer_cast< derived >(std::move(b));
+        ASSERT_EQ(d3.get(), d1.get());
+        if constexpr (TestFixture::moves_rvalues)
+        {
+            ASSERT_FALSE(b);
+        }
+
+        base_pointer other(new base);
+        ASSERT_FALSE(dynamic_pointer_cast< derived >(other));
+
+        // Failed cast leaves the source alone
+        auto d4 = dynamic_pointer_cast< derived >(std::move(other));
+        ASSERT_FALSE(d4);
+        ASSERT_TRUE(other);
+
+        auto d5 = dynamic_pointer_cast< derived >(base_pointer(d3));
+        ASSERT_EQ(d5.get(), d1.get());
+    }
+
+    TestFixture::merge();
+    ASSERT_EQ(derived::destroyed, 1);
+}
+
+struct thread_counter_value: counted_value< thread_counter_value > {};
+
+// Every thread gets the same id, only the first one to create an object may own objects
+struct colliding_thread_traits
+{
+    using thread_id = uint32_t;
+    static thread_id get_current_thread_id() { return 1; }
+};
+
+TEST(biased_counter_test, colliding_thread_id)
+{
+    using counter = smart_ptr::biased_counter< uint64_t, colliding_thread_traits >;
+    using pointer = smart_ptr::shared_ptr< thread_counter_value, counter >;
+    using merge_queue = smart_ptr::biased_merge_queue< colliding_thread_traits >;
+
+    thread_counter_value::destroyed = 0;
+    pointer owned(new thread_counter_value);
+    ASSERT_EQ(merge_queue::get_owner(), 1u);
+
+    std::thread([&]
+    {
+        // Thread with the id of a live owner does not own its objects, they start merged
+        pointer p(new thread_counter_value);
+        ASSERT_EQ(merge_queue::get_owner(), 0u);
+
+        auto copy = p;
+        auto other = owned;
+        p.reset();
+        copy.reset();
+        ASSERT_EQ(thread_counter_value::destroyed, 1);
+        other.reset();
+    }).join();
+
+    merge_queue::instance().merge();
+    ASSERT_EQ(thread_counter_value::destroyed, 1);
+    owned.reset();
+    ASSERT_EQ(thread_counter_value::destroyed, 2);
+}
+
+TEST(thread_counter_test, sharded_release)
+{
+    using value = thread_counter_value;
+    value::destroyed = 0;
+    using counter = smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > >;
+    const int count = 10000;
+
+    ASSERT_TRUE(collector_configured);
+    // Every NUMA node gets the same number of shards
+    auto nodes = smart_ptr::collector::instance().get_node_count();
+    ASSERT_EQ(smart_ptr::collector::instance().get_shard_count(), (3 + nodes - 1) / nodes * nodes);
+
+    std::vector< std::thread > threads;
+    for (size_t i = 0; i < 4; ++i)
+    {
+        threads.emplace_back([]
+        {
+            // Objects live long enough to spread over all shards
+            std::vector< smart_ptr::shared_ptr< value, counter > > pointers;
+            pointers.reserve(64);
+            for (int j = 0; j < count; ++j)
+            {
+                pointers.emplace_back(new value);
+                if (pointers.size() == 64)
+                {
+                    pointers.clear();
+                }
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    // Releases are asynchronous, flush waits for them
+    smart_ptr::collector::instance().flush();
+    ASSERT_EQ(value::destroyed, 4 * count);
+}
+
+TEST(thread_counter_test, full_queue)
+{
+    using value = thread_counter_value;
+    using counter = smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > >;
+    const int count = 4 * smart_ptr::collector_queue_size;
+
+    value::destroyed = 0;
+    std::thread([]
+    {
+        for (int j = 0; j < count; ++j)
+        {
+            smart_ptr::shared_ptr< value, counter > p(new value);
+        }
+
+        // Pinned thread can not drain itself
+        smart_ptr::pin_guard guard;
+        for (int j = 0; j < count; ++j)
+        {
+            smart_ptr::shared_ptr< value, counter > p(new value);
+        }
+    }).join();
+
+    smart_ptr::collector::instance().flush();
+    ASSERT_EQ(value::destroyed, 2 * count);
+}
+
+TEST(thread_counter_test, bounded_lag)
+{
+    using value = thread_counter_value;
+    using counter = smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > >;
+    const int count = 4 * smart_ptr::collector_queue_size;
+    const size_t limit = 64;
+
+    auto& collector = smart_ptr::collector::instance();
+    collector.set_max_pending_messages(limit);
+
+    value::destroyed = 0;
+    std::thread([&]
+    {
+        auto bound = limit * collector.get_shard_count();
+        for (int j = 0; j < count; ++j)
+        {
+            smart_ptr::shared_ptr< value, counter > p(new value);
+            ASSERT_LE(collector.get_pending_messages(), bound);
+        }
+
+        // Pinned thread waits for the collector instead of helping
+        smart_ptr::pin_guard guard;
+        for (int j = 0; j < count; ++j)
+        {
+            smart_ptr::shared_ptr< value, counter > p(new value);
+            ASSERT_LE(collector.get_pending_messages(), bound);
+        }
+    }).join();
+
+    collector.set_max_pending_messages(0);
+
+    collector.flush();
+    ASSERT_EQ(value::destroyed, 2 * count);
+}
+
+TEST(thread_counter_test, flush)
+{
+    using counter = smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > >;
+    struct value: thread_counter_value
+    {
+        smart_ptr::shared_ptr< thread_counter_value, counter > child;
+    };
+
+    const int count = 1000;
+    auto& collector = smart_ptr::collector::instance();
+    collector.flush();
+    value::destroyed = 0;
+
+    std::vector< std::thread > threads;
+    for (size_t i = 0; i < 2; ++i)
+    {
+        threads.emplace_back([&]
+        {
+            for (int j = 0; j < count; ++j)
+            {
+                smart_ptr::shared_ptr< value, counter > p(new value);
+                p->child = smart_ptr::shared_ptr< thread_counter_value, counter >(new thread_counter_value);
+            }
+
+            // Children are released by destructors of their parents on the flushing thread
+            collector.flush();
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    ASSERT_EQ(value::destroyed, 2 * 2 * count);
+}
+
+TEST(thread_counter_test, flush_thread_cache)
+{
+    using value = thread_counter_value;
+    using counter = smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > >;
+
+    auto& collector = smart_ptr::collector::instance();
+    collector.flush();
+    value::destroyed = 0;
+
+    // References released by copies stay in the cache of this thread, as it still holds the copy it passed away
+    smart_ptr::shared_ptr< value, counter > passed;
+    {
+        smart_ptr::shared_ptr< value, counter > p(new value);
+        for (int i = 0; i < 10; ++i)
+        {
+            auto copy = p;
+        }
+
+        passed = p;
+    }
+
+    std::thread([&] { passed.reset(); }).join();
+    collector.flush();
+    ASSERT_EQ(value::destroyed, 1);
+}
+
+TEST(thread_counter_test, memory_pressure)
+{
+    auto& collector = smart_ptr::collector::instance();
+    auto before = collector.get_metrics().pressure_drains;
+    memory_pressure = true;
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (collector.get_metrics().pressure_drains == before && std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::yield();
+    }
+
+    ASSERT_GT(collector.get_metrics().pressure_drains, before);
+    ASSERT_FALSE(memory_pressure);
+}
+
+TEST(thread_counter_test, thread_exit)
+{
+    using value = thread_counter_value;
+    using counter = smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > >;
+
+    value::destroyed = 0;
+    smart_ptr::shared_ptr< value, counter > p(new value);
+    std::thread([&]
+    {
+        // References released by copies stay in the cache of the thread until it exits
+        for (int i = 0; i < 10; ++i)
+        {
+            auto copy = p;
+        }
+    }).join();
+
+    std::thread([]
+    {
+        // Constructed before the producer of the thread, so it is destroyed after the producer is released
+        static thread_local smart_ptr::shared_ptr< value, counter > late;
+        late = smart_ptr::shared_ptr< value, counter >(new value);
+        auto copy = late;
+    }).join();
+
+    p.reset();
+
+    smart_ptr::collector::instance().flush();
+    ASSERT_EQ(value::destroyed, 2);
+}
+
+TEST(thread_counter_test, metrics)
+{
+    using value = thread_counter_value;
+    using counter = smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > >;
+
+    value::destroyed = 0;
+    auto& collector = smart_ptr::collector::instance();
+    auto before = collector.get_metrics();
+
+    std::thread([]
+    {
+        // Released copies leave their references in the slot of p, the following copies reuse them.
+        // Cached references are returned to the collector together with p.
+        smart_ptr::shared_ptr< int, counter > p(new int);
+        for (int i = 0; i < 100; ++i)
+        {
+            auto copy = p;
+        }
+
+        smart_ptr::shared_ptr< value, counter > released(new value);
+    }).join();
+
+    collector.flush();
+    ASSERT_EQ(value::destroyed, 1);
+
+    auto after = collector.get_metrics();
+    EXPECT_GE(after.cache_hits - before.cache_hits, 198u);
+    EXPECT_GE(after.pushed - before.pushed, 2u);
+    EXPECT_GE(after.released - before.released, 1u);
+    EXPECT_GE(after.table_bytes, smart_ptr::collector_table_size * 16);
+    EXPECT_GT(after.rounds, before.rounds);
+    EXPECT_GE(after.messages, after.rounds);
+    EXPECT_EQ(after.batch_sizes.count(), after.rounds);
+    EXPECT_EQ(after.drain_latency.count(), after.rounds);
+    EXPECT_EQ(after.release_latency.count(), after.released);
+    EXPECT_GE(after.release_latency.quantile(1.0), after.release_latency.quantile(0.5));
+}
+
+TEST(thread_counter_test, set_metrics)
+{
+    using counter = smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > >;
+
+    auto& collector = smart_ptr::collector::instance();
+    auto before = collector.get_metrics();
+    collector.set_metrics(false);
+    ASSERT_EQ(collector.get_metrics().rounds, 0u);
+
+    // References served by the cache are not counted while metrics are disabled
+    {
+        smart_ptr::shared_ptr< int, counter > p(new int);
+        for (int i = 0; i < 2; ++i)
+        {
+            auto copy = p;
+        }
+    }
+
+    collector.set_metrics(true);
+    auto after = collector.get_metrics();
+    ASSERT_GE(after.rounds, before.rounds);
+    ASSERT_EQ(after.cache_hits, before.cache_hits);
+}
+
+// A thread keeps references it released only while it holds a reference it took itself. A copy passed to other thread
+// still counts as held, so references cached for it are returned when newer pointers evict its slot.
+template < typename Counter > static void check_eviction()
+{
+    using value = thread_counter_value;
+
+    value::destroyed = 0;
+    smart_ptr::shared_ptr< value, Counter > p(new value);
+    smart_ptr::weak_ptr< value, Counter > w(p);
+    smart_ptr::shared_ptr< value, Counter > passed;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool evicted = false;
+    bool checked = false;
+
+    std::thread thread([&]
+    {
+        auto copy = p;
+        for (int i = 0; i < 10; ++i)
+        {
+            auto tmp = copy;
+        }
+
+        passed = std::move(copy);
+
+        static smart_ptr::shared_ptr< int, Counter > p1(new int(1));
+        static smart_ptr::shared_ptr< int, Counter > p2(new int(2));
+        auto copy1 = p1;
+        auto copy2 = p2;
+
+        // Thread keeps running, so its cache is not flushed
+        std::unique_lock< std::mutex > lock(mutex);
+        evicted = true;
+        cv.notify_all();
+        cv.wait(lock, [&] { return checked; });
+    });
+
+    {
+        std::unique_lock< std::mutex > lock(mutex);
+        cv.wait(lock, [&] { return evicted; });
+    }
+
+    p.reset();
+    passed.reset();
+    smart_ptr::collector::instance().flush();
+    EXPECT_EQ(value::destroyed, 1);
+    EXPECT_TRUE(w.expired());
+
+    {
+        std::lock_guard< std::mutex > lock(mutex);
+        checked = true;
+    }
+
+    cv.notify_all();
+    thread.join();
+}
+
+TEST(thread_counter_test, lru_eviction)
+{
+    check_eviction< smart_ptr::thread_counter< uint64_t, smart_ptr::lru_thread_cache< uintptr_t, uint64_t, 2 > > >();
+}
+
+TEST(thread_counter_test, set_associative_eviction)
+{
+    check_eviction< smart_ptr::thread_counter< uint64_t, smart_ptr::set_associative_thread_cache< uintptr_t, uint64_t, 1, 2 > > >();
+}
+
+using thread_counter_types = ::testing::Types<
+    smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > >
+    , smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache2< uintptr_t, uint64_t, 8 > >
+    , smart_ptr::thread_counter< uint64_t, smart_ptr::lru_thread_cache< uintptr_t, uint64_t, 8 > >
+    , smart_ptr::thread_counter< uint64_t, smart_ptr::set_associative_thread_cache< uintptr_t, uint64_t, 64 > >
+>;
+
+template < typename T > struct thread_counter_cache_test: public testing::Test {};
+TYPED_TEST_SUITE(thread_counter_cache_test, thread_counter_types);
+
+TYPED_TEST(thread_counter_cache_test, last_release)
+{
+    using value = thread_counter_value;
+    using pointer = smart_ptr::shared_ptr< value, TypeParam >;
+
+    // Caches that do not evict used to keep the first objects of a thread alive through references of their copies
+    value::destroyed = 0;
+    for (int i = 0; i < 100; ++i)
+    {
+        pointer p(new value);
+        pointer q(p);
+        for (int j = 0; j < 10; ++j)
+        {
+            pointer tmp(q);
+        }
+
+        // Bulk operations keep the same count
+        std::vector< pointer > copies;
+        smart_ptr::copy_n(q, 3, std::back_inserter(copies));
+        smart_ptr::release_range(copies.begin(), copies.end());
+    }
+
+    smart_ptr::collector::instance().flush();
+    ASSERT_EQ(value::destroyed, 100);
+}
@@ -0,0 +1,245 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#include <smart_ptr/shared_ptr_batch.h>
+#include <smart_ptr/detail/shared_counter.h>
+#include <smart_ptr/detail/biased_counter.h>
+#include <smart_ptr/detail/percpu_counter.h>
+#include <smart_ptr/detail/thread_counter.h>
+#include <smart_ptr/detail/thread_cache.h>
+#include <smart_ptr/detail/hazard_counter.h>
+
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+#include "counted_value.h"
+
+using shared_ptr_batch_counter_types = ::testing::Types<
+    smart_ptr::shared_counter< uint64_t, false >
+    , smart_ptr::shared_counter< uint64_t, true >
+    , smart_ptr::biased_counter< uint64_t >
+    , smart_ptr::percpu_counter< uint64_t >
+    , smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > >
+    , smart_ptr::hazard_counter< uint64_t >
+>;
+
+template < typename Counter > struct shared_ptr_batch_test: public testing::Test
+{
+    using value = counted_value< shared_ptr_batch_test< Counter > >;
+    using pointer = smart_ptr::shared_ptr< value, Counter >;
+
+    // Objects of earlier tests are destroyed before the count starts
+    void SetUp() override
+    {
+        flush_releases< Counter >();
+        value::destroyed = 0;
+    }
+
+    static void check_destroyed(int count) { ::check_destroyed< Counter, value >(count); }
+};
+
+TYPED_TEST_SUITE(shared_ptr_batch_test, shared_ptr_batch_counter_types);
+
+TYPED_TEST(shared_ptr_batch_test, copy_n)
+{
+    using pointer = typename TestFixture::pointer;
+    using value = typename TestFixture::value;
+
+    std::vector< pointer > pointers;
+    {
+        pointer p(new value);
+        smart_ptr::copy_n(p, 1000, std::back_inserter(pointers));
+        ASSERT_EQ(pointers.size(), 1000);
+        ASSERT_EQ(pointers.back().get(), p.get());
+    }
+
+    // References of the copies were counted, the object is alive until the last copy is gone
+    pointers.resize(1);
+    TestFixture::check_destroyed(0);
+
+    smart_ptr::release_range(pointers.begin(), pointers.end());
+    ASSERT_FALSE(pointers[0]);
+    TestFixture::check_destroyed(1);
+}
+
+TYPED_TEST(shared_ptr_batch_test, copy_n_counted)
+{
+    using pointer = typename TestFixture::pointer;
+    using value = typename TestFixture::value;
+
+    // Writes copies and drops the source after the first one, so only the copies keep the object alive
+    struct release_source
+    {
+        pointer& source;
+        std::vector< pointer >& copies;
+
+        release_source& operator * () { return *this; }
+        release_source& operator ++ (int) { return *this; }
+        release_source& operator = (pointer copy)
+        {
+            copies.push_back(std::move(copy));
+            source.reset();
+            return *this;
+        }
+    };
+
+    pointer p(new value);
+    std::vector< pointer > copies;
+    smart_ptr::copy_n(p, 3, release_source{ p, copies });
+    ASSERT_FALSE(p);
+    ASSERT_EQ(copies.size(), 3);
+    TestFixture::check_destroyed(0);
+
+    copies.clear();
+    TestFixture::check_destroyed(1);
+}
+
+TYPED_TEST(shared_ptr_batch_test, release_range)
+{
+    using pointer = typename TestFixture::pointer;
+    using value = typename TestFixture::value;
+
+    // More objects than the batch holds, their copies interleaved
+    const int count = 100;
+    std::vector< pointer > objects;
+    for (int i = 0; i < count; ++i)
+    {
+        objects.emplace_back(new value);
+    }
+
+    std::vector< pointer > pointers;
+    for (int i = 0; i < 10; ++i)
+    {
+        pointers.insert(pointers.end(), objects.begin(), objects.end());
+    }
+
+    smart_ptr::release_range(objects.begin(), objects.end());
+    TestFixture::check_destroyed(0);
+
+    smart_ptr::release_range(pointers.begin(), pointers.end());
+    TestFixture::check_destroyed(count);
+}
+
+TYPED_TEST(shared_ptr_batch_test, coalesce)
+{
+    using pointer = typename TestFixture::pointer;
+    using value = typename TestFixture::value;
+
+    pointer p(new value);
+    {
+        smart_ptr::shared_ptr_batch< TypeParam > batch;
+        auto copy1 = batch.copy(p);
+        batch.release(p);
+        ASSERT_FALSE(p);
+
+        // Copy takes over the reference released by p, flush releases the one of copy1
+        auto copy2 = batch.copy(copy1);
+        batch.release(copy1);
+        batch.flush();
+        ASSERT_FALSE(copy1);
+        ASSERT_TRUE(copy2);
+        TestFixture::check_destroyed(0);
+    }
+
+    TestFixture::check_destroyed(1);
+}
+
+TYPED_TEST(shared_ptr_batch_test, copy_released_before_flush)
+{
+    using pointer = typename TestFixture::pointer;
+    using value = typename TestFixture::value;
+
+    // Copies are counted when the batch returns them, so they can be destroyed before the flush
+    pointer p(new value);
+    smart_ptr::shared_ptr_batch< TypeParam > batch;
+    {
+        auto copy = batch.copy(p);
+    }
+    TestFixture::check_destroyed(0);
+
+    auto q = p;
+    batch.release(q);
+    {
+        auto copy = batch.copy(p);
+    }
+    TestFixture::check_destroyed(0);
+
+    batch.flush();
+    TestFixture::check_destroyed(0);
+    p.reset();
+    TestFixture::check_destroyed(1);
+}
+
+// Shared counter that counts its operations
+struct batch_counting_counter
+    : smart_ptr::shared_counter< uint64_t, true >
+{
+    using base = smart_ptr::shared_counter< uint64_t, true >;
+
+    batch_counting_counter(void* block)
+        : base(block)
+    {}
+
+    void increment(void* block)
+    {
+        ++operations;
+        base::increment(block);
+    }
+
+    void increment(void* block, uint64_t refs)
+    {
+        ++operations;
+        base::increment(block, refs);
+    }
+
+    bool decrement(void* block)
+    {
+        ++operations;
+        return base::decrement(block);
+    }
+
+    bool decrement(void* block, uint64_t refs)
+    {
+        ++operations;
+        return base::decrement(block, refs);
+    }
+
+    static inline size_t operations;
+};
+
+TEST(shared_ptr_batch_test, operations)
+{
+    using pointer = smart_ptr::shared_ptr< int, batch_counting_counter >;
+
+    pointer p1(new int(1));
+    pointer p2(new int(2));
+    batch_counting_counter::operations = 0;
+
+    std::vector< pointer > pointers;
+    smart_ptr::copy_n(p1, 100, std::back_inserter(pointers));
+    smart_ptr::copy_n(p2, 100, std::back_inserter(pointers));
+    ASSERT_EQ(batch_counting_counter::operations, 2);
+
+    // One decrement per block, the last one releases it
+    pointers.push_back(std::move(p1));
+    pointers.push_back(std::move(p2));
+    smart_ptr::release_range(pointers.begin(), pointers.end());
+    ASSERT_EQ(batch_counting_counter::operations, 4);
+
+    // Copies take over references released to the batch, only the rest updates the count
+    pointer p3(new int(3));
+    auto p4 = p3;
+    batch_counting_counter::operations = 0;
+    {
+        smart_ptr::shared_ptr_batch< batch_counting_counter > batch;
+        batch.release(p4);
+        auto copy1 = batch.copy(p3);
+        auto copy2 = batch.copy(p3);
+        ASSERT_EQ(batch_counting_counter::operations, 1);
+    }
+}
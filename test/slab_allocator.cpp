@@ -0,0 +1,160 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#include <smart_ptr/detail/slab_allocator.h>
+#include <smart_ptr/shared_ptr.h>
+#include <smart_ptr/detail/shared_counter.h>
+#include <smart_ptr/detail/thread_counter.h>
+
+#include <gtest/gtest.h>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "counted_value.h"
+
+// Each test uses its own size class, so blocks left by other tests do not interfere
+template < size_t Size > struct slab_value
+{
+    char data[Size];
+};
+
+// Number of blocks that fill count slabs of the size
+template < typename T > static size_t get_slab_blocks(size_t count)
+{
+    return (smart_ptr::slab_size - sizeof(smart_ptr::slab)) / sizeof(T) * count;
+}
+
+TEST(slab_allocator_test, allocate_deallocate)
+{
+    smart_ptr::slab_allocator< slab_value< 100 > > allocator;
+    std::set< void* > blocks;
+    std::set< smart_ptr::slab* > slabs;
+    for (size_t i = 0; i < 1000; ++i)
+    {
+        auto ptr = allocator.allocate(1);
+        ASSERT_EQ((uintptr_t)ptr % 16, 0);
+        ASSERT_EQ(smart_ptr::slab::get(ptr)->size, 112);
+        ASSERT_TRUE(blocks.insert(ptr).second);
+        slabs.insert(smart_ptr::slab::get(ptr));
+    }
+
+    for (auto ptr : blocks)
+    {
+        allocator.deallocate((slab_value< 100 >*)ptr, 1);
+    }
+
+    // Freed blocks are reused before new slabs are taken
+    blocks.clear();
+    for (size_t i = 0; i < 1000; ++i)
+    {
+        auto ptr = allocator.allocate(1);
+        ASSERT_EQ(slabs.count(smart_ptr::slab::get(ptr)), 1);
+        ASSERT_TRUE(blocks.insert(ptr).second);
+    }
+
+    for (auto ptr : blocks)
+    {
+        allocator.deallocate((slab_value< 100 >*)ptr, 1);
+    }
+}
+
+TEST(slab_allocator_test, large)
+{
+    smart_ptr::slab_allocator< char > allocator;
+    auto ptr = allocator.allocate(smart_ptr::slab_max_size + 1);
+    ptr[smart_ptr::slab_max_size] = 1;
+    allocator.deallocate(ptr, smart_ptr::slab_max_size + 1);
+}
+
+TEST(slab_allocator_test, remote_deallocate)
+{
+    using value = slab_value< 496 >;
+    smart_ptr::slab_allocator< value > allocator;
+
+    std::vector< value* > blocks;
+    for (size_t i = 0; i < get_slab_blocks< value >(4); ++i)
+    {
+        blocks.push_back(allocator.allocate(1));
+    }
+
+    // Blocks come back to the slabs of this thread, the thread returns what remained batched when it exits
+    std::thread([&]
+    {
+        for (auto ptr : blocks)
+        {
+            allocator.deallocate(ptr, 1);
+        }
+    }).join();
+
+    std::set< value* > allocated(blocks.begin(), blocks.end());
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+        ASSERT_EQ(allocated.count(allocator.allocate(1)), 1);
+    }
+}
+
+TEST(slab_allocator_test, thread_exit)
+{
+    using value = slab_value< 480 >;
+    smart_ptr::slab_allocator< value > allocator;
+
+    std::vector< value* > blocks;
+    std::thread([&]
+    {
+        for (size_t i = 0; i < get_slab_blocks< value >(4); ++i)
+        {
+            blocks.push_back(allocator.allocate(1));
+        }
+    }).join();
+
+    for (auto ptr : blocks)
+    {
+        allocator.deallocate(ptr, 1);
+    }
+
+    smart_ptr::flush_slab_allocator();
+
+    // Slabs of the exited thread are adopted by the next thread that needs their size
+    std::set< value* > allocated(blocks.begin(), blocks.end());
+    std::thread([&]
+    {
+        for (size_t i = 0; i < blocks.size(); ++i)
+        {
+            ASSERT_EQ(allocated.count(allocator.allocate(1)), 1);
+        }
+    }).join();
+}
+
+struct slab_counted_value: counted_value< slab_counted_value > {};
+
+TEST(slab_allocator_test, allocate_shared)
+{
+    using counter = smart_ptr::shared_counter< uint64_t, true >;
+    auto p = smart_ptr::allocate_shared< int, smart_ptr::slab_allocator< int >, counter >(smart_ptr::slab_allocator< int >(), 1);
+    ASSERT_EQ(*p, 1);
+    ASSERT_NE(smart_ptr::slab::get(p.get())->owner.load(), nullptr);
+}
+
+TEST(slab_allocator_test, thread_counter)
+{
+    using value = slab_counted_value;
+    using counter = smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > >;
+    using allocator = smart_ptr::slab_allocator< value >;
+
+    // Control blocks are freed by the collector and returned to the slabs of the thread that created them
+    value::destroyed = 0;
+    std::thread([&]
+    {
+        for (size_t i = 0; i < 1000; ++i)
+        {
+            smart_ptr::allocate_shared< value, allocator, counter >(allocator());
+        }
+    }).join();
+
+    check_destroyed< counter, value >(1000);
+}
@@ -0,0 +1,133 @@
+//
+// This file is part of smart_ptr project <https://github.com/romanpauk/smart_ptr>
+//
+// See LICENSE for license and copyright information
+// SPDX-License-Identifier: AGPL-3.0-or-later
+//
+
+#if defined(_WIN32)
+    // TODO: move to cmake
+    #define _ENABLE_EXTENDED_ALIGNED_STORAGE // Specifically enable standard behavior
+#endif
+
+#include <smart_ptr/shared_ptr.h>
+#include <smart_ptr/weak_ptr.h>
+#include <smart_ptr/detail/shared_counter.h>
+#include <smart_ptr/detail/biased_counter.h>
+#include <smart_ptr/detail/percpu_counter.h>
+#include <smart_ptr/detail/thread_counter.h>
+#include <smart_ptr/detail/thread_cache.h>
+#include <smart_ptr/detail/hazard_counter.h>
+
+#include <gtest/gtest.h>
+#include <memory>
+
+// Counters that release synchronously, so expiration is observable right after the last reset
+using weak_ptr_types = ::testing::Types<
+    std::shared_ptr< int >
+    , smart_ptr::shared_ptr< int, smart_ptr::shared_counter< uint64_t, false > >
+    , smart_ptr::shared_ptr< int, smart_ptr::shared_counter< uint64_t, true > >
+    , smart_ptr::shared_ptr< int, smart_ptr::biased_counter< uint64_t > >
+    , smart_ptr::shared_ptr< int, smart_ptr::percpu_counter< uint64_t > >
+    , smart_ptr::shared_ptr< int, smart_ptr::hazard_counter< uint64_t > >
+>;
+
+template < typename Ptr, typename U > struct rebind_pointer;
+template < typename T, typename U > struct rebind_pointer< std::shared_ptr< T >, U > { using type = std::shared_ptr< U >; };
+template < typename T, typename Counter, typename U > struct rebind_pointer< smart_ptr::shared_ptr< T, Counter >, U > { using type = smart_ptr::shared_ptr< U, Counter >; };
+
+template <typename T> struct weak_ptr_test: public testing::Test {};
+TYPED_TEST_SUITE(weak_ptr_test, weak_ptr_types);
+
+TYPED_TEST(weak_ptr_test, lock)
+{
+    using weak_ptr = typename TypeParam::weak_type;
+
+    TypeParam p1(new int(1));
+    weak_ptr w1(p1);
+    weak_ptr w2 = w1;
+    ASSERT_FALSE(w1.expired());
+
+    auto p2 = w2.lock();
+    ASSERT_TRUE(p2);
+    ASSERT_EQ(*p2, 1);
+
+    p1.reset();
+    ASSERT_FALSE(w1.expired());
+    p2.reset();
+    ASSERT_TRUE(w1.expired());
+    ASSERT_TRUE(w2.expired());
+    ASSERT_FALSE(w1.lock());
+}
+
+TYPED_TEST(weak_ptr_test, outlives_object)
+{
+    using weak_ptr = typename TypeParam::weak_type;
+
+    weak_ptr w;
+    {
+        TypeParam p(new int(1));
+        w = p;
+        weak_ptr w2(std::move(w));
+        w = w2;
+    }
+    ASSERT_TRUE(w.expired());
+    ASSERT_FALSE(w.lock());
+}
+
+struct virtual_base
+{
+    virtual ~virtual_base() = default;
+    int base = 1;
+};
+
+struct virtual_derived: virtual virtual_base
+{
+    int derived = 2;
+};
+
+TYPED_TEST(weak_ptr_test, convert_virtual_base)
+{
+    using derived_pointer = typename rebind_pointer< TypeParam, virtual_derived >::type;
+    using derived_weak_ptr = typename derived_pointer::weak_type;
+    using base_weak_ptr = typename rebind_pointer< TypeParam, virtual_base >::type::weak_type;
+
+    derived_pointer p(new virtual_derived);
+    derived_weak_ptr w(p);
+
+    base_weak_ptr alive(w);
+    ASSERT_EQ(alive.lock().get(), static_cast< virtual_base* >(p.get()));
+
+    // Offset of the virtual base is stored in the destroyed object
+    p.reset();
+    ASSERT_TRUE(w.expired());
+    base_weak_ptr expired(w);
+    ASSERT_TRUE(expired.expired());
+    ASSERT_FALSE(expired.lock());
+}
+
+TEST(weak_ptr_test, make_shared)
+{
+    using counter = smart_ptr::shared_counter< uint64_t, true >;
+
+    smart_ptr::weak_ptr< int, counter > w;
+    {
+        auto p = smart_ptr::make_shared< int, counter >(1);
+        w = p;
+        ASSERT_EQ(*w.lock(), 1);
+    }
+    ASSERT_TRUE(w.expired());
+}
+
+TEST(weak_ptr_test, thread_counter)
+{
+    using counter = smart_ptr::thread_counter< uint64_t, smart_ptr::thread_cache< uintptr_t, uint64_t, 8 > >;
+
+    smart_ptr::shared_ptr< int, counter > p(new int(1));
+    smart_ptr::weak_ptr< int, counter > w(p);
+    ASSERT_FALSE(w.expired());
+
+    auto p2 = w.lock();
+    ASSERT_TRUE(p2);
+    ASSERT_EQ(*p2, 1);
+}